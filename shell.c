@@ -1,8 +1,12 @@
+#define _GNU_SOURCE // for SCHED_BATCH and the CPU_* affinity macros
 #include "ascii_art.h"
 #include <stdio.h>
+#include <stdarg.h>
+#include <limits.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <termios.h>
@@ -12,9 +16,20 @@
 #include <errno.h>
 #include <ctype.h>
 #include <signal.h>
-#include <glob.h>
 #include <pthread.h>
 #include <sys/ioctl.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <math.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/file.h>
+#include <libgen.h>
+#include <pwd.h>
 
 /**
  * @file shell.c
@@ -28,16 +43,55 @@
  * * Command History: Stores and allows users to recall previously entered commands.
  * Inline Command Completion: Provides suggestions and auto-completion
  * as the user types commands.
- * Pathname Expansion (Globbing): Supports wildcard characters (*, ?)
- * to specify multiple files in a single command.
+ * Pathname Expansion (Globbing): Supports wildcard characters (*, ?, [...])
+ * and '**' for any depth of directories (read by parallel threads) to
+ * specify multiple files in a single command, with each directory listed at
+ * most once per command.
  * Input/Output Redirection: Allows users to redirect standard input,
- * standard output, and standard error streams.
+ * standard output, and standard error streams, duplicate and close file
+ * descriptors, in plain commands and in every stage of a pipeline.
  * Piping: Enables chaining multiple commands together, where the
  * output of one command becomes the input of the next.
  * Background Execution: Supports running commands in the background,
  * allowing users to continue using the shell while commands execute.
  * Delayed Command Execution: Schedules commands to be executed at a
- * specified time in the future.
+ * specified time in the future, kept in a min-heap with no fixed limit.
+ * With 'NORSEISH_JOURNAL' set, they are journaled and survive restarts.
+ * Delayed Queue Control: 'delayq' lists queued commands by job ID, and
+ * 'delayrm' and 'delaymv' cancel or reschedule them.
+ * Job Dependencies: 'delay --after ID cmd' runs cmd once job ID has finished
+ * ('--after-ok ID': only if it succeeded).
+ * Delayed Job Classes: '--priority high|normal|low' orders due commands, and
+ * '--queue NAME' groups them in named queues limited with 'delayqueue'.
+ * Scheduler Metrics: 'delaystats' reports dispatch lateness, the delay until
+ * a worker starts a command, throughput, high-water marks and lock contention.
+ * 'delaybench' stress-tests the scheduler with up to millions of stubbed-out
+ * timers, inserted by one or many threads, and reports the same figures.
+ * Delayed Job Logs: the output of every delayed command goes to a rotating,
+ * size-capped log per job instead of the terminal; 'delaylog ID' tails it.
+ * Batch Commands: 'batch' and 'delay --batch' start only when the load
+ * average and memory and I/O pressure are low ('batchload').
+ * Recurring Commands: 'every 5m cmd' and cron schedules ('cron 0 9 * * mon-fri cmd')
+ * run commands repeatedly from the same scheduler.
+ * Exit Status Tracking: Exposes '$?' and 'PIPESTATUS', and supports
+ * 'set -e' and 'set -o pipefail' for scripts that must fail fast.
+ * Script Mode: Runs commands from a script file or non-terminal stdin.
+ * Timing: The 'time' keyword reports wall-clock time, CPU time, memory,
+ * page faults and context switches for each stage of a pipeline.
+ * Benchmarking: The 'bench' built-in runs commands repeatedly and reports
+ * timing statistics, exportable as CSV or JSON.
+ * Supervision: The 'timeout' built-in enforces deadlines, retries failed
+ * commands with exponential backoff and restarts supervised ones.
+ * Job Priorities: Background and delayed jobs run with a lower CPU and I/O
+ * priority ('bgprio'), and any job can set its own with the 'prio' prefix.
+ * CPU Affinity: The 'cpus' prefix pins a job or individual pipeline stages
+ * to CPUs, or spreads the stages across the allowed CPUs.
+ * Resource Limits: 'ulimit' sets limits for the shell, and the 'limit'
+ * prefix for a single job, so runaway jobs cannot exhaust the host.
+ * Parallel Jobs: The 'parallel' built-in runs a command for many arguments
+ * with bounded concurrency, without interleaving the jobs' output.
+ * Fork Server: With '--fork-server', a small helper process started before
+ * any thread creates the shell's children, passed descriptors over a socket.
  * Signal Handling: Implements robust signal handling for 'SIGINT',
  * 'SIGCHLD', and other signals to ensure proper shell behavior.
  * Built-in Commands: Includes implementations of common shell built-in
@@ -47,7 +101,8 @@
  * and other data structures.
  * Terminal Interaction: Utilizes 'termios' functions for advanced
  * terminal control, including disabling input buffering and echoing.
- * Multi-threading: Uses POSIX threads for delayed command execution.
+ * Multi-threading: Uses POSIX threads for delayed command execution: a
+ * scheduler thread hands due commands to a pool of workers ('delayworkers').
  *
  * The shell is designed to be a powerful and user-friendly alternative to
  * traditional Unix shells, with a focus on interactive features and
@@ -75,6 +130,7 @@
  * cat < input.txt > output.txt (input/output redirection)
  * ls -l | grep "myfile" (piping)
  * delay 10 echo thoughts (delayed execution)
+ * delay 250ms echo soon, delay --at 14:30 echo lunch (sub-second and timed)
  * ls * (globbing)
  *
  * @section Sources
@@ -97,18 +153,393 @@
 #define MAX_ARGS 25
 #define MAX_ALIASES 100
 
+/**
+ * When a recurring command ('every' or 'cron') fires. An 'every' schedule
+ * has an interval; a cron schedule has one bit per allowed value of each
+ * field, so the next firing time is found by jumping between set bits.
+ */
 typedef struct {
-    time_t scheduled_time;
-    char command[MAX_COMMAND_LENGTH];
+    int64_t interval;   // 'every': nanoseconds between runs; 0 for cron
+    uint64_t minutes;   // bits 0-59
+    uint32_t hours;     // bits 0-23
+    uint32_t days;      // day of the month, bits 1-31
+    uint16_t months;    // bits 1-12
+    uint8_t weekdays;   // bits 0-6, Sunday is 0
+    int any_day;        // the day-of-month field is '*'
+    int any_weekday;    // the day-of-week field is '*'
+    char *spec;         // as typed, e.g. "every 5m" or "cron */15 * * * *"; malloc'd
+} RecurringSchedule;
+
+/**
+ * A dependency between delayed commands ('delay --after'): the job 'id' runs
+ * after another one has finished or, with 'on_success', only if it succeeded.
+ */
+typedef struct {
+    long id;
+    int on_success;
+} DelayedEdge;
+
+#define MAX_DEPENDENCIES 8  // '--after' options of one command
+#define DELAYED_HELD INT64_MAX  // deadline of a command waiting for others
+
+/**
+ * A command waiting in the delayed queue. Commands live in a slot array and
+ * are referred to by their slot; free slots are chained through 'next_free'.
+ * A one-off command keeps its slot (off the heap, 'heap_index' -1) while it
+ * runs, so commands can still be made to wait for it.
+ */
+typedef struct {
+    long id;            // stable job ID, unique across restarts when journaled
+    int64_t deadline;   // nanoseconds on CLOCK_MONOTONIC
+    time_t wall_time;   // for 'delay --at': the wall-clock time, else 0
+    char *command;
+    RecurringSchedule *schedule; // NULL for a one-off command
+    int batch;          // started only when the system is not busy (see 'BatchPolicy')
+    int priority;       // PRIORITY_*
+    int queue;          // named queue (see 'NamedQueue'), 0 for "default"
+    int batch_attempts; // times the command was deferred
+    int64_t batch_since; // when it was first deferred
+    DelayedEdge *dependents; // commands waiting for this one
+    int dependent_count;
+    int dependent_capacity;
+    DelayedEdge after[MAX_DEPENDENCIES]; // commands this one waits for; id 0 once finished
+    int after_count;
+    int waiting;        // of 'after', those not finished yet
+    int heap_index;     // position of the command's handle in the heap
+    int next_free;
 } DelayedCommand;
 
-#define MAX_DELAYED_COMMANDS 100
-DelayedCommand delayed_commands[MAX_DELAYED_COMMANDS];
-int delayed_command_count = 0;
-pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+/**
+ * A heap entry: the deadline and priority are copied next to the slot so the
+ * heap can be ordered without touching the commands themselves. Commands
+ * due at the same time come out in priority order.
+ */
+typedef struct {
+    int64_t deadline;
+    int slot;
+    int priority;
+} DelayedHandle;
+
+/**
+ * Priority classes of delayed commands ('delay --priority'). Among due
+ * commands, workers always start the highest class first.
+ */
+#define PRIORITY_HIGH 0
+#define PRIORITY_NORMAL 1
+#define PRIORITY_LOW 2
+#define PRIORITY_CLASSES 3
+
+/**
+ * A due command waiting for a worker (see 'ReadyQueue').
+ */
+typedef struct ReadyCommand {
+    long id;
+    long sequence;      // dispatch order
+    int64_t dispatched; // when the scheduler handed it over
+    int priority;
+    int queue;
+    int recurring;
+    char *command;
+    struct ReadyCommand *next;
+} ReadyCommand;
+
+/**
+ * A named queue of delayed commands ('delay --queue'), whose commands never
+ * run more than 'limit' at a time. Due commands wait in one FIFO per
+ * priority class. Queues are created on first use and never removed, so
+ * commands refer to them by index.
+ */
+#define MAX_NAMED_QUEUES 16
+
+typedef struct {
+    char name[32];
+    int limit;          // 0: no limit
+    int running;
+    ReadyCommand *head[PRIORITY_CLASSES];
+    ReadyCommand *tail[PRIORITY_CLASSES];
+} NamedQueue;
+
+/**
+ * How a delayed command runs once it is due.
+ */
+typedef struct {
+    int batch;
+    int priority;
+    int queue;
+    DelayedEdge after[MAX_DEPENDENCIES];
+    int after_count;
+} DelayedJobOptions;
+
+#define JOB_OPTION_BATCH 1  // '--batch' is allowed (see 'parseDelayedJobOptions')
+#define JOB_OPTION_AFTER 2  // '--after' and '--after-ok' are allowed
+
+/**
+ * Commands that are due, in their named queues, and the pool of worker
+ * threads that execute them. Workers beyond 'worker_target' exit when they
+ * are idle.
+ */
+typedef struct {
+    NamedQueue named[MAX_NAMED_QUEUES];
+    int named_count;
+    long next_sequence;
+    int count;
+    int worker_count;
+    int worker_target;
+    int busy;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} ReadyQueue;
+
+/**
+ * When a batch command ('delay --batch', 'batch') that is due may start: only
+ * while the 1-minute load average and the memory and I/O pressure are below
+ * the limits. Otherwise it is retried after 'backoff' seconds, doubling up
+ * to 'max_backoff', and started anyway once it has waited 'max_deferral'.
+ */
+typedef struct {
+    double max_load;        // 0: 0.8 per CPU the shell may run on
+    double max_pressure;    // percent of time stalled ('some avg10')
+    double backoff;
+    double max_backoff;
+    double max_deferral;
+} BatchPolicy;
+
+/**
+ * An entry of the job ID index of a delayed queue; an 'id' of 0 is empty.
+ */
+typedef struct {
+    long id;
+    int slot;
+} DelayedIndexEntry;
+
+/**
+ * The write-ahead journal of a delayed queue. Records are appended to
+ * 'buffer' and written out with a single 'write' and 'fdatasync' per batch
+ * by the journal thread. 'records' counts the records in the file, so the
+ * thread knows when to compact it.
+ */
+typedef struct {
+    int fd;
+    int lock_fd;        // '<path>.lock', held for the life of the shell
+    char *path;
+    char *buffer;
+    size_t length;
+    size_t capacity;
+    long records;
+    int stopping;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} DelayedJournal;
+
+/**
+ * A histogram of durations in nanoseconds with power-of-two buckets: bucket
+ * k counts durations in [2^k, 2^(k+1)), and bucket 0 also counts zero.
+ */
+#define LATENCY_BUCKETS 48
+
+typedef struct {
+    long count;
+    int64_t sum;
+    int64_t max;
+    long buckets[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+/**
+ * Counters and histograms of a delayed queue, shown by 'delaystats'. They are
+ * updated with the queue's mutex held, except 'start_delay' and 'max_ready'
+ * which belong to the ready list and are updated with its mutex held.
+ */
+typedef struct {
+    int64_t since;               // CLOCK_MONOTONIC time of the last reset
+    long inserted;
+    long dispatched;
+    long wakeups;                // times the scheduler thread woke up
+    long contended;              // lock attempts that found the mutex taken
+    int max_depth;               // queue depth high-water mark
+    int max_ready;               // ready list high-water mark
+    long per_second[60];         // commands dispatched, by second mod 60
+    int64_t last_second;         // the latest second 'per_second' holds
+    LatencyHistogram lateness;     // deadline to dispatch
+    LatencyHistogram start_delay;  // dispatch to a worker starting the command
+    LatencyHistogram lock_wait;    // waiting for the queue's mutex, when contended
+    LatencyHistogram lock_hold;    // holding it
+    int64_t locked_at;
+} DelayedMetrics;
+
+/**
+ * One run of a delayed command whose output is being copied to its log.
+ */
+typedef struct {
+    long id;
+    int pipe_fd;        // read end; the job's stdout and stderr write into it
+    int log_fd;
+    off_t size;         // of the log file 'log_fd' writes to
+} LogStream;
+
+/**
+ * The per-job logs of delayed commands: '<dir>/job-<id>.log', renamed to
+ * '.log.1' (and so on, up to 'keep' old files) when it would grow beyond
+ * 'max_size'. A single thread copies every running job's output from its
+ * pipe into its log, so delayed commands never write to the terminal.
+ */
+typedef struct {
+    char dir[PATH_MAX];  // empty: output goes to the terminal
+    off_t max_size;
+    int keep;
+    LogStream *streams;
+    int count;
+    int capacity;
+    int wake_fd[2];      // written to when a stream is added
+    pthread_mutex_t mutex;
+} DelayedLogs;
+
+/**
+ * The delayed command queue: a binary min-heap of handles ordered by
+ * deadline, over separately stored commands. Both arrays grow on demand.
+ * Deadlines are on CLOCK_MONOTONIC, so changes to the system time do not
+ * move them; commands scheduled for a wall-clock time ('wall_count' of them)
+ * are rebased when the offset between the two clocks ('clock_offset') moves.
+ * 'index' finds a command's slot, and so its heap position, from its job ID.
+ */
+typedef struct {
+    DelayedHandle *heap;
+    int count;
+    int heap_capacity;
+    DelayedCommand *slots;
+    int slot_capacity;
+    int free_slot;      // head of the free slot list, -1 if none
+    int wall_count;
+    int64_t clock_offset; // CLOCK_REALTIME minus CLOCK_MONOTONIC, in nanoseconds
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    ReadyQueue ready;
+    long next_id;
+    DelayedIndexEntry *index; // open-addressing hash table from job ID to slot
+    int index_capacity;       // a power of two
+    int index_count;          // IDs in the index: queued, waiting for a worker or running
+    DelayedJournal *journal; // NULL unless 'NORSEISH_JOURNAL' is set
+    DelayedMetrics metrics;
+    int (*execute)(long id, char *command); // what workers run; NULL: 'executeDelayedCommand'
+} DelayedQueue;
+
+/**
+ * Exit statuses of the stages of the most recently run pipeline, in stage
+ * order. A plain command is recorded as a pipeline with a single stage.
+ * 'usage' holds the resources each stage consumed, as reported by 'wait4'.
+ */
+typedef struct {
+    int count;
+    int status[MAX_ARGS];
+    struct rusage usage[MAX_ARGS];
+} PipelineResult;
+
+/**
+ * One compiled redirection. Each action maps directly onto a system call in
+ * the child (and onto 'posix_spawn_file_actions_addopen', '_adddup2' and
+ * '_addclose' respectively), and the actions of a command run in the order
+ * they were written.
+ */
+typedef enum {
+    REDIR_OPEN,  // open 'path' with 'flags' onto 'fd'
+    REDIR_DUP,   // make 'fd' a copy of 'source_fd'
+    REDIR_CLOSE  // close 'fd'
+} RedirectionType;
+
+typedef struct {
+    RedirectionType type;
+    int fd;
+    int source_fd;
+    int flags;
+    const char *path;
+} Redirection;
+
+#define MAX_REDIRECTIONS 16
+typedef struct {
+    int count;
+    Redirection actions[MAX_REDIRECTIONS];
+} RedirectionList;
+
+/**
+ * CPU and I/O priority given to a job's processes before they exec. Background
+ * and delayed jobs get 'background_priority' unless the job sets its own with
+ * the 'prio' prefix.
+ */
+#define IOPRIO_CLASS_NONE 0
+#define IOPRIO_CLASS_RT 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+typedef struct {
+    int set;          // non-zero if this priority should be applied
+    int nice;
+    int io_class;     // IOPRIO_CLASS_*; IOPRIO_CLASS_NONE leaves I/O alone
+    int io_level;     // 0 (highest) .. 7 (lowest) within the class
+    int sched_batch;  // run under SCHED_BATCH
+} JobPriority;
+
+#define AFFINITY_NONE 0   // inherit the shell's CPU affinity
+#define AFFINITY_MASK 1   // pin to 'cpus'
+#define AFFINITY_SPREAD 2 // give each pipeline stage its own CPU out of 'cpus'
+
+#define MAX_JOB_LIMITS 8
+
+/**
+ * Per-job settings applied in every child of a job, between 'fork' and 'exec'.
+ */
+typedef struct {
+    JobPriority priority;
+    int affinity;     // AFFINITY_*
+    cpu_set_t cpus;
+    int limit_count;  // resource limits set with the 'limit' prefix
+    struct {
+        int resource;
+        rlim_t value;
+    } limits[MAX_JOB_LIMITS];
+} SpawnAttributes;
+
+/**
+ * Measurements of one command benchmarked by 'bench'. Times are in seconds.
+ */
+typedef struct {
+    char name[MAX_COMMAND_LENGTH];
+    int runs;
+    int failures;
+    double *times;      // wall time of each measured run
+    double mean, stddev, median, p90, p95, p99, min, max;
+    double user, sys;   // mean CPU time per run
+} BenchResult;
+
+DelayedQueue delayed_queue; // set up by initDelayedQueue
+BatchPolicy batch_policy = {0, 10.0, 1, 60, 3600}; // batchload
+#define DEFAULT_DELAY_WORKERS 4
+DelayedLogs delayed_logs = {.keep = 3, .max_size = 1024 * 1024, .mutex = PTHREAD_MUTEX_INITIALIZER};
+
+// Standard input and output (and error) of the children started by this
+// thread, in place of the shell's own; -1 to inherit them (see 'startChild')
+__thread int job_stdin_fd = -1;
+__thread int job_output_fd = -1;
 pthread_t delayed_commands_thread;
 
+#define MAX_BACKGROUND_JOBS 256
+pid_t background_pids[MAX_BACKGROUND_JOBS];
+int background_count = 0;
+pthread_mutex_t background_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int last_exit_status = 0;          // $?
+PipelineResult last_pipeline = {0}; // PIPESTATUS
+int errexit_enabled = 0;           // set -e
+int pipefail_enabled = 0;          // set -o pipefail
+JobPriority background_priority = {1, 10, IOPRIO_CLASS_BE, 7, 1}; // bgprio
+
+int fork_server_fd = -1;         // the shell's end of the fork-server socket
+pid_t fork_server_pid = -1;
+int fork_server_enabled = 0;     // route spawns through the fork server
+pthread_mutex_t fork_server_mutex = PTHREAD_MUTEX_INITIALIZER;
+mode_t shell_umask = 022;        // recorded at startup: umask(2) cannot read it without setting it
+
 void disableInputBuffering(struct termios *oldt);
 void restoreInputBuffering(struct termios *oldt);
 int isExecutable(const char *filepath);
@@ -116,17 +547,73 @@ void displayInlineCompletions(const char *prompt, const char *buf, const char *c
 char **generateCompletions(const char *buf, int pos, int *count);
 int readLine(const char *prompt, char *buf, int bufsize);
 void titleScreen();
-void cd(char *path);
+int cd(char *path);
 void removeQuotes(char *str);
-void executeCommand(char **args, int background);
-void handlePipes(char **args, int num_commands, int background);
+int statusToExitCode(int status);
+int parseRedirections(char **args, char **argv, RedirectionList *list);
+int applyRedirections(const RedirectionList *list);
+void applySpawnAttributes(const SpawnAttributes *attrs);
+void execChild(char **argv, const RedirectionList *redirs, const SpawnAttributes *attrs);
+pid_t startChild(char **argv, const RedirectionList *redirs, const SpawnAttributes *attrs,
+                 int in_fd, int out_fd, const int *close_fds, int close_count);
+int startForkServer();
+void stopForkServer();
+pid_t forkServerSpawn(char **argv, const RedirectionList *redirs, const SpawnAttributes *attrs,
+                      int in_fd, int out_fd, int err_fd);
+int forkserverCommand(char **args);
+int parallelCommand(char **args, const SpawnAttributes *attrs);
+pid_t spawnCommand(char **argv, const RedirectionList *redirs, const SpawnAttributes *attrs);
+int executeCommand(char **args, int background, const SpawnAttributes *attrs, struct rusage *usage);
+int handlePipes(char **args, int num_commands, int background, const SpawnAttributes *attrs,
+                PipelineResult *result);
+int runCommandLine(char **args, int background, const SpawnAttributes *attrs, PipelineResult *result);
+int parseCpuList(const char *list, cpu_set_t *set);
+int parseCpuPrefix(char **args, SpawnAttributes *attrs);
+void resolveStageAffinity(SpawnAttributes *attrs, int stage);
+int parseJobPrefixes(char **args, SpawnAttributes *attrs);
+int ulimitCommand(char **args);
+int bgprioCommand(char **args);
+void reapBackgroundJobs();
+void expandStatusVariables(const char *src, char *dest, size_t size);
+int setOptions(char **args);
+void recordBuiltinStatus(int code);
+void printTimingReport(char **args, const struct timespec *start, const struct timespec *end,
+                       const PipelineResult *result);
+int benchCommand(char **args);
+int parseDuration(const char *str, double *seconds);
+int parseSignalName(const char *name);
+int timeoutCommand(char **args, int background, const SpawnAttributes *attrs);
 void addToHistory(const char *command);
 void displayHistory();
 int disownProcess(pid_t pid);
 int expandWildcards(char **args, char ***expanded_args);
 void *processDelayedCommands(void *arg);
-void addDelayedCommand(time_t scheduled_time, const char *command);
-void executeDelayedCommand(char *command);
+int64_t clockNanoseconds(clockid_t clock);
+void initDelayedQueue(DelayedQueue *queue);
+int setDelayedWorkers(DelayedQueue *queue, int count);
+int delayworkersCommand(char **args);
+long addDelayedCommand(DelayedQueue *queue, int64_t deadline, time_t wall_time, const DelayedJobOptions *options,
+                       const char *command);
+int batchloadCommand(char **args);
+long addRecurringCommand(DelayedQueue *queue, const RecurringSchedule *schedule,
+                         const DelayedJobOptions *options, const char *command);
+int parseRecurringSchedule(char **words, RecurringSchedule *schedule);
+void freeRecurringSchedule(RecurringSchedule *schedule);
+time_t nextCronTime(const RecurringSchedule *schedule, time_t after);
+int recurringCommand(char **args);
+int openDelayedJournal(DelayedQueue *queue, const char *path, int run_missed);
+void closeDelayedJournal(DelayedQueue *queue);
+int delayCommand(char **args);
+int delayqCommand(char **args);
+int delayrmCommand(char **args);
+int delaymvCommand(char **args);
+int executeDelayedCommand(long id, char *command);
+void finishDelayedCommand(DelayedQueue *queue, long id, int status);
+void noteJobLog(DelayedLogs *logs, long id, const char *note);
+int delaylogCommand(char **args);
+int delaystatsCommand(char **args);
+int delaybenchCommand(char **args);
+int delayqueueCommand(char **args);
 
 char history[MAX_HISTORY][MAX_COMMAND_LENGTH];
 int history_count = 0;
@@ -751,12 +1238,16 @@ void titleScreen() {
  *
  * @param path A pointer to a null-terminated string representing the path to
  * the directory to change to.
+ *
+ * @return 0 if the directory was changed, 1 otherwise (the value of '$?').
  * @see https://man7.org/linux/man-pages/man2/chdir.2.html
  */
-void cd(char *path) {
+int cd(char *path) {
     if (chdir(path) != 0) {
         perror("cd");
+        return 1;
     }
+    return 0;
 }
 
 /**
@@ -792,614 +1283,7988 @@ void removeQuotes(char *str) {
 }
 
 /**
- * @brief Executes a command with its arguments, handling both foreground and background 
- * execution, as well as input/output redirection.
+ * @brief Appends an action to a redirection list.
  *
- * This function forks a child process to execute the specified command. In the
- * child process, it restores the default signal handlers for 'SIGINT', 'SIGQUIT',
- * 'SIGTSTP', and 'SIGCHLD'. It then checks for input redirection ('<'), output
- * redirection ('>'), and append redirection ('>>') in the command arguments. If
- * any of these are found, it opens the corresponding file and uses 'dup2' to
- * redirect the standard input or standard output of the child process. Finally,
- * it executes the command using 'execvp'. If 'execvp' fails, an error message
- * is printed.
+ * @return 0 on success, -1 if the list is full.
+ */
+static int addRedirection(RedirectionList *list, RedirectionType type, int fd, int source_fd,
+                          int flags, const char *path) {
+    if (list->count >= MAX_REDIRECTIONS) {
+        fprintf(stderr, "Too many redirections\n");
+        return -1;
+    }
+    Redirection *r = &list->actions[list->count++];
+    r->type = type;
+    r->fd = fd;
+    r->source_fd = source_fd;
+    r->flags = flags;
+    r->path = path;
+    return 0;
+}
+
+/**
+ * @brief Compiles the redirections of a single command into a list of actions.
  *
- * In the parent process, if the 'background' flag is false (foreground execution),
- * it waits for the child process to complete and retrieves its exit status or
- * termination signal. If the 'background' flag is true, it prints the process ID
- * of the child process and then attempts to detach it using the 'disownProcess'
- * function (which is assumed to be defined elsewhere).
+ * Scans 'args' for redirection operators and translates each one into
+ * 'REDIR_OPEN', 'REDIR_DUP' or 'REDIR_CLOSE' actions; every other argument is
+ * copied, in order, into 'argv'. The target may be written as a separate
+ * argument ('2> err.txt') or attached to the operator ('2>err.txt').
+ * Supported forms, where 'n' and 'm' are optional file descriptor numbers:
+ * - 'n<file', 'n>file', 'n>>file', 'n<>file': open for reading, writing
+ * (truncating), appending, or reading and writing ('n' defaults to 0 for
+ * '<' and '<>', 1 otherwise).
+ * - '&>file', '&>>file': send both standard output and standard error to file.
+ * - 'n>&m', 'n<&m': make 'n' a duplicate of 'm'.
+ * - 'n>&-', 'n<&-': close 'n'.
  *
- * @param args A null-terminated array of character pointers representing the
- * command and its arguments (e.g., {"ls", "-l", NULL}). The first element
- * ('args[0]') should be the command to execute. Redirection operators ("<", ">",
- * ">>") and their corresponding filenames can be included in this array.
- * @param background An integer flag. If non-zero, the command is executed in
- * the background; otherwise, it's executed in the foreground and the parent
- * waits for its completion.
+ * Parsing happens in the shell before anything is forked, so a malformed
+ * redirection fails the command without starting it.
  *
- * @note This function assumes that the 'disownProcess' function is defined
- * elsewhere and handles the detachment of background processes. It also handles
- * basic input and output redirection but does not support more complex scenarios
- * like pipes or multiple redirections in a single command. Error handling is
- * performed using 'perror' and exiting the child process on failure.
- * 
- * @see https://man7.org/linux/man-pages/man2/pipe.2.html
- * @see https://man7.org/linux/man-pages/man2/fork.2.html
- * @see https://man7.org/linux/man-pages/man2/dup2.html
- * @see https://man7.org/linux/man-pages/man3/execvp.3.html
- * @see https://man7.org/linux/man-pages/man2/wait.2.html
+ * @param args A null-terminated array of arguments for one command (no pipes).
+ * @param argv Receives the remaining arguments, null-terminated. Must have
+ * room for 'MAX_ARGS' entries. The strings are borrowed from 'args'.
+ * @param list Receives the compiled redirections.
+ *
+ * @return 0 on success, -1 on a syntax error (a message is printed).
  */
-void executeCommand(char **args, int background) {
-    pid_t pid = fork();
-    if (pid == 0) {
-        // Child process
-        // Restore default signal handlers for child process.  This is important
-        // for proper job control.  The parent shell might have set signal handlers
-        // that we don't want the child process to inherit.
-        signal(SIGINT, SIG_DFL);  // Restore default behavior for Ctrl+C
-        signal(SIGQUIT, SIG_DFL); // Restore default behavior for Ctrl+backslash
-        signal(SIGTSTP, SIG_DFL); // Restore default behavior for Ctrl+Z
-        signal(SIGCHLD, SIG_DFL);
-
-        int inPos = -1, outPos = -1, appendPos = -1;
-        for (int j = 0; j < MAX_ARGS - 1 && args[j] != NULL; j++) {
-            if (strcmp(args[j], "<") == 0) inPos = j;
-            if (strcmp(args[j], ">") == 0) outPos = j;
-            if (strcmp(args[j], ">>") == 0) appendPos = j;
-        }
-        // Input redirection
-        if (inPos != -1 && args[inPos + 1] != NULL) {
-            FILE *inFile = fopen(args[inPos + 1], "r");
-            if (inFile == NULL) {
-                perror("fopen");
-                exit(1);
-            }
-            dup2(fileno(inFile), STDIN_FILENO);
-            fclose(inFile);
-            args[inPos] = NULL;
-        }
-        // Output redirection
-        if (outPos != -1 && args[outPos + 1] != NULL) {
-            FILE *outFile = fopen(args[outPos + 1], "w");
-            if (outFile == NULL) {
-                perror("fopen");
-                exit(1);
-            }
-            dup2(fileno(outFile), STDOUT_FILENO);
-            fclose(outFile);
-            args[outPos] = NULL;
-        }
-        // Append redirection
-        if (appendPos != -1 && args[appendPos + 1] != NULL) {
-            FILE *appendFile = fopen(args[appendPos + 1], "a");
-            if (appendFile == NULL) {
-                perror("fopen");
-                exit(1);
-            }
-            dup2(fileno(appendFile), STDOUT_FILENO);
-            fclose(appendFile);
-            args[appendPos] = NULL;
-        }
-
-        execvp(args[0], args);
-        perror("execvp"); // Only gets here if execvp fails
-        exit(1);
-    } else if (pid > 0) {
-        // Parent process
-        if (!background) {
-            // Wait for foreground process to complete
-            int status;
-            waitpid(pid, &status, 0);
-            if (WIFEXITED(status)) {
-                // printf("Child process exited with status %d\n", WEXITSTATUS(status)); //debugging
-            } else if (WIFSIGNALED(status)) {
-                // printf("Child process terminated by signal %d\n", WTERMSIG(status)); //debugging
+int parseRedirections(char **args, char **argv, RedirectionList *list) {
+    int argc = 0;
+    list->count = 0;
+
+    for (int j = 0; args[j] != NULL; j++) {
+        const char *p = args[j];
+        int fd = -1;
+        int both = 0;
+
+        if (p[0] == '&' && p[1] == '>') {
+            both = 1;
+            p++;
+        } else if (isdigit((unsigned char)p[0])) {
+            const char *q = p;
+            while (isdigit((unsigned char)*q)) q++;
+            if (*q == '<' || *q == '>') {
+                fd = atoi(p);
+                p = q;
             }
-        } else {
-            // Print the PID of the background process
-            printf("[Background] Process ID: %d\n", pid);
-            // Detach the process using signal handling.
-            if (disownProcess(pid) != 0) {
-                perror("disownProcess");
+        }
+        if (*p != '<' && *p != '>') {
+            if (argc < MAX_ARGS - 1) {
+                argv[argc++] = args[j];
             }
+            continue;
+        }
+
+        int input = (*p == '<');
+        int flags;
+        if (strncmp(p, ">>", 2) == 0) {
+            flags = O_WRONLY | O_CREAT | O_APPEND;
+            p += 2;
+        } else if (strncmp(p, "<>", 2) == 0) {
+            flags = O_RDWR | O_CREAT;
+            p += 2;
+        } else if (strncmp(p, "<&", 2) == 0 || strncmp(p, ">&", 2) == 0) {
+            if (both) {
+                fprintf(stderr, "syntax error near '%s'\n", args[j]);
+                return -1;
+            }
+            if (fd < 0) {
+                fd = input ? STDIN_FILENO : STDOUT_FILENO;
+            }
+            const char *target = p[2] != '\0' ? p + 2 : args[++j];
+            if (target == NULL) {
+                fprintf(stderr, "syntax error: missing file descriptor after '%s'\n", args[j - 1]);
+                return -1;
+            }
+            if (strcmp(target, "-") == 0) {
+                if (addRedirection(list, REDIR_CLOSE, fd, -1, 0, NULL) != 0) return -1;
+            } else {
+                char *end;
+                long source = strtol(target, &end, 10);
+                if (*target == '\0' || *end != '\0' || source < 0) {
+                    fprintf(stderr, "%s: ambiguous redirect\n", target);
+                    return -1;
+                }
+                if (addRedirection(list, REDIR_DUP, fd, (int)source, 0, NULL) != 0) return -1;
+            }
+            continue;
+        } else {
+            flags = input ? O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC;
+            p += 1;
+        }
+        if (fd < 0) {
+            fd = input ? STDIN_FILENO : STDOUT_FILENO;
+        }
+
+        const char *path = *p != '\0' ? p : args[++j];
+        if (path == NULL) {
+            fprintf(stderr, "syntax error: missing file name after '%s'\n", args[j - 1]);
+            return -1;
+        }
+        if (addRedirection(list, REDIR_OPEN, fd, -1, flags, path) != 0) return -1;
+        if (both && addRedirection(list, REDIR_DUP, STDERR_FILENO, STDOUT_FILENO, 0, NULL) != 0) {
+            return -1;
         }
-    } else {
-        perror("fork");
-        exit(1); // Exit on fork error.
     }
+    argv[argc] = NULL;
+    return 0;
 }
 
 /**
- * @brief Disowns a process, allowing it to continue running after the shell exits.
+ * @brief Performs a compiled redirection list in the current process.
  *
- * This function disowns the process with the given process ID ('pid') by
- * creating a new process and making the original process a child of the
- * new process.  The new process then calls setsid to detach from the
- * terminal.
+ * Intended to run in a freshly forked child just before 'execvp'. Actions
+ * are applied in order with 'open', 'dup2' and 'close', so later
+ * redirections see the effect of earlier ones (e.g. '> out 2>&1').
  *
- * @param pid The process ID of the process to disown.
+ * @param list The list produced by 'parseRedirections'.
  *
- * @return 0 on success, -1 on error.
- * @see https://man7.org/linux/man-pages/man1/disown.1.html
- * @see https://www.man7.org/linux/man-pages/man2/sigaction.2.html
+ * @return 0 on success, -1 on failure (an error is printed with 'perror').
+ * @see https://man7.org/linux/man-pages/man2/open.2.html
+ * @see https://man7.org/linux/man-pages/man2/dup2.html
  */
-int disownProcess(pid_t pid) {
-    // Set the signal handler for SIGCHLD to ignore the child process.
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = SIG_IGN;
-    sa.sa_flags = SA_NOCLDSTOP; // Important: Don't get notified on STOP/CONTINUE
-    if (sigaction(SIGCHLD, &sa, NULL) != 0) {
-        perror("sigaction");
-        return -1;
+int applyRedirections(const RedirectionList *list) {
+    for (int k = 0; k < list->count; k++) {
+        const Redirection *r = &list->actions[k];
+        if (r->type == REDIR_OPEN) {
+            int tmp = open(r->path, r->flags, 0666);
+            if (tmp < 0) {
+                perror(r->path);
+                return -1;
+            }
+            if (tmp != r->fd) {
+                if (dup2(tmp, r->fd) < 0) {
+                    perror("dup2");
+                    return -1;
+                }
+                close(tmp);
+            }
+        } else if (r->type == REDIR_DUP) {
+            if (dup2(r->source_fd, r->fd) < 0) {
+                fprintf(stderr, "%d: %s\n", r->source_fd, strerror(errno));
+                return -1;
+            }
+        } else {
+            close(r->fd);
+        }
     }
     return 0;
 }
 
 /**
- * @brief Handles the execution of commands connected by pipes.
- *
- * This function takes an array of arguments representing a pipeline of commands
- * and executes them by creating a series of child processes connected by pipes.
- * It iterates through the arguments, identifying the pipe symbols ("|") to
- * determine the individual commands in the pipeline. For each command, it
- * creates a child process, sets up the necessary pipe file descriptors,
- * and executes the command using 'execvp'. The parent process waits for all
- * child processes to complete, unless the last command is to be run in the
- * background.
+ * @brief Applies a job's settings to the calling process.
  *
- * @param args A null-terminated array of character pointers representing the
- * commands and their arguments, including pipe symbols ("|").
- * @param num_commands The number of commands in the pipeline.
- * @param background An integer flag indicating whether the last command in the
- * pipeline should be executed in the background (1) or foreground (0).
+ * Runs in a freshly forked child before 'execvp'. The nice value is set with
+ * 'setpriority', the I/O scheduling class and level with 'ioprio_set',
+ * 'SCHED_BATCH' with 'sched_setscheduler', a CPU mask with
+ * 'sched_setaffinity', and resource limits with 'setrlimit'. A setting that
+ * cannot be applied (for instance a negative nice value without privileges)
+ * only produces a warning: the command still runs.
  *
- * @note This function uses 'pipe', 'fork', 'dup2', 'close', 'execvp', and
- * 'waitpid' system calls.  It handles errors during pipe creation,
- * process creation, and execution.
- * @note dup2 is functionality same as dup in C, but user specifies file descriptor
+ * @param attrs The settings to apply; NULL applies nothing. An
+ * 'AFFINITY_SPREAD' mask must have been resolved with 'resolveStageAffinity'
+ * first, otherwise the child keeps the shell's affinity.
+ * @see https://man7.org/linux/man-pages/man2/setpriority.2.html
+ * @see https://man7.org/linux/man-pages/man2/ioprio_set.2.html
+ * @see https://man7.org/linux/man-pages/man2/sched_setscheduler.2.html
  */
-void handlePipes(char **args, int num_commands, int background) {
-    int pipefd[2 * (num_commands - 1)];
-    for (int i = 0; i < num_commands - 1; i++) {
-        if (pipe(pipefd + i * 2) < 0) {
-            perror("pipe");
-            exit(1);
-        }
+void applySpawnAttributes(const SpawnAttributes *attrs) {
+    if (attrs == NULL) {
+        return;
     }
-
-    int arg_index = 0;
-    for (int i = 0; i < num_commands; i++) {
-        char *command_args[MAX_ARGS];
-        int current_arg = 0;
-        while (args[arg_index] != NULL && strcmp(args[arg_index], "|") != 0) {
-            command_args[current_arg++] = args[arg_index++];
+    const JobPriority *prio = &attrs->priority;
+    if (prio->set) {
+        if (prio->sched_batch) {
+            struct sched_param param = {.sched_priority = 0};
+            if (sched_setscheduler(0, SCHED_BATCH, &param) != 0) {
+                perror("sched_setscheduler");
+            }
         }
-        command_args[current_arg] = NULL; // Null-terminate arguments for the current command
-        if (args[arg_index] != NULL && strcmp(args[arg_index], "|") == 0) {
-            arg_index++; // Move past the pipe symbol
+        if (setpriority(PRIO_PROCESS, 0, prio->nice) != 0) {
+            perror("setpriority");
         }
-
-        pid_t pid = fork();
-        if (pid == 0) {
-            // Child process
-            signal(SIGINT, SIG_DFL);
-            signal(SIGQUIT, SIG_DFL);
-            signal(SIGTSTP, SIG_DFL);
-            signal(SIGCHLD, SIG_DFL);
-
-            // Set up input from the previous pipe, if not the first command
-            if (i > 0) {
-                dup2(pipefd[(i - 1) * 2], STDIN_FILENO);
-            }
-
-            // Set up output to the next pipe, if not the last command
-            if (i < num_commands - 1) {
-                dup2(pipefd[i * 2 + 1], STDOUT_FILENO);
-            }
-
-            // Close all pipe ends in the child
-            for (int k = 0; k < 2 * (num_commands - 1); k++) {
-                close(pipefd[k]);
-            }
-
-            if (command_args[0] != NULL) {
-                execvp(command_args[0], command_args);
-                perror("execvp");
+        if (prio->io_class != IOPRIO_CLASS_NONE) {
+            int value = (prio->io_class << IOPRIO_CLASS_SHIFT) | prio->io_level;
+            if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, value) != 0) {
+                perror("ioprio_set");
             }
-        exit(1);
-        } else if (pid < 0) {
-            perror("fork");
-            exit(1);
         }
     }
-
-    // Close all pipe ends in the parent
-    for (int i = 0; i < 2 * (num_commands - 1); i++) {
-        close(pipefd[i]);
+    if (attrs->affinity == AFFINITY_MASK) {
+        if (sched_setaffinity(0, sizeof(cpu_set_t), &attrs->cpus) != 0) {
+            perror("sched_setaffinity");
+        }
+    }
+    for (int k = 0; k < attrs->limit_count; k++) {
+        // Both soft and hard, so the job cannot raise the limit again
+        struct rlimit rl = {attrs->limits[k].value, attrs->limits[k].value};
+        if (setrlimit(attrs->limits[k].resource, &rl) != 0) {
+            perror("setrlimit");
+        }
     }
+}
 
-    // Wait for all child processes if not in the background
-    if (!background) {
-        for (int i = 0; i < num_commands; i++) {
-            wait(NULL);
+/**
+ * The resource limits understood by 'ulimit' and the 'limit' prefix. Sizes
+ * are counted in 'unit' bytes, like bash's 'ulimit'.
+ */
+static const struct {
+    char option;
+    int resource;
+    int unit;
+    const char *description;
+} rlimit_options[] = {
+    {'c', RLIMIT_CORE, 1024, "core file size (KiB)"},
+    {'d', RLIMIT_DATA, 1024, "data seg size (KiB)"},
+    {'f', RLIMIT_FSIZE, 1024, "file size (KiB)"},
+    {'n', RLIMIT_NOFILE, 1, "open files"},
+    {'s', RLIMIT_STACK, 1024, "stack size (KiB)"},
+    {'t', RLIMIT_CPU, 1, "cpu time (seconds)"},
+    {'u', RLIMIT_NPROC, 1, "max user processes"},
+    {'v', RLIMIT_AS, 1024, "virtual memory (KiB)"},
+};
+
+/**
+ * @brief Looks up a resource limit option letter.
+ *
+ * @return The index into 'rlimit_options', or -1 if 'option' is unknown.
+ */
+static int findRlimitOption(char option) {
+    for (size_t k = 0; k < sizeof(rlimit_options) / sizeof(rlimit_options[0]); k++) {
+        if (rlimit_options[k].option == option) {
+            return (int)k;
         }
     }
+    return -1;
 }
 
 /**
- * @brief Adds a command to the command history.
+ * @brief Parses a resource limit value.
  *
- * This function adds the given 'command' string to the global 'history' array.
- * The command is added to the end of the history, and the 'history_count'
- * is incremented. If the history is full (reaches 'MAX_HISTORY'), the oldest
- * command is overwritten.
+ * Accepts 'unlimited' or a number in the option's unit. Size limits also
+ * accept a K, M or G suffix, which makes the number an amount of bytes in
+ * that power of 1024 (so 'limit -v 2G' means two gibibytes).
  *
- * @param command A pointer to a null-terminated string representing the
- * command to add to the history.
+ * @return 0 on success, -1 if the value is invalid.
  */
-void addToHistory(const char *command) {
-    if (history_count < MAX_HISTORY) {
-        strcpy(history[history_count], command);
-        history_count++;
+static int parseRlimitValue(const char *str, int index, rlim_t *value) {
+    if (strcmp(str, "unlimited") == 0) {
+        *value = RLIM_INFINITY;
+        return 0;
+    }
+    char *end;
+    unsigned long long n = strtoull(str, &end, 10);
+    if (end == str || str[0] == '-') {
+        return -1;
+    }
+    int unit = rlimit_options[index].unit;
+    if (*end == '\0') {
+        *value = (rlim_t)n * unit;
+        return 0;
+    }
+    if (unit == 1 || end[1] != '\0') {
+        return -1;
+    }
+    const char *suffixes = "KMG";
+    const char *suffix = strchr(suffixes, toupper((unsigned char)*end));
+    if (suffix == NULL) {
+        return -1;
+    }
+    *value = (rlim_t)n << (10 * (suffix - suffixes + 1));
+    return 0;
+}
+
+/**
+ * @brief Parses the options of a 'limit' prefix into 'attrs'.
+ *
+ * 'limit -v 1G -t 60 -n 256 -c 0 command...' runs the command with those
+ * limits (see 'rlimit_options'); the shell itself is unaffected.
+ *
+ * @return The number of words consumed, or -1 on a usage error.
+ */
+static int parseLimitPrefix(char **args, SpawnAttributes *attrs) {
+    int j = 1;
+    while (args[j] != NULL && args[j][0] == '-' && args[j][1] != '\0' && args[j][2] == '\0') {
+        int index = findRlimitOption(args[j][1]);
+        rlim_t value;
+        if (index < 0 || args[j + 1] == NULL || parseRlimitValue(args[j + 1], index, &value) != 0) {
+            fprintf(stderr, "limit: invalid limit '%s %s'\n", args[j], args[j + 1] ? args[j + 1] : "");
+            return -1;
+        }
+        if (attrs->limit_count >= MAX_JOB_LIMITS) {
+            fprintf(stderr, "limit: too many limits\n");
+            return -1;
+        }
+        attrs->limits[attrs->limit_count].resource = rlimit_options[index].resource;
+        attrs->limits[attrs->limit_count].value = value;
+        attrs->limit_count++;
+        j += 2;
+    }
+    return j;
+}
+
+/**
+ * @brief Implements the 'ulimit' built-in.
+ *
+ * Usage: ulimit [-S|-H] [-a] [-c|-d|-f|-n|-s|-t|-u|-v [value]]
+ *
+ * Shows or changes a resource limit of the shell, which every command it
+ * starts inherits. Without a value the current limit is printed; '-a'
+ * prints them all. A new value sets both the soft and the hard limit unless
+ * '-S' or '-H' is given. Without an option, '-f' is assumed.
+ *
+ * @param args The arguments of the command, starting with "ulimit".
+ *
+ * @return 0 on success, 1 if the limit could not be changed, 2 on a usage error.
+ * @see https://man7.org/linux/man-pages/man2/setrlimit.2.html
+ */
+int ulimitCommand(char **args) {
+    int soft = 1, hard = 1, all = 0;
+    int index = findRlimitOption('f');
+    const char *value = NULL;
+
+    for (int j = 1; args[j] != NULL; j++) {
+        if (args[j][0] == '-' && args[j][1] != '\0') {
+            for (const char *opt = args[j] + 1; *opt != '\0'; opt++) {
+                if (*opt == 'S') {
+                    soft = 1;
+                    hard = 0;
+                } else if (*opt == 'H') {
+                    hard = 1;
+                    soft = 0;
+                } else if (*opt == 'a') {
+                    all = 1;
+                } else if ((index = findRlimitOption(*opt)) < 0) {
+                    fprintf(stderr, "ulimit: -%c: invalid option\n", *opt);
+                    return 2;
+                }
+            }
+        } else {
+            value = args[j];
+        }
+    }
+
+    // When showing, -H shows the hard limit and anything else the soft one
+    int show_hard = hard && !soft;
+    if (all || value == NULL) {
+        size_t first = all ? 0 : (size_t)index;
+        size_t last = all ? sizeof(rlimit_options) / sizeof(rlimit_options[0]) : (size_t)index + 1;
+        for (size_t k = first; k < last; k++) {
+            struct rlimit rl;
+            if (getrlimit(rlimit_options[k].resource, &rl) != 0) {
+                perror("getrlimit");
+                return 1;
+            }
+            rlim_t limit = show_hard ? rl.rlim_max : rl.rlim_cur;
+            if (all) {
+                printf("%-24s (-%c) ", rlimit_options[k].description, rlimit_options[k].option);
+            }
+            if (limit == RLIM_INFINITY) {
+                printf("unlimited\n");
+            } else {
+                printf("%llu\n", (unsigned long long)(limit / rlimit_options[k].unit));
+            }
+        }
+        return 0;
+    }
+
+    rlim_t new_limit;
+    if (parseRlimitValue(value, index, &new_limit) != 0) {
+        fprintf(stderr, "ulimit: %s: invalid limit\n", value);
+        return 2;
+    }
+    struct rlimit rl;
+    if (getrlimit(rlimit_options[index].resource, &rl) != 0) {
+        perror("getrlimit");
+        return 1;
+    }
+    if (soft) {
+        rl.rlim_cur = new_limit;
+    }
+    if (hard) {
+        rl.rlim_max = new_limit;
+    }
+    if (setrlimit(rlimit_options[index].resource, &rl) != 0) {
+        perror("ulimit");
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Parses a CPU list such as "0-3,6,8-9" into a CPU set.
+ *
+ * @param list The comma-separated list of CPUs and CPU ranges.
+ * @param set Receives the CPUs.
+ *
+ * @return 0 on success, -1 if the list is malformed or empty.
+ */
+int parseCpuList(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *p = list;
+    while (*p != '\0') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0) {
+            return -1;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) {
+                return -1;
+            }
+        }
+        if (last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return -1;
+        }
+        p = end;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+/**
+ * @brief Parses a 'cpus' prefix at the start of 'args'.
+ *
+ * Forms:
+ * - 'cpus LIST': pin the job (or pipeline stage) to the CPUs in LIST.
+ * - 'cpus spread': give each pipeline stage its own CPU, taken in turn from
+ * the CPUs the shell is allowed to run on, so stages don't contend.
+ * - 'cpus spread:LIST': the same, spreading over LIST only.
+ *
+ * @param args The words to parse.
+ * @param attrs Receives the affinity setting.
+ *
+ * @return The number of words consumed (0 if 'args' does not start with
+ * 'cpus'), or -1 on an invalid list (a message is printed).
+ */
+int parseCpuPrefix(char **args, SpawnAttributes *attrs) {
+    if (args[0] == NULL || strcmp(args[0], "cpus") != 0) {
+        return 0;
+    }
+    const char *list = args[1];
+    if (list == NULL) {
+        fprintf(stderr, "Usage: cpus LIST|spread[:LIST] command...\n");
+        return -1;
+    }
+    if (strncmp(list, "spread", 6) == 0 && (list[6] == '\0' || list[6] == ':')) {
+        attrs->affinity = AFFINITY_SPREAD;
+        if (list[6] == '\0') {
+            if (sched_getaffinity(0, sizeof(cpu_set_t), &attrs->cpus) != 0) {
+                perror("sched_getaffinity");
+                return -1;
+            }
+            return 2;
+        }
+        list += 7;
+    } else {
+        attrs->affinity = AFFINITY_MASK;
+    }
+    if (parseCpuList(list, &attrs->cpus) != 0) {
+        fprintf(stderr, "cpus: invalid CPU list '%s'\n", list);
+        return -1;
+    }
+    return 2;
+}
+
+/**
+ * @brief Turns an 'AFFINITY_SPREAD' setting into the mask of one stage.
+ *
+ * Stage 'stage' is pinned to the stage-th CPU of the spread set, wrapping
+ * around when there are more stages than CPUs. Other settings are left
+ * untouched.
+ *
+ * @param attrs The attributes of the stage, updated in place.
+ * @param stage The index of the stage (or job) being spawned.
+ */
+void resolveStageAffinity(SpawnAttributes *attrs, int stage) {
+    if (attrs->affinity != AFFINITY_SPREAD) {
+        return;
+    }
+    int n = CPU_COUNT(&attrs->cpus);
+    int target = stage % n;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &attrs->cpus) && target-- == 0) {
+            CPU_ZERO(&attrs->cpus);
+            CPU_SET(cpu, &attrs->cpus);
+            attrs->affinity = AFFINITY_MASK;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Parses one option of 'prio' or 'bgprio' into 'prio'.
+ *
+ * Options: '-n nice', '-c class[:level]' where class is 'idle', 'be'
+ * (best-effort), 'rt' (real-time) or 'none', and '--batch' / '--no-batch'.
+ *
+ * @param args The arguments being parsed.
+ * @param j The index of the option; advanced past any value it consumes.
+ * @param prio Receives the setting.
+ *
+ * @return 1 if an option was parsed, 0 if 'args[*j]' is not an option, -1 on
+ * an invalid value (a message is printed).
+ */
+static int parsePriorityOption(char **args, int *j, JobPriority *prio) {
+    const char *opt = args[*j];
+    if (strcmp(opt, "--batch") == 0 || strcmp(opt, "--no-batch") == 0) {
+        prio->sched_batch = (opt[2] == 'b');
+        return 1;
+    }
+    if (strcmp(opt, "-n") != 0 && strcmp(opt, "-c") != 0) {
+        return 0;
+    }
+    const char *value = args[*j + 1];
+    if (value == NULL) {
+        fprintf(stderr, "%s: option requires a value\n", opt);
+        return -1;
+    }
+    (*j)++;
+    if (opt[1] == 'n') {
+        char *end;
+        long nice = strtol(value, &end, 10);
+        if (*value == '\0' || *end != '\0' || nice < -20 || nice > 19) {
+            fprintf(stderr, "%s: nice value must be between -20 and 19\n", value);
+            return -1;
+        }
+        prio->nice = (int)nice;
+        return 1;
+    }
+    static const struct {
+        const char *name;
+        int io_class;
+    } classes[] = {
+        {"none", IOPRIO_CLASS_NONE}, {"rt", IOPRIO_CLASS_RT},
+        {"be", IOPRIO_CLASS_BE}, {"idle", IOPRIO_CLASS_IDLE},
+    };
+    size_t name_len = strcspn(value, ":");
+    for (size_t k = 0; k < sizeof(classes) / sizeof(classes[0]); k++) {
+        if (strlen(classes[k].name) == name_len && strncmp(value, classes[k].name, name_len) == 0) {
+            int level = value[name_len] == ':' ? atoi(value + name_len + 1) : 4;
+            if (level < 0 || level > 7) {
+                fprintf(stderr, "%s: I/O priority level must be between 0 and 7\n", value);
+                return -1;
+            }
+            prio->io_class = classes[k].io_class;
+            prio->io_level = classes[k].io_class == IOPRIO_CLASS_IDLE ? 0 : level;
+            return 1;
+        }
+    }
+    fprintf(stderr, "%s: unknown I/O class (expected idle, be, rt or none)\n", value);
+    return -1;
+}
+
+/**
+ * @brief Consumes the job prefixes at the start of a command line.
+ *
+ * A prefix sets per-job attributes for the command that follows it:
+ * - 'prio [-n nice] [-c class[:level]] [--batch|--no-batch]' sets the CPU
+ * and I/O priority of the job, overriding 'background_priority' for
+ * background and delayed jobs (and applying to foreground jobs too).
+ * - 'cpus LIST|spread[:LIST]' sets the CPU affinity of the job (see
+ * 'parseCpuPrefix'). Individual pipeline stages may also start with their
+ * own 'cpus' prefix, which overrides the job's for that stage.
+ * - 'limit [-c|-d|-f|-n|-s|-t|-u|-v value]...' sets resource limits (soft
+ * and hard) on the job's processes only; see 'rlimit_options'.
+ *
+ * Options not given on the prefix keep their value from
+ * 'background_priority'.
+ *
+ * @param args The command line, starting with any prefixes.
+ * @param attrs Receives the attributes. It is cleared first.
+ *
+ * @return The number of words consumed by prefixes (0 if there were none), or
+ * -1 on a usage error (a message is printed).
+ */
+int parseJobPrefixes(char **args, SpawnAttributes *attrs) {
+    memset(attrs, 0, sizeof(*attrs));
+    int j = 0;
+    while (args[j] != NULL) {
+        int skip = parseCpuPrefix(args + j, attrs);
+        if (skip < 0) {
+            return -1;
+        } else if (skip > 0) {
+            j += skip;
+            continue;
+        }
+        if (strcmp(args[j], "limit") == 0) {
+            skip = parseLimitPrefix(args + j, attrs);
+            if (skip < 0) {
+                return -1;
+            }
+            j += skip;
+            continue;
+        }
+        if (strcmp(args[j], "prio") != 0) {
+            break;
+        }
+        if (!attrs->priority.set) {
+            attrs->priority = background_priority;
+            attrs->priority.set = 1;
+        }
+        for (j++; args[j] != NULL; j++) {
+            int ret = parsePriorityOption(args, &j, &attrs->priority);
+            if (ret < 0) {
+                return -1;
+            }
+            if (ret == 0) {
+                break;
+            }
+        }
+    }
+    if (j > 0 && args[j] == NULL) {
+        fprintf(stderr, "Usage: [prio [-n nice] [-c idle|be|rt|none[:level]] [--batch|--no-batch]] "
+                        "[cpus LIST|spread[:LIST]] [limit -X value...] command...\n");
+        return -1;
+    }
+    return j;
+}
+
+/**
+ * @brief Implements the 'bgprio' built-in.
+ *
+ * Without arguments, prints the priority given by default to background and
+ * delayed jobs. Otherwise updates it with the options of 'prio', or disables
+ * it with '--off' ('--on' re-enables it). The default is nice 10, best-effort
+ * I/O level 7 and 'SCHED_BATCH', so background work yields to the
+ * interactive foreground.
+ *
+ * @param args The arguments of the command, starting with "bgprio".
+ *
+ * @return 0 on success, 2 on a usage error.
+ */
+int bgprioCommand(char **args) {
+    static const char *class_names[] = {"none", "rt", "be", "idle"};
+    JobPriority prio = background_priority;
+    for (int j = 1; args[j] != NULL; j++) {
+        if (strcmp(args[j], "--off") == 0 || strcmp(args[j], "--on") == 0) {
+            prio.set = (args[j][3] == 'n');
+            continue;
+        }
+        int ret = parsePriorityOption(args, &j, &prio);
+        if (ret <= 0) {
+            if (ret == 0) {
+                fprintf(stderr, "Usage: bgprio [--on|--off] [-n nice] [-c idle|be|rt|none[:level]] "
+                                "[--batch|--no-batch]\n");
+            }
+            return 2;
+        }
+    }
+    if (args[1] != NULL) {
+        background_priority = prio;
+        return 0;
+    }
+    if (!prio.set) {
+        printf("background priority: off\n");
+    } else {
+        printf("background priority: nice %d, io %s:%d, %s\n", prio.nice, class_names[prio.io_class],
+               prio.io_level, prio.sched_batch ? "SCHED_BATCH" : "SCHED_OTHER");
+    }
+    return 0;
+}
+
+/**
+ * @brief Turns the calling process into the command: never returns.
+ *
+ * This is the common tail of every child the shell starts, whether it was
+ * forked by the shell itself or by the fork server. It restores the default
+ * signal handlers, applies the job's attributes and redirections, and
+ * executes the command using 'execvp'.
+ *
+ * @param argv The null-terminated argument vector, already stripped of
+ * redirections. If empty, the child only performs the redirections.
+ * @param redirs The compiled redirections of the command.
+ * @param attrs Settings applied before exec, or NULL.
+ */
+void execChild(char **argv, const RedirectionList *redirs, const SpawnAttributes *attrs) {
+    // Restore default signal handlers for child process.  This is important
+    // for proper job control.  The parent shell might have set signal handlers
+    // that we don't want the child process to inherit.
+    signal(SIGINT, SIG_DFL);  // Restore default behavior for Ctrl+C
+    signal(SIGQUIT, SIG_DFL); // Restore default behavior for Ctrl+backslash
+    signal(SIGTSTP, SIG_DFL); // Restore default behavior for Ctrl+Z
+    signal(SIGCHLD, SIG_DFL);
+    applySpawnAttributes(attrs);
+
+    if (applyRedirections(redirs) != 0) {
+        _exit(1);
+    }
+    if (argv[0] == NULL) {
+        _exit(0); // Redirections only, e.g. "> file" to truncate
+    }
+
+    execvp(argv[0], argv);
+    perror("execvp"); // Only gets here if execvp fails
+    // _exit: exit() would flush stdio streams shared with the shell (and
+    // rewind a script being read), so the child must skip it.
+    _exit(127);
+}
+
+/**
+ * @brief Starts a child running 'argv' with the given standard input and output.
+ *
+ * The child is created by the fork server when it is enabled, and forked
+ * directly otherwise. Either way it is a child of the shell, so it is waited
+ * for with 'wait4' as usual. Standard input and output that are the shell's
+ * own, and standard error, are replaced by the calling thread's
+ * 'job_stdin_fd' and 'job_output_fd' when those are set.
+ *
+ * @param argv The argument vector, already stripped of redirections.
+ * @param redirs The compiled redirections, applied after 'in_fd'/'out_fd'.
+ * @param attrs Settings applied before exec, or NULL.
+ * @param in_fd The descriptor to use as standard input (e.g. a pipe end).
+ * @param out_fd The descriptor to use as standard output.
+ * @param close_fds Descriptors the child must close (e.g. all pipe ends).
+ * @param close_count The number of entries in 'close_fds'.
+ *
+ * @return The PID of the child, or -1 on failure (an error is printed).
+ */
+pid_t startChild(char **argv, const RedirectionList *redirs, const SpawnAttributes *attrs,
+                 int in_fd, int out_fd, const int *close_fds, int close_count) {
+    fflush(stdout); // Don't let the child inherit (and re-emit) buffered output
+    int err_fd = STDERR_FILENO;
+    if (job_stdin_fd >= 0 && in_fd == STDIN_FILENO) {
+        in_fd = job_stdin_fd;
+    }
+    if (job_output_fd >= 0) {
+        out_fd = out_fd == STDOUT_FILENO ? job_output_fd : out_fd;
+        err_fd = job_output_fd;
+    }
+    if (fork_server_enabled) {
+        pid_t pid = forkServerSpawn(argv, redirs, attrs, in_fd, out_fd, err_fd);
+        if (pid != -2) {
+            return pid; // -2: the server is unavailable, fork directly instead
+        }
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Child process
+        if (in_fd != STDIN_FILENO) {
+            dup2(in_fd, STDIN_FILENO);
+        }
+        if (out_fd != STDOUT_FILENO) {
+            dup2(out_fd, STDOUT_FILENO);
+        }
+        if (err_fd != STDERR_FILENO) {
+            dup2(err_fd, STDERR_FILENO);
+        }
+        for (int k = 0; k < close_count; k++) {
+            close(close_fds[k]);
+        }
+        execChild(argv, redirs, attrs);
+    } else if (pid < 0) {
+        perror("fork");
+    }
+    return pid;
+}
+
+#define FORK_SERVER_MAX_STRINGS (128 * 1024)
+
+/**
+ * A spawn request sent to the fork server. It is followed in the same
+ * message by 'strings_len' bytes of null-terminated strings: the working
+ * directory, then the 'argc' arguments, the 'envc' environment entries and
+ * the redirection paths ('path_offsets' locates each one, -1 for none).
+ * Standard input, output and error travel as 'SCM_RIGHTS' descriptors.
+ *
+ * The server was forked when the shell started, so the request also carries
+ * the process state that a child forked by the shell would inherit and that
+ * may have changed since: resource limits ('ulimit', or 'prlimit' from
+ * outside), the umask, the nice value and the CPU affinity.
+ */
+typedef struct {
+    struct rlimit rlimits[RLIM_NLIMITS];
+    unsigned rlimits_known;      // bit k set if 'rlimits[k]' was read
+    mode_t umask;
+    int nice;
+    cpu_set_t affinity;
+    SpawnAttributes attrs;
+    int redir_count;
+    Redirection redirs[MAX_REDIRECTIONS];
+    int path_offsets[MAX_REDIRECTIONS];
+    int argc;
+    int envc;
+    size_t strings_len;
+} ForkServerRequest;
+
+typedef struct {
+    pid_t pid;
+    int error;
+} ForkServerReply;
+
+/**
+ * @brief Appends a string to a request's string area.
+ *
+ * @return The offset of the string, or -1 if it does not fit.
+ */
+static int appendRequestString(char *strings, size_t *len, const char *str) {
+    size_t n = strlen(str) + 1;
+    if (*len + n > FORK_SERVER_MAX_STRINGS) {
+        return -1;
+    }
+    memcpy(strings + *len, str, n);
+    *len += n;
+    return (int)(*len - n);
+}
+
+/**
+ * @brief Gives a child of the fork server the shell's current resource
+ * limits, umask, nice value and CPU affinity, as listed in the request.
+ * The job's own settings are applied afterwards by 'execChild'.
+ *
+ * Limits are only set where they differ from the server's; as with 'ulimit',
+ * lowering a hard limit is always allowed, so a child never ends up with
+ * more than the shell allows.
+ *
+ * @see https://man7.org/linux/man-pages/man2/getrlimit.2.html
+ */
+static void inheritShellState(const ForkServerRequest *request) {
+    for (int k = 0; k < RLIM_NLIMITS; k++) {
+        struct rlimit rl;
+        if ((request->rlimits_known & (1u << k)) != 0 && getrlimit(k, &rl) == 0
+            && (rl.rlim_cur != request->rlimits[k].rlim_cur
+                || rl.rlim_max != request->rlimits[k].rlim_max)
+            && setrlimit(k, &request->rlimits[k]) != 0) {
+            perror("setrlimit");
+        }
+    }
+    umask(request->umask);
+    if (getpriority(PRIO_PROCESS, 0) != request->nice && setpriority(PRIO_PROCESS, 0, request->nice) != 0) {
+        perror("setpriority");
+    }
+    if (CPU_COUNT(&request->affinity) > 0 && sched_setaffinity(0, sizeof(cpu_set_t), &request->affinity) != 0) {
+        perror("sched_setaffinity");
+    }
+}
+
+/**
+ * @brief Main loop of the fork server process.
+ *
+ * Receives spawn requests on 'sock' and creates each child with 'clone' and
+ * 'CLONE_PARENT', which makes the child a child of the shell rather than of
+ * the server. The shell can therefore wait for it, collect its 'rusage' and
+ * watch it through a pidfd exactly as if it had forked it itself, while the
+ * cost of copying the address space is paid by this small single-threaded
+ * process instead of the shell. Replies with the PID (or the 'errno' of a
+ * failed 'clone'). Exits when the shell closes its end of the socket.
+ *
+ * @see https://man7.org/linux/man-pages/man2/clone.2.html
+ * @see https://man7.org/linux/man-pages/man7/unix.7.html
+ */
+static void forkServerMain(int sock) {
+    static char strings[FORK_SERVER_MAX_STRINGS];
+    ForkServerRequest request;
+    union {
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    while (1) {
+        struct iovec iov[2] = {{&request, sizeof(request)}, {strings, sizeof(strings)}};
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2,
+                             .msg_control = control.buf, .msg_controllen = sizeof(control.buf)};
+        ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            _exit(0); // The shell went away
+        }
+
+        int fds[3] = {-1, -1, -1};
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        }
+
+        // Rebuild the pointers into the string area
+        char *cwd = strings;
+        char *argv[MAX_ARGS];
+        char **envp = malloc((request.envc + 1) * sizeof(char *));
+        char *p = cwd + strlen(cwd) + 1;
+        for (int k = 0; k < request.argc && k < MAX_ARGS - 1; k++) {
+            argv[k] = p;
+            p += strlen(p) + 1;
+        }
+        argv[request.argc < MAX_ARGS - 1 ? request.argc : MAX_ARGS - 1] = NULL;
+        for (int k = 0; envp != NULL && k < request.envc; k++) {
+            envp[k] = p;
+            p += strlen(p) + 1;
+        }
+        if (envp != NULL) {
+            envp[request.envc] = NULL;
+        }
+        RedirectionList redirs;
+        redirs.count = request.redir_count;
+        for (int k = 0; k < request.redir_count; k++) {
+            redirs.actions[k] = request.redirs[k];
+            redirs.actions[k].path = request.path_offsets[k] >= 0 ? strings + request.path_offsets[k] : NULL;
+        }
+
+        ForkServerReply reply = {-1, 0};
+        pid_t pid = (pid_t)syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL, NULL);
+        if (pid == 0) {
+            close(sock);
+            for (int k = 0; k < 3; k++) {
+                if (fds[k] >= 0) {
+                    dup2(fds[k], k);
+                }
+            }
+            for (int k = 0; k < 3; k++) {
+                if (fds[k] > STDERR_FILENO) {
+                    close(fds[k]);
+                }
+            }
+            if (chdir(cwd) != 0) {
+                perror(cwd);
+                _exit(1);
+            }
+            if (envp != NULL) {
+                environ = envp;
+            }
+            inheritShellState(&request);
+            execChild(argv, &redirs, &request.attrs);
+        }
+        reply.pid = pid;
+        reply.error = pid < 0 ? errno : 0;
+        for (int k = 0; k < 3; k++) {
+            if (fds[k] >= 0) {
+                close(fds[k]);
+            }
+        }
+        free(envp);
+        send(sock, &reply, sizeof(reply), MSG_NOSIGNAL);
+    }
+}
+
+/**
+ * @brief Starts the fork server.
+ *
+ * Must be called before the shell creates any thread, so the server is a
+ * small, single-threaded copy of the shell. The two processes talk over a
+ * 'SOCK_SEQPACKET' socket pair, which keeps every request a single message.
+ *
+ * @return 0 on success, -1 on failure (the shell then forks directly).
+ * @see https://man7.org/linux/man-pages/man2/socketpair.2.html
+ */
+int startForkServer() {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) {
+        perror("socketpair");
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        forkServerMain(sv[1]);
+        _exit(0);
+    }
+    close(sv[1]);
+    fork_server_fd = sv[0];
+    fork_server_pid = pid;
+    fork_server_enabled = 1;
+    return 0;
+}
+
+/**
+ * @brief Shuts the fork server down by closing the socket and reaps it.
+ */
+void stopForkServer() {
+    if (fork_server_fd < 0) {
+        return;
+    }
+    fork_server_enabled = 0;
+    close(fork_server_fd);
+    fork_server_fd = -1;
+    waitpid(fork_server_pid, NULL, 0);
+    fork_server_pid = -1;
+}
+
+/**
+ * @brief Asks the fork server to start a child.
+ *
+ * Sends the arguments, the environment, the current working directory, the
+ * compiled redirections and attributes, and passes 'in_fd', 'out_fd' and
+ * 'err_fd' along with 'SCM_RIGHTS'. Requests from different threads
+ * are serialized by 'fork_server_mutex'.
+ *
+ * @return The PID of the child, -1 if the server could not create it, or -2
+ * if the request could not be made (too large, or the server is gone, in
+ * which case it is disabled); the caller should then fork directly.
+ * @see https://man7.org/linux/man-pages/man3/cmsg.3.html
+ */
+pid_t forkServerSpawn(char **argv, const RedirectionList *redirs, const SpawnAttributes *attrs,
+                      int in_fd, int out_fd, int err_fd) {
+    static char strings[FORK_SERVER_MAX_STRINGS];
+    static ForkServerRequest request;
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        return -2;
+    }
+
+    pthread_mutex_lock(&fork_server_mutex);
+    memset(&request, 0, sizeof(request));
+    if (attrs != NULL) {
+        request.attrs = *attrs;
+    }
+    for (int k = 0; k < RLIM_NLIMITS; k++) {
+        if (getrlimit(k, &request.rlimits[k]) == 0) {
+            request.rlimits_known |= 1u << k;
+        }
+    }
+    request.umask = shell_umask;
+    request.nice = getpriority(PRIO_PROCESS, 0);
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &request.affinity) != 0) {
+        CPU_ZERO(&request.affinity); // Leave the server's
+    }
+    size_t len = 0;
+    int ok = appendRequestString(strings, &len, cwd) >= 0;
+    for (request.argc = 0; ok && argv[request.argc] != NULL; request.argc++) {
+        ok = appendRequestString(strings, &len, argv[request.argc]) >= 0;
+    }
+    for (request.envc = 0; ok && environ[request.envc] != NULL; request.envc++) {
+        ok = appendRequestString(strings, &len, environ[request.envc]) >= 0;
+    }
+    request.redir_count = redirs->count;
+    for (int k = 0; ok && k < redirs->count; k++) {
+        request.redirs[k] = redirs->actions[k];
+        request.redirs[k].path = NULL;
+        request.path_offsets[k] = -1;
+        if (redirs->actions[k].path != NULL) {
+            request.path_offsets[k] = appendRequestString(strings, &len, redirs->actions[k].path);
+            ok = request.path_offsets[k] >= 0;
+        }
+    }
+    request.strings_len = len;
+    if (!ok) {
+        pthread_mutex_unlock(&fork_server_mutex);
+        return -2; // Too large for one message
+    }
+
+    int fds[3] = {in_fd, out_fd, err_fd};
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov[2] = {{&request, sizeof(request)}, {strings, len}};
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2,
+                         .msg_control = control.buf, .msg_controllen = sizeof(control.buf)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ForkServerReply reply;
+    if (sendmsg(fork_server_fd, &msg, MSG_NOSIGNAL) < 0
+        || recv(fork_server_fd, &reply, sizeof(reply), 0) != sizeof(reply)) {
+        perror("fork server");
+        fprintf(stderr, "fork server: disabled, forking directly\n");
+        fork_server_enabled = 0;
+        pthread_mutex_unlock(&fork_server_mutex);
+        return -2;
+    }
+    pthread_mutex_unlock(&fork_server_mutex);
+    if (reply.pid < 0) {
+        errno = reply.error;
+        perror("fork server: clone");
+        return -1;
+    }
+    return reply.pid;
+}
+
+/**
+ * @brief Forks a child that performs 'redirs' and executes 'argv'.
+ *
+ * This is the spawn step shared by 'executeCommand' and the built-ins that
+ * manage a child themselves (such as 'timeout'). The child inherits the
+ * shell's standard input and output (see 'startChild'); the parent returns
+ * immediately without waiting. A single command is stage 0 as far as
+ * 'cpus spread' is concerned, so it is pinned to the first CPU of the set.
+ *
+ * @param argv The null-terminated argument vector, already stripped of
+ * redirections. If empty, the child only performs the redirections.
+ * @param redirs The compiled redirections of the command.
+ * @param attrs Settings applied in the child before exec, or NULL.
+ *
+ * @return The PID of the child, or -1 if it could not be started (an error
+ * is printed).
+ * @see https://man7.org/linux/man-pages/man2/fork.2.html
+ * @see https://man7.org/linux/man-pages/man3/execvp.3.html
+ */
+pid_t spawnCommand(char **argv, const RedirectionList *redirs, const SpawnAttributes *attrs) {
+    SpawnAttributes resolved;
+    if (attrs != NULL && attrs->affinity == AFFINITY_SPREAD) {
+        resolved = *attrs;
+        resolveStageAffinity(&resolved, 0);
+        attrs = &resolved;
+    }
+    return startChild(argv, redirs, attrs, STDIN_FILENO, STDOUT_FILENO, NULL, 0);
+}
+
+/**
+ * @brief Executes a command with its arguments, handling both foreground and background 
+ * execution, as well as input/output redirection.
+ *
+ * This function forks a child process to execute the specified command. In the
+ * child process, it restores the default signal handlers for 'SIGINT', 'SIGQUIT',
+ * 'SIGTSTP', and 'SIGCHLD'. The redirections in the command arguments are
+ * compiled by 'parseRedirections' before forking and performed in the child by
+ * 'applyRedirections', in the order they were written. Finally, it executes
+ * the command using 'execvp'. If 'execvp' fails, an error message is printed.
+ *
+ * In the parent process, if the 'background' flag is false (foreground execution),
+ * it waits for the child process to complete and retrieves its exit status or
+ * termination signal. If the 'background' flag is true, it prints the process ID
+ * of the child process and then attempts to detach it using the 'disownProcess'
+ * function (which is assumed to be defined elsewhere).
+ *
+ * @param args A null-terminated array of character pointers representing the
+ * command and its arguments (e.g., {"ls", "-l", NULL}). The first element
+ * ('args[0]') should be the command to execute. Redirection operators (see
+ * 'parseRedirections') and their targets can be included in this array.
+ * @param background An integer flag. If non-zero, the command is executed in
+ * the background; otherwise, it's executed in the foreground and the parent
+ * waits for its completion.
+ * @param attrs Settings applied to the child before exec (see
+ * 'SpawnAttributes'), or NULL.
+ * @param usage If not NULL, receives the resource usage of a foreground
+ * command as reported by 'wait4' (zeroed for background commands).
+ *
+ * @return The exit status of a foreground command as reported by
+ * 'statusToExitCode' (127 if the command could not be executed, 2 if its
+ * redirections could not be parsed), or 0 once a background command has been
+ * started.
+ *
+ * @note This function assumes that the 'disownProcess' function is defined
+ * elsewhere and handles the detachment of background processes. Pipes are
+ * handled by 'handlePipes'. Error handling is performed using 'perror' and
+ * exiting the child process on failure.
+ * 
+ * @see https://man7.org/linux/man-pages/man2/pipe.2.html
+ * @see https://man7.org/linux/man-pages/man2/fork.2.html
+ * @see https://man7.org/linux/man-pages/man2/dup2.html
+ * @see https://man7.org/linux/man-pages/man3/execvp.3.html
+ * @see https://man7.org/linux/man-pages/man2/wait4.2.html
+ */
+int executeCommand(char **args, int background, const SpawnAttributes *attrs, struct rusage *usage) {
+    char *argv[MAX_ARGS];
+    RedirectionList redirs;
+    if (parseRedirections(args, argv, &redirs) != 0) {
+        return 2;
+    }
+
+    struct rusage ignored;
+    if (usage == NULL) {
+        usage = &ignored;
+    }
+    memset(usage, 0, sizeof(*usage));
+
+    pid_t pid = spawnCommand(argv, &redirs, attrs);
+    if (pid > 0) {
+        // Parent process
+        if (!background) {
+            // Wait for foreground process to complete
+            int status;
+            if (wait4(pid, &status, 0, usage) < 0) {
+                perror("wait4");
+                return 1;
+            }
+            return statusToExitCode(status);
+        } else {
+            // Print the PID of the background process
+            printf("[Background] Process ID: %d\n", pid);
+            // Detach the process using signal handling.
+            if (disownProcess(pid) != 0) {
+                perror("disownProcess");
+            }
+        }
+    } else {
+        exit(1); // Exit on fork error.
+    }
+    return 0;
+}
+
+/**
+ * @brief Converts a raw wait status into a shell exit status.
+ *
+ * Follows the usual shell convention: a process that exited normally reports
+ * its exit code, and a process killed by a signal reports 128 plus the signal
+ * number (e.g. 130 for SIGINT).
+ *
+ * @param status The status value filled in by 'waitpid'.
+ *
+ * @return The exit status as it is exposed through '$?' and 'PIPESTATUS'.
+ * @see https://man7.org/linux/man-pages/man2/wait.2.html
+ */
+int statusToExitCode(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    } else if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return 1;
+}
+
+/**
+ * @brief Disowns a process, allowing it to continue running after the shell exits.
+ *
+ * This function records the background process with the given process ID
+ * ('pid') in the 'background_pids' table so that it can be reaped later by
+ * 'reapBackgroundJobs' without the shell ever blocking on it.
+ *
+ * SIGCHLD used to be set to 'SIG_IGN' here instead, but that makes the kernel
+ * reap every child automatically, so foreground 'waitpid' calls lost the exit
+ * status needed for '$?'.
+ *
+ * @param pid The process ID of the process to disown.
+ *
+ * @return 0 on success, -1 on error (the table is full; the process will then
+ * stay a zombie until the shell exits).
+ * @see https://man7.org/linux/man-pages/man1/disown.1.html
+ * @see https://man7.org/linux/man-pages/man2/wait.2.html
+ */
+int disownProcess(pid_t pid) {
+    int ret = 0;
+    pthread_mutex_lock(&background_mutex);
+    if (background_count < MAX_BACKGROUND_JOBS) {
+        background_pids[background_count++] = pid;
+    } else {
+        errno = EAGAIN;
+        ret = -1;
+    }
+    pthread_mutex_unlock(&background_mutex);
+    return ret;
+}
+
+/**
+ * @brief Reaps background processes that have finished.
+ *
+ * Polls every process in 'background_pids' with 'waitpid' and 'WNOHANG' and
+ * drops the ones that have terminated from the table. It is called before
+ * each prompt so finished background jobs never linger as zombies, and since
+ * only known background PIDs are waited for, it cannot steal the status of a
+ * foreground command.
+ *
+ * @see https://man7.org/linux/man-pages/man2/wait.2.html
+ */
+void reapBackgroundJobs() {
+    pthread_mutex_lock(&background_mutex);
+    int i = 0;
+    while (i < background_count) {
+        int status;
+        pid_t ret = waitpid(background_pids[i], &status, WNOHANG);
+        if (ret == 0) {
+            i++;
+            continue;
+        }
+        // Finished (or no longer our child); swap the last entry into place.
+        background_pids[i] = background_pids[--background_count];
+    }
+    pthread_mutex_unlock(&background_mutex);
+}
+
+/**
+ * @brief Handles the execution of commands connected by pipes.
+ *
+ * This function takes an array of arguments representing a pipeline of commands
+ * and executes them by creating a series of child processes connected by pipes.
+ * It iterates through the arguments, identifying the pipe symbols ("|") to
+ * determine the individual commands in the pipeline, and compiles the
+ * redirections of every stage with 'parseRedirections' before anything is
+ * started. For each command, it creates a child process, sets up the
+ * necessary pipe file descriptors, applies the stage's own redirections on top
+ * of them (so '2>&1 |' sends standard error down the pipe), and executes the
+ * command using 'execvp'. The parent process waits for all
+ * child processes to complete, unless the last command is to be run in the
+ * background.
+ *
+ * @param args A null-terminated array of character pointers representing the
+ * commands and their arguments, including pipe symbols ("|").
+ * @param num_commands The number of commands in the pipeline.
+ * @param background An integer flag indicating whether the last command in the
+ * pipeline should be executed in the background (1) or foreground (0).
+ * @param attrs Settings applied to every stage before exec, or NULL. A stage
+ * starting with its own 'cpus' prefix overrides the CPU affinity, and an
+ * 'AFFINITY_SPREAD' setting places each stage on a different CPU.
+ * @param result If not NULL, receives the exit status of every stage of a
+ * foreground pipeline (see 'PipelineResult').
+ *
+ * @return The exit status of the pipeline: the status of the last stage, or
+ * with 'set -o pipefail' the status of the rightmost stage that failed. A
+ * background pipeline reports 0, and a pipeline whose redirections cannot be
+ * parsed reports 2 without running.
+ *
+ * @note This function uses 'pipe', 'fork', 'dup2', 'close', 'execvp', and
+ * 'waitpid' system calls.  It handles errors during pipe creation,
+ * process creation, and execution.
+ * @note dup2 is functionality same as dup in C, but user specifies file descriptor
+ */
+int handlePipes(char **args, int num_commands, int background, const SpawnAttributes *attrs,
+                PipelineResult *result) {
+    pid_t pids[MAX_ARGS];
+    char *stage_argv[num_commands][MAX_ARGS];
+    RedirectionList stage_redirs[num_commands];
+    SpawnAttributes stage_attrs[num_commands];
+
+    int arg_index = 0;
+    for (int i = 0; i < num_commands; i++) {
+        char *command_args[MAX_ARGS];
+        int current_arg = 0;
+        while (args[arg_index] != NULL && strcmp(args[arg_index], "|") != 0) {
+            command_args[current_arg++] = args[arg_index++];
+        }
+        command_args[current_arg] = NULL; // Null-terminate arguments for the current command
+        if (args[arg_index] != NULL && strcmp(args[arg_index], "|") == 0) {
+            arg_index++; // Move past the pipe symbol
+        }
+        if (attrs != NULL) {
+            stage_attrs[i] = *attrs;
+        } else {
+            memset(&stage_attrs[i], 0, sizeof(stage_attrs[i]));
+        }
+        int skip = parseCpuPrefix(command_args, &stage_attrs[i]); // per-stage 'cpus'
+        if (skip < 0) {
+            return 2;
+        }
+        resolveStageAffinity(&stage_attrs[i], i);
+        if (parseRedirections(command_args + skip, stage_argv[i], &stage_redirs[i]) != 0) {
+            return 2;
+        }
+    }
+
+    int pipefd[2 * (num_commands - 1)];
+    for (int i = 0; i < num_commands - 1; i++) {
+        if (pipe(pipefd + i * 2) < 0) {
+            perror("pipe");
+            exit(1);
+        }
+    }
+
+    for (int i = 0; i < num_commands; i++) {
+        // Input from the previous pipe, output to the next one
+        int in_fd = i > 0 ? pipefd[(i - 1) * 2] : STDIN_FILENO;
+        int out_fd = i < num_commands - 1 ? pipefd[i * 2 + 1] : STDOUT_FILENO;
+        pid_t pid = startChild(stage_argv[i], &stage_redirs[i], &stage_attrs[i], in_fd, out_fd,
+                               pipefd, 2 * (num_commands - 1));
+        if (pid < 0) {
+            exit(1);
+        }
+        pids[i] = pid;
+    }
+
+    // Close all pipe ends in the parent
+    for (int i = 0; i < 2 * (num_commands - 1); i++) {
+        close(pipefd[i]);
+    }
+
+    if (background) {
+        for (int i = 0; i < num_commands; i++) {
+            if (disownProcess(pids[i]) != 0) {
+                perror("disownProcess");
+            }
+            if (result != NULL) {
+                result->status[i] = 0;
+                memset(&result->usage[i], 0, sizeof(result->usage[i]));
+            }
+        }
+        if (result != NULL) {
+            result->count = num_commands;
+        }
+        return 0;
+    }
+
+    // Wait for every stage, in order, so each status lands in its own slot
+    int exit_code = 0;
+    for (int i = 0; i < num_commands; i++) {
+        int status;
+        int code = 1;
+        struct rusage usage;
+        memset(&usage, 0, sizeof(usage));
+        if (wait4(pids[i], &status, 0, &usage) < 0) {
+            perror("wait4");
+        } else {
+            code = statusToExitCode(status);
+        }
+        if (result != NULL) {
+            result->status[i] = code;
+            result->usage[i] = usage;
+        }
+        if (pipefail_enabled) {
+            if (code != 0) {
+                exit_code = code; // rightmost failing stage wins
+            }
+        } else if (i == num_commands - 1) {
+            exit_code = code;
+        }
+    }
+    if (result != NULL) {
+        result->count = num_commands;
+    }
+    return exit_code;
+}
+
+/**
+ * @brief Runs a tokenized command line, with or without pipes.
+ *
+ * Counts the pipe symbols in 'args' and hands the command line to
+ * 'handlePipes' or 'executeCommand' accordingly. A single command is recorded
+ * in 'result' as a one-stage pipeline, so callers can treat both cases alike.
+ *
+ * @param args A null-terminated array of arguments, possibly containing "|".
+ * @param background Non-zero to run the command line in the background.
+ * @param attrs Settings applied to every child before exec, or NULL.
+ * @param result If not NULL, receives the per-stage exit statuses.
+ *
+ * @return The exit status of the command line.
+ */
+int runCommandLine(char **args, int background, const SpawnAttributes *attrs, PipelineResult *result) {
+    int numCommands = 1;
+    for (int j = 0; args[j] != NULL; j++) {
+        if (strcmp(args[j], "|") == 0)
+            numCommands++;
+    }
+    if (numCommands > 1) {
+        return handlePipes(args, numCommands, background, attrs, result);
+    }
+    int code = executeCommand(args, background, attrs, result != NULL ? &result->usage[0] : NULL);
+    if (result != NULL) {
+        result->count = 1;
+        result->status[0] = code;
+    }
+    return code;
+}
+
+/**
+ * @brief Converts a 'timeval' into seconds.
+ */
+static double timevalSeconds(const struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/**
+ * @brief Prints the report of the 'time' keyword to standard error.
+ *
+ * The first lines give the wall-clock time measured with 'CLOCK_MONOTONIC'
+ * (nanosecond resolution) and the user and system CPU time summed over all
+ * stages. A table then lists, for each pipeline stage, its exit status, CPU
+ * times, maximum resident set size, minor and major page faults, and
+ * voluntary and involuntary context switches, as collected by 'wait4'.
+ *
+ * @param args The command line that was timed (used for stage names).
+ * @param start The 'CLOCK_MONOTONIC' time taken before the first fork.
+ * @param end The 'CLOCK_MONOTONIC' time taken after the last stage was reaped.
+ * @param result The per-stage statuses and resource usage.
+ * @see https://man7.org/linux/man-pages/man2/getrusage.2.html
+ * @see https://man7.org/linux/man-pages/man2/clock_gettime.2.html
+ */
+void printTimingReport(char **args, const struct timespec *start, const struct timespec *end,
+                       const PipelineResult *result) {
+    long long elapsed_ns = (long long)(end->tv_sec - start->tv_sec) * 1000000000LL
+                           + (end->tv_nsec - start->tv_nsec);
+    double user = 0, sys = 0;
+    for (int i = 0; i < result->count; i++) {
+        user += timevalSeconds(&result->usage[i].ru_utime);
+        sys += timevalSeconds(&result->usage[i].ru_stime);
+    }
+
+    fprintf(stderr, "\nreal\t%lld.%09llds\n", elapsed_ns / 1000000000LL, elapsed_ns % 1000000000LL);
+    fprintf(stderr, "user\t%.6fs\n", user);
+    fprintf(stderr, "sys\t%.6fs\n", sys);
+    fprintf(stderr, "%-5s %6s %10s %10s %12s %8s %8s %7s %7s  %s\n", "stage", "status", "user(s)",
+            "sys(s)", "maxrss(KiB)", "minflt", "majflt", "nvcsw", "nivcsw", "command");
+
+    int arg_index = 0;
+    for (int i = 0; i < result->count; i++) {
+        const struct rusage *ru = &result->usage[i];
+        // Name each stage after the first word following the previous pipe
+        const char *name = args[arg_index] != NULL ? args[arg_index] : "";
+        while (args[arg_index] != NULL && strcmp(args[arg_index], "|") != 0) {
+            arg_index++;
+        }
+        if (args[arg_index] != NULL) {
+            arg_index++;
+        }
+        fprintf(stderr, "%-5d %6d %10.6f %10.6f %12ld %8ld %8ld %7ld %7ld  %s\n", i,
+                result->status[i], timevalSeconds(&ru->ru_utime), timevalSeconds(&ru->ru_stime),
+                ru->ru_maxrss, ru->ru_minflt, ru->ru_majflt, ru->ru_nvcsw, ru->ru_nivcsw, name);
+    }
+}
+
+/**
+ * @brief Checks the index of a '${PIPESTATUS[...]}' expansion: '@', '*' or
+ * digits, followed by "]}".
+ *
+ * @return A pointer to the ']', or NULL if 'index' is not a valid index.
+ */
+static const char *findPipestatusClose(const char *index) {
+    const char *close = *index == '@' || *index == '*' ? index + 1 : index + strspn(index, "0123456789");
+    return close > index && strncmp(close, "]}", 2) == 0 ? close : NULL;
+}
+
+/**
+ * @brief Expands the exit status variables in a command line.
+ *
+ * Copies 'src' into 'dest', replacing:
+ * - '$?' with the exit status of the last command line,
+ * - '${PIPESTATUS[@]}' and '${PIPESTATUS[*]}' with the space-separated exit
+ * statuses of every stage of the last pipeline,
+ * - '${PIPESTATUS[n]}' with the status of stage 'n' (empty if out of range),
+ * - '$PIPESTATUS' with the status of the first stage, as bash does.
+ *
+ * Anything else is copied verbatim, including everything between single
+ * quotes (outside double quotes), as in other shells. The output is
+ * truncated to fit 'size'.
+ *
+ * @param src The command line as typed.
+ * @param dest The buffer receiving the expanded command line.
+ * @param size The size of 'dest' in bytes.
+ */
+void expandStatusVariables(const char *src, char *dest, size_t size) {
+    size_t len = 0;
+    char value[MAX_COMMAND_LENGTH];
+    int in_double = 0;
+
+    while (*src != '\0' && len + 1 < size) {
+        value[0] = '\0';
+        const char *close;
+        if (*src == '"') {
+            in_double = !in_double;
+            dest[len++] = *src++;
+            continue;
+        } else if (*src == '\'' && !in_double) {
+            // Copy the single-quoted span as it is
+            do {
+                dest[len++] = *src++;
+            } while (*src != '\0' && *src != '\'' && len + 1 < size);
+            if (*src == '\'' && len + 1 < size) {
+                dest[len++] = *src++;
+            }
+            continue;
+        } else if (strncmp(src, "$?", 2) == 0) {
+            snprintf(value, sizeof(value), "%d", last_exit_status);
+            src += 2;
+        } else if (strncmp(src, "${PIPESTATUS[", 13) == 0 && (close = findPipestatusClose(src + 13)) != NULL) {
+            const char *index = src + 13;
+            if (*index == '@' || *index == '*') {
+                size_t used = 0;
+                for (int i = 0; i < last_pipeline.count && used < sizeof(value); i++) {
+                    used += snprintf(value + used, sizeof(value) - used, "%s%d",
+                                     i > 0 ? " " : "", last_pipeline.status[i]);
+                }
+            } else {
+                int n = atoi(index);
+                if (n >= 0 && n < last_pipeline.count) {
+                    snprintf(value, sizeof(value), "%d", last_pipeline.status[n]);
+                }
+            }
+            src = close + 2;
+        } else if (strncmp(src, "$PIPESTATUS", 11) == 0) {
+            snprintf(value, sizeof(value), "%d", last_pipeline.count > 0 ? last_pipeline.status[0] : 0);
+            src += 11;
+        } else {
+            dest[len++] = *src++;
+            continue;
+        }
+        for (char *v = value; *v != '\0' && len + 1 < size; v++) {
+            dest[len++] = *v;
+        }
+    }
+    dest[len] = '\0';
+}
+
+/**
+ * @brief Implements the 'set' built-in for shell options.
+ *
+ * Supported options:
+ * - '-e' / '+e' ('-o errexit' / '+o errexit'): exit the shell as soon as a
+ * command line fails.
+ * - '-o pipefail' / '+o pipefail': make a pipeline fail with the status of
+ * its rightmost failing stage instead of the status of its last stage.
+ *
+ * Flags may be combined ('set -eo pipefail'). Without arguments, or with a
+ * bare '-o', the current option values are printed.
+ *
+ * @param args The arguments of the command, starting with "set".
+ *
+ * @return 0 on success, 2 on an unknown option.
+ */
+int setOptions(char **args) {
+    if (args[1] == NULL || (strcmp(args[1], "-o") == 0 && args[2] == NULL)) {
+        printf("errexit \t%s\n", errexit_enabled ? "on" : "off");
+        printf("pipefail\t%s\n", pipefail_enabled ? "on" : "off");
+        return 0;
+    }
+    for (int j = 1; args[j] != NULL; j++) {
+        char sign = args[j][0];
+        if ((sign != '-' && sign != '+') || args[j][1] == '\0') {
+            fprintf(stderr, "set: %s: invalid option\n", args[j]);
+            return 2;
+        }
+        int value = (sign == '-');
+        for (const char *flag = args[j] + 1; *flag != '\0'; flag++) {
+            if (*flag == 'e') {
+                errexit_enabled = value;
+            } else if (*flag == 'o') {
+                const char *name = args[++j];
+                if (name == NULL) {
+                    fprintf(stderr, "set: -o: option name required\n");
+                    return 2;
+                }
+                if (strcmp(name, "errexit") == 0) {
+                    errexit_enabled = value;
+                } else if (strcmp(name, "pipefail") == 0) {
+                    pipefail_enabled = value;
+                } else {
+                    fprintf(stderr, "set: %s: invalid option name\n", name);
+                    return 2;
+                }
+                break;
+            } else {
+                fprintf(stderr, "set: %c%c: invalid option\n", sign, *flag);
+                return 2;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Returns the elapsed time between two 'CLOCK_MONOTONIC' readings in seconds.
+ */
+static double elapsedSeconds(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * @brief 'qsort' comparator for doubles.
+ */
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Returns the 'p'-th percentile (0..1) of a sorted array, interpolating
+ * linearly between the two closest samples.
+ */
+static double percentile(const double *sorted, int n, double p) {
+    double rank = p * (n - 1);
+    int lo = (int)rank;
+    if (lo + 1 >= n) {
+        return sorted[n - 1];
+    }
+    return sorted[lo] + (rank - lo) * (sorted[lo + 1] - sorted[lo]);
+}
+
+/**
+ * @brief Runs a command line through 'runCommandLine' without touching '$?'.
+ *
+ * Used for the benchmarked command and its prepare and cleanup commands.
+ * When 'quiet' is set, standard output and standard error are sent to
+ * '/dev/null' for the duration of the run.
+ *
+ * @return The exit status of the command line.
+ */
+static int runBenchStep(char **cmd, int quiet, PipelineResult *result) {
+    int saved_out = -1, saved_err = -1;
+    if (quiet) {
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull >= 0) {
+            fflush(stdout);
+            saved_out = dup(STDOUT_FILENO);
+            saved_err = dup(STDERR_FILENO);
+            dup2(devnull, STDOUT_FILENO);
+            dup2(devnull, STDERR_FILENO);
+            close(devnull);
+        }
+    }
+    int code = runCommandLine(cmd, 0, NULL, result);
+    if (saved_out >= 0) {
+        dup2(saved_out, STDOUT_FILENO);
+        dup2(saved_err, STDERR_FILENO);
+        close(saved_out);
+        close(saved_err);
+    }
+    return code;
+}
+
+/**
+ * @brief Measures one command for 'bench'.
+ *
+ * Runs 'warmup' unmeasured iterations, then 'bench->runs' measured ones.
+ * Every iteration is preceded by 'prepare' and followed by 'cleanup' (either
+ * may be NULL), which are not part of the measurement. Each measured run is
+ * timed with 'CLOCK_MONOTONIC' around the shell's own spawn path, and its CPU
+ * time is taken from 'wait4'. The statistics in 'bench' are filled in.
+ *
+ * @return 0 on success, -1 if a run failed and 'ignore_failures' is not set.
+ */
+static int measureCommand(char **cmd, char **prepare, char **cleanup, int warmup, int quiet,
+                          int ignore_failures, BenchResult *bench) {
+    PipelineResult result;
+    bench->failures = 0;
+    bench->user = bench->sys = 0;
+
+    for (int r = -warmup; r < bench->runs; r++) {
+        if (prepare != NULL) {
+            runBenchStep(prepare, quiet, NULL);
+        }
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int code = runBenchStep(cmd, quiet, &result);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (cleanup != NULL) {
+            runBenchStep(cleanup, quiet, NULL);
+        }
+        if (code != 0) {
+            if (!ignore_failures) {
+                fprintf(stderr, "bench: '%s' exited with status %d (use -i to ignore)\n",
+                        bench->name, code);
+                return -1;
+            }
+            bench->failures++;
+        }
+        if (r < 0) {
+            continue; // warmup
+        }
+        bench->times[r] = elapsedSeconds(&start, &end);
+        for (int i = 0; i < result.count; i++) {
+            bench->user += timevalSeconds(&result.usage[i].ru_utime);
+            bench->sys += timevalSeconds(&result.usage[i].ru_stime);
+        }
+    }
+
+    int n = bench->runs;
+    double sum = 0;
+    for (int r = 0; r < n; r++) {
+        sum += bench->times[r];
+    }
+    bench->mean = sum / n;
+    double sq = 0;
+    for (int r = 0; r < n; r++) {
+        sq += (bench->times[r] - bench->mean) * (bench->times[r] - bench->mean);
+    }
+    bench->stddev = n > 1 ? sqrt(sq / (n - 1)) : 0;
+    bench->user /= n;
+    bench->sys /= n;
+
+    double *sorted = malloc(n * sizeof(double));
+    if (sorted == NULL) {
+        perror("bench");
+        return -1;
+    }
+    memcpy(sorted, bench->times, n * sizeof(double));
+    qsort(sorted, n, sizeof(double), compareDoubles);
+    bench->min = sorted[0];
+    bench->max = sorted[n - 1];
+    bench->median = percentile(sorted, n, 0.5);
+    bench->p90 = percentile(sorted, n, 0.90);
+    bench->p95 = percentile(sorted, n, 0.95);
+    bench->p99 = percentile(sorted, n, 0.99);
+    free(sorted);
+    return 0;
+}
+
+/**
+ * @brief Writes 'bench' results as CSV (one row per command, times in seconds).
+ *
+ * The command is quoted, with any '"' in it doubled, as RFC 4180 requires.
+ */
+static int exportBenchCsv(const char *path, const BenchResult *results, int count, double overhead) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    fprintf(f, "command,runs,mean,stddev,median,p90,p95,p99,min,max,user,system,spawn_overhead\n");
+    for (int c = 0; c < count; c++) {
+        const BenchResult *b = &results[c];
+        fputc('"', f);
+        for (const char *p = b->name; *p != '\0'; p++) {
+            if (*p == '"') {
+                fputc('"', f);
+            }
+            fputc(*p, f);
+        }
+        fprintf(f, "\",%d,%.9f,%.9f,%.9f,%.9f,%.9f,%.9f,%.9f,%.9f,%.9f,%.9f,%.9f\n",
+                b->runs, b->mean, b->stddev, b->median, b->p90, b->p95, b->p99, b->min, b->max,
+                b->user, b->sys, overhead);
+    }
+    fclose(f);
+    return 0;
+}
+
+/**
+ * @brief Writes 'bench' results as JSON, including every individual run time.
+ */
+static int exportBenchJson(const char *path, const BenchResult *results, int count, double overhead) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    fprintf(f, "{\n  \"spawn_overhead\": %.9f,\n  \"results\": [\n", overhead);
+    for (int c = 0; c < count; c++) {
+        const BenchResult *b = &results[c];
+        fprintf(f, "    {\n      \"command\": \"");
+        for (const char *p = b->name; *p != '\0'; p++) {
+            if (*p == '"' || *p == '\\') {
+                fputc('\\', f);
+            }
+            fputc(*p, f);
+        }
+        fprintf(f, "\",\n      \"runs\": %d,\n      \"failures\": %d,\n", b->runs, b->failures);
+        fprintf(f, "      \"mean\": %.9f,\n      \"stddev\": %.9f,\n      \"median\": %.9f,\n",
+                b->mean, b->stddev, b->median);
+        fprintf(f, "      \"p90\": %.9f,\n      \"p95\": %.9f,\n      \"p99\": %.9f,\n",
+                b->p90, b->p95, b->p99);
+        fprintf(f, "      \"min\": %.9f,\n      \"max\": %.9f,\n", b->min, b->max);
+        fprintf(f, "      \"user\": %.9f,\n      \"system\": %.9f,\n      \"times\": [",
+                b->user, b->sys);
+        for (int r = 0; r < b->runs; r++) {
+            fprintf(f, "%s%.9f", r > 0 ? ", " : "", b->times[r]);
+        }
+        fprintf(f, "]\n    }%s\n", c < count - 1 ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    fclose(f);
+    return 0;
+}
+
+/**
+ * @brief Implements the 'bench' built-in, a hyperfine-style command benchmark.
+ *
+ * Usage:
+ * bench [-n runs] [-w warmup] [-i] [--show-output] [--prepare cmd...]
+ * [--cleanup cmd...] [--csv file] [--json file] -- cmd1... [-- cmd2...]
+ *
+ * Each command after a '--' is run 'runs' times (default 10) after 'warmup'
+ * unmeasured runs, through the same spawn path as ordinary commands. Before
+ * the commands are measured, the cost of launching a process ('true') is
+ * measured the same way and reported separately, together with each
+ * command's mean minus that overhead. For every command the mean, standard
+ * deviation, min/max, median and 90th/95th/99th percentiles of the wall
+ * time are printed, and with several commands a comparison against the
+ * fastest one. The words after '--prepare' and '--cleanup' (up to the next
+ * word starting with '--') are run before and after every run, unmeasured.
+ * Output of all commands is discarded unless '--show-output' is given, and a
+ * failing run aborts the benchmark unless '-i' is given.
+ *
+ * @param args The arguments of the command, starting with "bench".
+ *
+ * @return 0 on success, 1 if a benchmark failed, 2 on a usage error.
+ */
+int benchCommand(char **args) {
+    int runs = 10, warmup = 0, quiet = 1, ignore_failures = 0;
+    const char *csv_path = NULL, *json_path = NULL;
+    char *prepare[MAX_ARGS], *cleanup[MAX_ARGS];
+    int prepare_count = 0, cleanup_count = 0;
+    char *commands[MAX_ARGS][MAX_ARGS];
+    int command_count = 0;
+
+    int j = 1;
+    while (args[j] != NULL && strcmp(args[j], "--") != 0) {
+        if ((strcmp(args[j], "-n") == 0 || strcmp(args[j], "-r") == 0) && args[j + 1] != NULL) {
+            runs = atoi(args[j + 1]);
+            j += 2;
+        } else if (strcmp(args[j], "-w") == 0 && args[j + 1] != NULL) {
+            warmup = atoi(args[j + 1]);
+            j += 2;
+        } else if (strcmp(args[j], "-i") == 0) {
+            ignore_failures = 1;
+            j++;
+        } else if (strcmp(args[j], "--show-output") == 0) {
+            quiet = 0;
+            j++;
+        } else if (strcmp(args[j], "--csv") == 0 && args[j + 1] != NULL) {
+            csv_path = args[j + 1];
+            j += 2;
+        } else if (strcmp(args[j], "--json") == 0 && args[j + 1] != NULL) {
+            json_path = args[j + 1];
+            j += 2;
+        } else if (strcmp(args[j], "--prepare") == 0 || strcmp(args[j], "--cleanup") == 0) {
+            char **dest = args[j][2] == 'p' ? prepare : cleanup;
+            int *count = args[j][2] == 'p' ? &prepare_count : &cleanup_count;
+            const char *option = args[j++];
+            while (args[j] != NULL && strncmp(args[j], "--", 2) != 0) {
+                if (*count == MAX_ARGS - 1) {
+                    fprintf(stderr, "bench: %s: too many words (at most %d)\n", option, MAX_ARGS - 1);
+                    return 2;
+                }
+                dest[(*count)++] = args[j++];
+            }
+            dest[*count] = NULL;
+        } else {
+            fprintf(stderr, "bench: unknown option '%s'\n", args[j]);
+            return 2;
+        }
+    }
+    while (args[j] != NULL) { // args[j] is "--"
+        int argc = 0;
+        j++;
+        if (command_count == MAX_ARGS) {
+            fprintf(stderr, "bench: too many commands (at most %d)\n", MAX_ARGS);
+            return 2;
+        }
+        while (args[j] != NULL && strcmp(args[j], "--") != 0) {
+            if (argc == MAX_ARGS - 1) {
+                fprintf(stderr, "bench: command too long (at most %d words)\n", MAX_ARGS - 1);
+                return 2;
+            }
+            commands[command_count][argc++] = args[j++];
+        }
+        commands[command_count][argc] = NULL;
+        if (argc > 0) {
+            command_count++;
+        }
+    }
+    if (command_count == 0 || runs <= 0 || warmup < 0) {
+        fprintf(stderr, "Usage: bench [-n runs] [-w warmup] [-i] [--show-output] [--prepare cmd...] "
+                        "[--cleanup cmd...] [--csv file] [--json file] -- cmd1... [-- cmd2...]\n");
+        return 2;
+    }
+
+    BenchResult results[command_count];
+    memset(results, 0, sizeof(results));
+
+    // Process launch overhead, measured through the same path
+    char *noop[] = {"true", NULL};
+    BenchResult spawn = {.name = "true", .runs = runs < 10 ? 10 : runs};
+    spawn.times = malloc(spawn.runs * sizeof(double));
+    if (spawn.times == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    double overhead = 0;
+    if (measureCommand(noop, NULL, NULL, 1, 1, 1, &spawn) == 0) {
+        overhead = spawn.median;
+    }
+    free(spawn.times);
+    printf("Spawn overhead: %.3f ms (median of %d runs of 'true')\n", overhead * 1e3, spawn.runs);
+
+    int ret = 0;
+    int done = 0;
+    for (int c = 0; c < command_count; c++) {
+        BenchResult *b = &results[c];
+        b->runs = runs;
+        for (int k = 0; commands[c][k] != NULL; k++) {
+            if (k > 0) {
+                strncat(b->name, " ", sizeof(b->name) - strlen(b->name) - 1);
+            }
+            strncat(b->name, commands[c][k], sizeof(b->name) - strlen(b->name) - 1);
+        }
+        b->times = malloc(runs * sizeof(double));
+        if (b->times == NULL) {
+            perror("malloc");
+            ret = 1;
+            break;
+        }
+        if (measureCommand(commands[c], prepare_count > 0 ? prepare : NULL,
+                           cleanup_count > 0 ? cleanup : NULL, warmup, quiet, ignore_failures, b) != 0) {
+            ret = 1;
+            break;
+        }
+        done++;
+
+        printf("Benchmark %d: %s\n", c + 1, b->name);
+        printf("  Time (mean ± σ):   %9.3f ms ± %7.3f ms    [User: %.3f ms, System: %.3f ms]\n",
+               b->mean * 1e3, b->stddev * 1e3, b->user * 1e3, b->sys * 1e3);
+        printf("  Range (min … max): %9.3f ms … %7.3f ms    %d runs", b->min * 1e3, b->max * 1e3, b->runs);
+        if (b->failures > 0) {
+            printf(", %d failed", b->failures);
+        }
+        printf("\n  Percentiles:       p50 %.3f ms, p90 %.3f ms, p95 %.3f ms, p99 %.3f ms\n",
+               b->median * 1e3, b->p90 * 1e3, b->p95 * 1e3, b->p99 * 1e3);
+        printf("  Minus spawn:       %9.3f ms\n", (b->mean - overhead) * 1e3);
+    }
+
+    if (done > 1) {
+        int fastest = 0;
+        for (int c = 1; c < done; c++) {
+            if (results[c].mean < results[fastest].mean) {
+                fastest = c;
+            }
+        }
+        const BenchResult *f = &results[fastest];
+        printf("Summary\n  '%s' ran\n", f->name);
+        for (int c = 0; c < done; c++) {
+            if (c == fastest) {
+                continue;
+            }
+            const BenchResult *b = &results[c];
+            double ratio = b->mean / f->mean;
+            // Propagate the relative standard deviations of both means
+            double rel_b = b->stddev / b->mean, rel_f = f->stddev / f->mean;
+            double err = ratio * sqrt(rel_b * rel_b + rel_f * rel_f);
+            printf("  %8.2f ± %.2f times faster than '%s'\n", ratio, err, b->name);
+        }
+    }
+
+    if (done > 0 && csv_path != NULL && exportBenchCsv(csv_path, results, done, overhead) != 0) {
+        ret = 1;
+    }
+    if (done > 0 && json_path != NULL && exportBenchJson(json_path, results, done, overhead) != 0) {
+        ret = 1;
+    }
+    for (int c = 0; c < command_count; c++) {
+        free(results[c].times);
+    }
+    return ret;
+}
+
+/**
+ * @brief Measures the latency of starting and reaping 'true' 'runs' times.
+ *
+ * @return The sorted latencies in seconds (to be freed), or NULL on failure.
+ */
+static double *measureSpawnLatency(int runs) {
+    double *times = malloc(runs * sizeof(double));
+    char *argv[] = {"true", NULL};
+    RedirectionList redirs = {0};
+    if (times == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    for (int i = 0; i < runs; i++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pid_t pid = spawnCommand(argv, &redirs, NULL);
+        if (pid < 0 || waitpid(pid, NULL, 0) < 0) {
+            free(times);
+            return NULL;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        times[i] = elapsedSeconds(&start, &end);
+    }
+    qsort(times, runs, sizeof(double), compareDoubles);
+    return times;
+}
+
+/**
+ * @brief Implements the 'forkserver' built-in command.
+ *
+ * Usage: forkserver [status | on | off | bench [runs]]
+ *
+ * The fork server is a helper process started with the shell (with
+ * '--fork-server' or 'NORSEISH_FORK_SERVER=1') before any thread, which
+ * creates the shell's children on its behalf. 'on' and 'off' choose whether
+ * spawns go through it, and 'bench' compares the latency of spawning 'true'
+ * directly and through the server.
+ *
+ * @param args The arguments of the command.
+ *
+ * @return 0 on success, 1 on failure, 2 on a usage error.
+ */
+int forkserverCommand(char **args) {
+    if (args[1] == NULL || strcmp(args[1], "status") == 0) {
+        if (fork_server_pid < 0) {
+            printf("fork server: not running (start the shell with --fork-server)\n");
+        } else {
+            printf("fork server: running (pid %d), %s\n", fork_server_pid,
+                   fork_server_enabled ? "enabled" : "disabled");
+        }
+        return 0;
+    }
+    if (strcmp(args[1], "on") != 0 && strcmp(args[1], "off") != 0 && strcmp(args[1], "bench") != 0) {
+        fprintf(stderr, "Usage: forkserver [status | on | off | bench [runs]]\n");
+        return 2;
+    }
+    if (fork_server_pid < 0) {
+        fprintf(stderr, "forkserver: not running (start the shell with --fork-server)\n");
+        return 1;
+    }
+    if (strcmp(args[1], "bench") != 0) {
+        fork_server_enabled = strcmp(args[1], "on") == 0;
+        return 0;
+    }
+
+    int runs = args[2] != NULL ? atoi(args[2]) : 200;
+    if (runs <= 0) {
+        fprintf(stderr, "forkserver: invalid number of runs '%s'\n", args[2]);
+        return 2;
+    }
+
+    struct rusage self;
+    getrusage(RUSAGE_SELF, &self);
+    printf("Spawn latency of 'true' over %d runs (shell max RSS %ld KiB):\n", runs, self.ru_maxrss);
+    int saved = fork_server_enabled;
+    int status = 0;
+    for (int mode = 0; mode < 2; mode++) {
+        fork_server_enabled = mode;
+        double *times = measureSpawnLatency(runs);
+        if (times == NULL) {
+            status = 1;
+            break;
+        }
+        double sum = 0;
+        for (int i = 0; i < runs; i++) {
+            sum += times[i];
+        }
+        printf("  %-12s mean %8.1f us   median %8.1f us   p99 %8.1f us\n",
+               mode ? "fork server" : "direct fork", sum / runs * 1e6,
+               percentile(times, runs, 0.5) * 1e6, percentile(times, runs, 0.99) * 1e6);
+        free(times);
+    }
+    fork_server_enabled = saved;
+    return status;
+}
+
+/**
+ * Output and status of one job of the 'parallel' built-in.
+ */
+typedef struct {
+    char *output;   // captured standard output and error
+    size_t length;
+    size_t capacity;
+    int status;     // exit status, valid once 'done' is set
+    int done;
+} ParallelJob;
+
+/**
+ * @brief Builds the argument vector of one 'parallel' job.
+ *
+ * Every '{}' in the template is replaced by 'arg'; if the template has none,
+ * 'arg' is appended as a single extra argument. The words are allocated into
+ * 'words' (to be freed by the caller, even on failure) and terminated by NULL.
+ *
+ * @return 0 on success, -1 if the command is too long.
+ */
+static int buildParallelArgs(char **template, const char *arg, char **words) {
+    int count = 0, substituted = 0;
+    words[0] = NULL;
+    for (int i = 0; template[i] != NULL; i++) {
+        if (count >= MAX_ARGS - 2) {
+            return -1;
+        }
+        char word[MAX_COMMAND_LENGTH * 4];
+        size_t length = 0;
+        for (const char *p = template[i]; *p != '\0';) {
+            const char *piece = p;
+            size_t n = 1;
+            if (p[0] == '{' && p[1] == '}') {
+                piece = arg;
+                n = strlen(arg);
+                substituted = 1;
+                p += 2;
+            } else {
+                p++;
+            }
+            if (length + n >= sizeof(word)) {
+                return -1;
+            }
+            memcpy(word + length, piece, n);
+            length += n;
+        }
+        word[length] = '\0';
+        words[count++] = strdup(word);
+        words[count] = NULL;
+    }
+    if (!substituted) {
+        words[count++] = strdup(arg);
+    }
+    words[count] = NULL;
+    return 0;
+}
+
+/**
+ * @brief Writes a finished job's output to the shell's standard output and
+ * reports its status on standard error if it failed (or always, 'verbose').
+ */
+static void emitParallelJob(ParallelJob *job, int seq, const char *arg, int verbose) {
+    fwrite(job->output, 1, job->length, stdout);
+    fflush(stdout);
+    if (job->status != 0 || verbose) {
+        fprintf(stderr, "parallel: job %d (%s) exited with status %d\n", seq + 1, arg, job->status);
+    }
+    free(job->output);
+    job->output = NULL;
+}
+
+/**
+ * @brief Implements the 'parallel' built-in, a replacement for 'xargs -P'.
+ *
+ * Usage: parallel [-j jobs] [-k] [-v] [-a file] command... [::: arg...]
+ *
+ * Runs 'command' once for every argument, with at most 'jobs' (default: the
+ * number of CPUs the shell may run on) running at the same time. The
+ * arguments are the words after ':::', the lines of 'file', or else the
+ * lines of standard input. Every '{}' in the command is replaced by the
+ * argument; without one, the argument is appended. Jobs are started through
+ * the shell's spawn path (so job prefixes and the fork server apply, and
+ * 'cpus spread' gives the N-th job the N-th CPU of the set), with standard
+ * input from /dev/null. Each job's standard output and error are
+ * captured through a pipe and written out in one piece when the job ends, so
+ * the output of concurrent jobs is never interleaved; with '-k' the outputs
+ * are written in the order of the arguments instead of completion order.
+ * Failed jobs are reported on standard error, and with '-v' every job is.
+ *
+ * @param args The arguments of the command, starting with "parallel".
+ * @param attrs Settings applied to every job, or NULL.
+ *
+ * @return 0 if every job succeeded, otherwise the number of failed jobs
+ * (at most 101), or 2 on a usage error.
+ * @see https://man7.org/linux/man-pages/man1/xargs.1.html
+ * @see https://man7.org/linux/man-pages/man2/poll.2.html
+ */
+int parallelCommand(char **args, const SpawnAttributes *attrs) {
+    cpu_set_t allowed;
+    int max_jobs = 1, keep_order = 0, verbose = 0;
+    const char *arg_file = NULL;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        max_jobs = CPU_COUNT(&allowed);
+    }
+
+    int j = 1;
+    while (args[j] != NULL && args[j][0] == '-') {
+        if (strcmp(args[j], "-j") == 0 && args[j + 1] != NULL) {
+            max_jobs = atoi(args[j + 1]);
+            j += 2;
+        } else if (strcmp(args[j], "-k") == 0) {
+            keep_order = 1;
+            j++;
+        } else if (strcmp(args[j], "-v") == 0) {
+            verbose = 1;
+            j++;
+        } else if (strcmp(args[j], "-a") == 0 && args[j + 1] != NULL) {
+            arg_file = args[j + 1];
+            j += 2;
+        } else if (strcmp(args[j], "--") == 0) {
+            j++;
+            break;
+        } else {
+            fprintf(stderr, "parallel: unknown option '%s'\n", args[j]);
+            return 2;
+        }
+    }
+    char *template[MAX_ARGS];
+    int template_count = 0;
+    while (args[j] != NULL && strcmp(args[j], ":::") != 0) {
+        if (template_count == MAX_ARGS - 1) {
+            fprintf(stderr, "parallel: command too long (at most %d words)\n", MAX_ARGS - 1);
+            return 2;
+        }
+        template[template_count++] = args[j++];
+    }
+    template[template_count] = NULL;
+    if (template_count == 0 || max_jobs <= 0) {
+        fprintf(stderr, "Usage: parallel [-j jobs] [-k] [-v] [-a file] command... [::: arg...]\n");
+        return 2;
+    }
+
+    // Collect the arguments
+    char **inputs = NULL;
+    int input_count = 0, input_capacity = 0;
+    FILE *source = NULL;
+    if (args[j] != NULL) {
+        j++; // Skip ":::"
+    } else if (arg_file != NULL) {
+        source = fopen(arg_file, "r");
+        if (source == NULL) {
+            perror(arg_file);
+            return 1;
+        }
+    } else {
+        source = stdin;
+    }
+    char *line = NULL;
+    size_t line_size = 0;
+    int out_of_memory = 0;
+    while (1) {
+        char *input;
+        if (source == NULL) {
+            if (args[j] == NULL) {
+                break;
+            }
+            input = strdup(args[j++]);
+        } else {
+            ssize_t n = getline(&line, &line_size, source);
+            if (n < 0) {
+                break;
+            }
+            if (n > 0 && line[n - 1] == '\n') {
+                line[n - 1] = '\0';
+            }
+            if (line[0] == '\0') {
+                continue;
+            }
+            input = strdup(line);
+        }
+        if (input != NULL && input_count == input_capacity) {
+            int capacity = input_capacity ? input_capacity * 2 : 64;
+            char **grown = realloc(inputs, capacity * sizeof(char *));
+            if (grown == NULL) {
+                free(input);
+                input = NULL;
+            } else {
+                inputs = grown;
+                input_capacity = capacity;
+            }
+        }
+        if (input == NULL) {
+            out_of_memory = 1;
+            break;
+        }
+        inputs[input_count++] = input;
+    }
+    free(line);
+    if (source == stdin) {
+        clearerr(stdin);
+    } else if (source != NULL) {
+        fclose(source);
+    }
+    if (out_of_memory) {
+        perror("parallel");
+        for (int k = 0; k < input_count; k++) {
+            free(inputs[k]);
+        }
+        free(inputs);
+        return 1;
+    }
+
+    // No more slots than jobs, however large '-j' is
+    if (max_jobs > input_count) {
+        max_jobs = input_count > 0 ? input_count : 1;
+    }
+    ParallelJob *jobs = calloc(input_count > 0 ? input_count : 1, sizeof(ParallelJob));
+    pid_t *pids = malloc(max_jobs * sizeof(pid_t));
+    struct pollfd *fds = malloc(max_jobs * sizeof(struct pollfd));
+    int *slot_seq = malloc(max_jobs * sizeof(int));
+    int running = 0, next = 0, next_emit = 0, failed = 0;
+    int null_fd = -1;
+    if (jobs == NULL || pids == NULL || fds == NULL || slot_seq == NULL) {
+        perror("parallel");
+        failed = 1;
+        next = input_count; // Start nothing
+    } else {
+        null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+
+    while (next < input_count || running > 0) {
+        // Start jobs until every slot is busy
+        while (running < max_jobs && next < input_count) {
+            int seq = next++;
+            char *words[MAX_ARGS];
+            char *argv[MAX_ARGS];
+            RedirectionList redirs;
+            int pipefd[2];
+            if (buildParallelArgs(template, inputs[seq], words) != 0
+                || parseRedirections(words, argv, &redirs) != 0
+                || redirs.count >= MAX_REDIRECTIONS) {
+                fprintf(stderr, "parallel: job %d (%s): command too long\n", seq + 1, inputs[seq]);
+                jobs[seq].status = 2;
+                jobs[seq].done = 1;
+            } else if (pipe2(pipefd, O_CLOEXEC) != 0) {
+                perror("pipe");
+                jobs[seq].status = 1;
+                jobs[seq].done = 1;
+            } else {
+                // Capture standard error too, unless the command redirects it itself
+                memmove(&redirs.actions[1], &redirs.actions[0], redirs.count * sizeof(Redirection));
+                redirs.actions[0] = (Redirection){REDIR_DUP, STDERR_FILENO, STDOUT_FILENO, 0, NULL};
+                redirs.count++;
+                SpawnAttributes job_attrs;
+                const SpawnAttributes *spawn_attrs = attrs;
+                if (attrs != NULL && attrs->affinity == AFFINITY_SPREAD) {
+                    job_attrs = *attrs;
+                    resolveStageAffinity(&job_attrs, seq);
+                    spawn_attrs = &job_attrs;
+                }
+                pid_t pid = startChild(argv, &redirs, spawn_attrs, null_fd, pipefd[1], NULL, 0);
+                close(pipefd[1]);
+                if (pid < 0) {
+                    close(pipefd[0]);
+                    jobs[seq].status = 1;
+                    jobs[seq].done = 1;
+                } else {
+                    pids[running] = pid;
+                    fds[running].fd = pipefd[0];
+                    fds[running].events = POLLIN;
+                    slot_seq[running] = seq;
+                    running++;
+                }
+            }
+            for (int k = 0; words[k] != NULL; k++) {
+                free(words[k]);
+            }
+            if (jobs[seq].done && !keep_order) {
+                emitParallelJob(&jobs[seq], seq, inputs[seq], verbose);
+                failed++;
+            }
+        }
+
+        if (running > 0 && poll(fds, running, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // Give up on the output, but leave no child unreaped
+            perror("poll");
+            for (int s = 0; s < running; s++) {
+                close(fds[s].fd);
+                waitpid(pids[s], NULL, 0);
+            }
+            failed += running + (input_count - next);
+            break;
+        }
+        for (int s = 0; s < running; s++) {
+            if (fds[s].revents == 0) {
+                continue;
+            }
+            ParallelJob *job = &jobs[slot_seq[s]];
+            if (job->capacity - job->length < 4096) {
+                size_t capacity = job->capacity ? job->capacity * 2 : 8192;
+                char *grown = realloc(job->output, capacity);
+                if (grown != NULL) {
+                    job->output = grown;
+                    job->capacity = capacity;
+                }
+            }
+            // Out of memory: keep the output so far and drop the rest, so the job is not blocked
+            char discard[4096];
+            int keep = job->capacity - job->length >= sizeof(discard);
+            ssize_t n = keep ? read(fds[s].fd, job->output + job->length, job->capacity - job->length)
+                             : read(fds[s].fd, discard, sizeof(discard));
+            if (n > 0) {
+                job->length += keep ? (size_t)n : 0;
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            // End of output: reap the job and free its slot
+            int status;
+            close(fds[s].fd);
+            job->status = waitpid(pids[s], &status, 0) < 0 ? 1 : statusToExitCode(status);
+            job->done = 1;
+            if (!keep_order) {
+                emitParallelJob(job, slot_seq[s], inputs[slot_seq[s]], verbose);
+                failed += job->status != 0;
+            }
+            running--;
+            pids[s] = pids[running];
+            fds[s] = fds[running];
+            slot_seq[s] = slot_seq[running];
+            s--;
+        }
+
+        // With '-k', write out the finished jobs that are next in order
+        while (keep_order && next_emit < next && jobs[next_emit].done) {
+            emitParallelJob(&jobs[next_emit], next_emit, inputs[next_emit], verbose);
+            failed += jobs[next_emit].status != 0;
+            next_emit++;
+        }
+    }
+
+    if (null_fd >= 0) {
+        close(null_fd);
+    }
+    for (int k = 0; k < input_count; k++) {
+        if (jobs != NULL) {
+            free(jobs[k].output);
+        }
+        free(inputs[k]);
+    }
+    free(jobs);
+    free(inputs);
+    free(pids);
+    free(fds);
+    free(slot_seq);
+    return failed > 101 ? 101 : failed;
+}
+
+// Longest duration accepted: 100 years, so a deadline in nanoseconds on
+// CLOCK_REALTIME still fits in an int64_t
+#define MAX_DURATION_SECONDS (100.0 * 365 * 86400)
+
+/**
+ * @brief Parses a duration such as "10", "1.5s", "250ms", "5m" or "2h".
+ *
+ * A bare number is taken as seconds. The accepted suffixes are 'ms', 's',
+ * 'm', 'h' and 'd'.
+ *
+ * @param str The duration as typed.
+ * @param seconds Receives the duration in seconds.
+ *
+ * @return 0 on success, -1 if 'str' is not a valid non-negative duration
+ * of at most MAX_DURATION_SECONDS ("inf" and "nan" are rejected).
+ */
+int parseDuration(const char *str, double *seconds) {
+    char *end;
+    double value = strtod(str, &end);
+    if (end == str || !isfinite(value) || value < 0 || value > MAX_DURATION_SECONDS) {
+        return -1;
+    }
+    if (strcmp(end, "") == 0 || strcmp(end, "s") == 0) {
+        *seconds = value;
+    } else if (strcmp(end, "ms") == 0) {
+        *seconds = value / 1000;
+    } else if (strcmp(end, "m") == 0) {
+        *seconds = value * 60;
+    } else if (strcmp(end, "h") == 0) {
+        *seconds = value * 3600;
+    } else if (strcmp(end, "d") == 0) {
+        *seconds = value * 86400;
+    } else {
+        return -1;
+    }
+    return *seconds <= MAX_DURATION_SECONDS ? 0 : -1;
+}
+
+/**
+ * @brief Translates a signal name ("TERM", "SIGTERM") or number ("15") into
+ * a signal number.
+ *
+ * @return The signal number, or -1 if the name is unknown.
+ */
+int parseSignalName(const char *name) {
+    static const struct {
+        const char *name;
+        int number;
+    } signals[] = {
+        {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL},
+        {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"ALRM", SIGALRM}, {"TERM", SIGTERM},
+        {"CONT", SIGCONT}, {"STOP", SIGSTOP},
+    };
+    if (isdigit((unsigned char)name[0])) {
+        int number = atoi(name);
+        return number > 0 && number < NSIG ? number : -1;
+    }
+    if (strncmp(name, "SIG", 3) == 0) {
+        name += 3;
+    }
+    for (size_t k = 0; k < sizeof(signals) / sizeof(signals[0]); k++) {
+        if (strcasecmp(name, signals[k].name) == 0) {
+            return signals[k].number;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Settings of one 'timeout' invocation. 'argv' is owned by the structure
+ * when the built-in runs in the background.
+ */
+typedef struct {
+    double deadline;     // seconds per attempt, 0 for none
+    int signal;          // sent when the deadline passes
+    double grace;        // seconds before escalating to SIGKILL, 0 for never
+    int retries;         // extra attempts after a failure (or restarts when supervising)
+    double backoff;      // delay before the first retry, doubled on every failure
+    double max_backoff;
+    int supervise;       // restart whenever the command exits
+    SpawnAttributes attrs;
+    char **argv;
+} TimeoutOptions;
+
+/**
+ * @brief Arms a timerfd to expire once after 'seconds'.
+ */
+static void armTimer(int tfd, double seconds) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = (time_t)seconds;
+    its.it_value.tv_nsec = (long)((seconds - (time_t)seconds) * 1e9);
+    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) {
+        its.it_value.tv_nsec = 1; // a zero value would disarm the timer
+    }
+    if (timerfd_settime(tfd, 0, &its, NULL) != 0) {
+        perror("timerfd_settime");
+    }
+}
+
+/**
+ * @brief Runs a command once under a wall-clock deadline.
+ *
+ * The child is watched through a pidfd, and the deadline through a timerfd on
+ * 'CLOCK_MONOTONIC'; the shell 'poll's both, so no wrapper process is needed.
+ * When the deadline passes, 'options->signal' is sent with
+ * 'pidfd_send_signal', and if the child is still alive after the grace
+ * period it is sent SIGKILL.
+ *
+ * @return The exit status of the command, 124 if it was stopped because the
+ * deadline passed, 137 if it had to be killed after the grace period, or 126
+ * if it could not be started.
+ * @see https://man7.org/linux/man-pages/man2/pidfd_open.2.html
+ * @see https://man7.org/linux/man-pages/man2/pidfd_send_signal.2.html
+ * @see https://man7.org/linux/man-pages/man2/timerfd_create.2.html
+ * @see https://man7.org/linux/man-pages/man2/poll.2.html
+ */
+static int runWithDeadline(char **argv, const RedirectionList *redirs, const TimeoutOptions *options) {
+    pid_t pid = spawnCommand(argv, redirs, &options->attrs);
+    if (pid < 0) {
+        return 126;
+    }
+    int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    int tfd = -1;
+    if (pidfd < 0) {
+        perror("pidfd_open"); // No way to watch the deadline; just wait
+    } else if (options->deadline > 0) {
+        tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (tfd < 0) {
+            perror("timerfd_create");
+        } else {
+            armTimer(tfd, options->deadline);
+        }
+    }
+
+    int timed_out = 0, killed = 0;
+    while (pidfd >= 0) {
+        struct pollfd fds[2] = {{.fd = pidfd, .events = POLLIN}, {.fd = tfd, .events = POLLIN}};
+        if (poll(fds, tfd >= 0 ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            break; // The child has exited
+        }
+        if (tfd >= 0 && (fds[1].revents & POLLIN)) {
+            uint64_t expirations;
+            if (read(tfd, &expirations, sizeof(expirations)) < 0) {
+                perror("read");
+            }
+            if (!timed_out) {
+                timed_out = 1;
+                syscall(SYS_pidfd_send_signal, pidfd, options->signal, NULL, 0);
+                if (options->grace > 0) {
+                    armTimer(tfd, options->grace);
+                }
+            } else {
+                killed = 1;
+                syscall(SYS_pidfd_send_signal, pidfd, SIGKILL, NULL, 0);
+            }
+        }
+    }
+
+    int status = 0;
+    if (waitpid(pid, &status, 0) < 0) {
+        perror("waitpid");
+    }
+    if (tfd >= 0) {
+        close(tfd);
+    }
+    if (pidfd >= 0) {
+        close(pidfd);
+    }
+    if (killed) {
+        return 128 + SIGKILL;
+    }
+    if (timed_out) {
+        return 124;
+    }
+    return statusToExitCode(status);
+}
+
+#define SUPERVISE_MIN_INTERVAL 0.1 // seconds before restarting a command that succeeded
+
+/**
+ * @brief Runs the attempt/retry/restart loop of 'timeout'.
+ *
+ * A failed attempt is retried after the current backoff, which then doubles.
+ * A successful one resets the backoff and, when supervising, is restarted
+ * after the base backoff but never sooner than SUPERVISE_MIN_INTERVAL, so a
+ * command that exits at once does not make the shell spin.
+ *
+ * @return The exit status of the last attempt.
+ */
+static int superviseCommand(TimeoutOptions *options) {
+    char *argv[MAX_ARGS];
+    RedirectionList redirs;
+    if (parseRedirections(options->argv, argv, &redirs) != 0) {
+        return 2;
+    }
+
+    double backoff = options->backoff;
+    int code = 0;
+    for (int attempt = 0;; attempt++) {
+        code = runWithDeadline(argv, &redirs, options);
+        if (code == 128 + SIGINT) {
+            break; // Interrupted from the terminal: stop supervising
+        }
+        if (code == 0) {
+            backoff = options->backoff;
+            if (!options->supervise) {
+                break;
+            }
+        }
+        if (options->retries >= 0 && attempt >= options->retries) {
+            break;
+        }
+        double delay = backoff;
+        if (code == 0 && delay < SUPERVISE_MIN_INTERVAL) {
+            delay = SUPERVISE_MIN_INTERVAL;
+        }
+        fprintf(stderr, "timeout: '%s' exited with status %d, restarting in %.3gs (attempt %d)\n",
+                argv[0] != NULL ? argv[0] : "", code, delay, attempt + 2);
+        struct timespec pause;
+        pause.tv_sec = (time_t)delay;
+        pause.tv_nsec = (long)((delay - (time_t)delay) * 1e9);
+        while (clock_nanosleep(CLOCK_MONOTONIC, 0, &pause, &pause) == EINTR) {
+        }
+        if (code != 0) {
+            backoff *= 2;
+            if (backoff > options->max_backoff) {
+                backoff = options->max_backoff;
+            }
+        }
+    }
+    return code;
+}
+
+/**
+ * @brief Thread body for a 'timeout' run in the background.
+ */
+static void *timeoutThread(void *arg) {
+    TimeoutOptions *options = arg;
+    superviseCommand(options);
+    for (int j = 0; options->argv[j] != NULL; j++) {
+        free(options->argv[j]);
+    }
+    free(options->argv);
+    free(options);
+    return NULL;
+}
+
+/**
+ * @brief Implements the 'timeout' built-in: deadlines, retries and supervision.
+ *
+ * Usage:
+ * timeout [-s signal] [-k grace] [-r retries] [-b backoff] [--max-backoff d]
+ * [--supervise] duration command...
+ *
+ * Runs 'command' and sends it 'signal' (default TERM) once 'duration' has
+ * passed (0 disables the deadline); with '-k' it is killed with SIGKILL if it
+ * is still running 'grace' later. A failed attempt is retried up to 'retries'
+ * times, waiting 'backoff' (default 1s) before the first retry and twice as
+ * long before each following one, up to '--max-backoff' (default 60s). With
+ * '--supervise' the command is also restarted when it succeeds, after
+ * 'backoff' (at least 0.1s), forever unless '-r' limits the number of
+ * restarts. Durations accept the suffixes of
+ * 'parseDuration'. A command killed by SIGINT (Ctrl+C) is never restarted.
+ *
+ * The child is watched with a pidfd and a timerfd from inside the shell
+ * (see 'runWithDeadline'), so no 'timeout(1)' wrapper process is spawned.
+ * With a trailing '&' the loop runs on a detached thread of the shell.
+ *
+ * @param args The arguments of the command, starting with "timeout".
+ * @param background Non-zero to run the supervision loop in the background.
+ * @param attrs Settings applied to the command before exec, or NULL.
+ *
+ * @return The exit status of the last attempt (124 if it timed out), 0 once a
+ * background supervisor has been started, or 2 on a usage error.
+ */
+int timeoutCommand(char **args, int background, const SpawnAttributes *attrs) {
+    TimeoutOptions options = {
+        .signal = SIGTERM, .retries = 0, .backoff = 1, .max_backoff = 60,
+    };
+    if (attrs != NULL) {
+        options.attrs = *attrs;
+    }
+    int retries_given = 0;
+
+    int j = 1;
+    for (; args[j] != NULL && args[j][0] == '-' && args[j][1] != '\0'; j++) {
+        const char *value = args[j + 1];
+        if (strcmp(args[j], "--supervise") == 0) {
+            options.supervise = 1;
+            continue;
+        }
+        if (value == NULL) {
+            break;
+        }
+        int ok = 1;
+        if (strcmp(args[j], "-s") == 0) {
+            options.signal = parseSignalName(value);
+            ok = options.signal > 0;
+        } else if (strcmp(args[j], "-k") == 0) {
+            ok = parseDuration(value, &options.grace) == 0;
+        } else if (strcmp(args[j], "-r") == 0) {
+            options.retries = atoi(value);
+            retries_given = 1;
+            ok = options.retries >= 0;
+        } else if (strcmp(args[j], "-b") == 0) {
+            ok = parseDuration(value, &options.backoff) == 0;
+        } else if (strcmp(args[j], "--max-backoff") == 0) {
+            ok = parseDuration(value, &options.max_backoff) == 0;
+        } else {
+            ok = 0;
+        }
+        if (!ok) {
+            fprintf(stderr, "timeout: invalid option '%s %s'\n", args[j], value);
+            return 2;
+        }
+        j++;
+    }
+    if (args[j] == NULL || args[j + 1] == NULL || parseDuration(args[j], &options.deadline) != 0) {
+        fprintf(stderr, "Usage: timeout [-s signal] [-k grace] [-r retries] [-b backoff] "
+                        "[--max-backoff d] [--supervise] duration command...\n");
+        return 2;
+    }
+    if (options.supervise && !retries_given) {
+        options.retries = -1; // restart forever
+    }
+
+    if (!background) {
+        options.argv = args + j + 1;
+        return superviseCommand(&options);
+    }
+
+    // Background: hand a private copy of the command to a detached thread
+    TimeoutOptions *copy = malloc(sizeof(TimeoutOptions));
+    int argc = 0;
+    while (args[j + 1 + argc] != NULL) {
+        argc++;
+    }
+    char **argv = copy != NULL ? calloc(argc + 1, sizeof(char *)) : NULL;
+    if (argv == NULL) {
+        perror("malloc");
+        free(copy);
+        return 1;
+    }
+    for (int k = 0; k < argc; k++) {
+        argv[k] = strdup(args[j + 1 + k]);
+    }
+    *copy = options;
+    copy->argv = argv;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, timeoutThread, copy) != 0) {
+        perror("pthread_create");
+        for (int k = 0; k < argc; k++) {
+            free(argv[k]);
+        }
+        free(argv);
+        free(copy);
+        return 1;
+    }
+    pthread_detach(thread);
+    printf("[Background] Supervising '%s'\n", argv[0]);
+    return 0;
+}
+
+/**
+ * @brief Adds a command to the command history.
+ *
+ * This function adds the given 'command' string to the global 'history' array.
+ * The command is added to the end of the history, and the 'history_count'
+ * is incremented. If the history is full (reaches 'MAX_HISTORY'), the oldest
+ * command is overwritten.
+ *
+ * @param command A pointer to a null-terminated string representing the
+ * command to add to the history.
+ */
+void addToHistory(const char *command) {
+    if (history_count < MAX_HISTORY) {
+        strcpy(history[history_count], command);
+        history_count++;
+    } else {
+        // Wrap around the history buffer
+        strcpy(history[history_count % MAX_HISTORY], command);
+        history_count++;
+    }
+}
+
+/**
+ * @brief Displays the command history.
+ *
+ * This function iterates through the stored command history and prints each
+ * command along with its index number to the standard output. If the history
+ * contains more than 10 commands, it will only display the last 10 entries.
+ */
+void displayHistory() {
+    int start = 0;
+    if (history_count > 10) {
+        start = history_count - 10;
+    }
+    for (int i = start; i < history_count; i++) {
+        printf("  %d  %s\n", i + 1, history[i]);
+    }
+}
+
+/**
+ * One element of a compiled glob pattern component.
+ */
+#define GLOB_LITERAL 0  // the byte 'c'
+#define GLOB_ANY 1      // '?': any byte
+#define GLOB_STAR 2     // '*': any run of bytes
+#define GLOB_SET 3      // '[...]': a byte whose bit is set in 'set'
+
+typedef struct {
+    int type;
+    unsigned char c;
+    uint32_t set[8];
+} GlobToken;
+
+#define GLOB_DFA_MAX_TOKENS 63     // NFA positions are bits of a uint64_t
+#define GLOB_DFA_MAX_STATES 256
+
+/**
+ * A path component of a compiled glob pattern. A component without
+ * wildcards is looked up by name rather than matched against a listing of
+ * its directory, and "**" matches any number of directories.
+ *
+ * Names are matched in two steps. Cheap prefilters come first: the
+ * literal prefix and suffix every match has, and the longest literal run
+ * of the component, looked for with memchr/memmem. Then a DFA runs over
+ * the name, one table lookup per byte. The DFA is built by subset
+ * construction over the tokens, with bytes that no token tells apart
+ * sharing a column. Components with more than GLOB_DFA_MAX_TOKENS tokens,
+ * or whose DFA would exceed GLOB_DFA_MAX_STATES states, fall back to
+ * backtracking over the tokens.
+ */
+typedef struct {
+    char *text;          // the component as written, the key of 'glob_components'
+    GlobToken *tokens;
+    int token_count;
+    char *literal;       // the name with its escapes removed, or NULL if it has wildcards
+    int globstar;
+    int leading_dot;     // starts with a literal '.', so it may match hidden names
+    int has_star;
+    size_t min_length;   // the number of tokens other than '*'
+    char *bytes;         // the byte of each literal token, for the prefilters
+    int prefix_length;   // literal tokens at the start
+    int suffix_length;   // literal tokens at the end (0 if there is no '*')
+    int needle_start;    // the longest run of literal tokens in between
+    int needle_length;
+    unsigned char byte_class[256];
+    int class_count;
+    uint16_t *transitions; // [state * class_count + class]; state 0 is dead
+    unsigned char *accepting;
+    int start_state;     // 0 if there is no DFA
+} GlobComponent;
+
+/**
+ * Compiled glob components by text, an open-addressing hash table. It
+ * lives as long as the shell, so patterns used again are not compiled
+ * again, and is emptied by 'expandWildcards' when it grows beyond
+ * GLOB_COMPONENT_CACHE_MAX components. Only the main thread expands
+ * wildcards.
+ */
+#define GLOB_COMPONENT_CACHE_MAX 1024
+
+static struct {
+    GlobComponent **table;
+    int capacity;        // a power of two
+    int count;
+} glob_components;
+
+/**
+ * A glob pattern compiled by 'compileGlobPattern'.
+ */
+typedef struct {
+    int absolute;        // starts with '/'
+    int dir_only;        // ends with '/': matches directories only, printed with the '/'
+    GlobComponent **components; // in 'glob_components'
+    int count;
+} GlobPattern;
+
+/**
+ * A directory entry as read by 'readGlobDirectory'.
+ */
+typedef struct {
+    char *name;
+    unsigned char type;  // its 'd_type', DT_UNKNOWN if the file system does not tell
+} GlobEntry;
+
+/**
+ * A directory listing in a 'GlobCache'; an unreadable directory has no
+ * entries.
+ */
+typedef struct {
+    char *path;          // NULL for an empty slot of the table
+    uint64_t hash;
+    GlobEntry *entries;
+    int count;
+    char *names;         // the getdents64 records the entries' names point into
+    int walked;          // every directory below it is in the cache too
+} GlobDirectory;
+
+/**
+ * The directory listings read while expanding the words of one command, so
+ * 'cp *.c *.h dst/' lists the current directory only once: an
+ * open-addressing hash table keyed by path.
+ */
+typedef struct {
+    GlobDirectory *table;
+    int capacity;        // a power of two
+    int count;
+} GlobCache;
+
+/**
+ * The paths a pattern matched.
+ */
+typedef struct {
+    char **paths;
+    size_t count;
+    size_t capacity;
+} GlobMatches;
+
+/**
+ * @brief Parses a bracket expression ("[abc]", "[!a-z]", "[[:digit:]_]")
+ * into the byte set of 'token'.
+ *
+ * @param p Points just after the '['.
+ *
+ * @return The position just after the closing ']', or NULL if there is
+ * none, in which case the '[' is an ordinary character.
+ * @see https://man7.org/linux/man-pages/man7/glob.7.html
+ */
+static const char *parseGlobBracket(const char *p, GlobToken *token) {
+    static const struct {
+        const char *name;
+        int (*test)(int);
+    } classes[] = {{"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank}, {"cntrl", iscntrl},
+                   {"digit", isdigit}, {"graph", isgraph}, {"lower", islower}, {"print", isprint},
+                   {"punct", ispunct}, {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit}};
+    int negate = *p == '!' || *p == '^';
+    if (negate) {
+        p++;
+    }
+    memset(token->set, 0, sizeof(token->set));
+    token->type = GLOB_SET;
+    for (int first = 1; *p != ']' || first; first = 0) {
+        if (*p == '\0') {
+            return NULL;
+        }
+        if (p[0] == '[' && p[1] == ':') {
+            const char *end = strstr(p + 2, ":]");
+            size_t k = 0;
+            while (end != NULL && k < sizeof(classes) / sizeof(classes[0])
+                   && (strlen(classes[k].name) != (size_t)(end - p - 2)
+                       || strncmp(classes[k].name, p + 2, end - p - 2) != 0)) {
+                k++;
+            }
+            if (end != NULL && k < sizeof(classes) / sizeof(classes[0])) {
+                for (int b = 0; b < 256; b++) {
+                    if (classes[k].test(b)) {
+                        token->set[b / 32] |= 1u << (b % 32);
+                    }
+                }
+                p = end + 2;
+                continue;
+            }
+        }
+        if (*p == '\\' && p[1] != '\0') {
+            p++;
+        }
+        unsigned char low = (unsigned char)*p++, high = low;
+        if (p[0] == '-' && p[1] != ']' && p[1] != '\0') {
+            p++;
+            if (*p == '\\' && p[1] != '\0') {
+                p++;
+            }
+            high = (unsigned char)*p++;
+        }
+        for (int b = low; b <= high; b++) {
+            token->set[b / 32] |= 1u << (b % 32);
+        }
+    }
+    if (negate) {
+        for (int w = 0; w < 8; w++) {
+            token->set[w] = ~token->set[w];
+        }
+    }
+    return p + 1;
+}
+
+/**
+ * @brief Tests whether a byte matches a single-byte token.
+ */
+static int globTokenAccepts(const GlobToken *token, unsigned char c) {
+    switch (token->type) {
+    case GLOB_LITERAL:
+        return token->c == c;
+    case GLOB_ANY:
+        return 1;
+    case GLOB_SET:
+        return (token->set[c / 32] >> (c % 32)) & 1;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief Hashes a string for the glob caches (FNV-1a).
+ */
+static uint64_t hashGlobPath(const char *path) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)path; *p != '\0'; p++) {
+        hash = (hash ^ *p) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * @brief Adds the positions reachable through '*' tokens without consuming
+ * a byte to a set of NFA positions (position i: tokens before i matched).
+ */
+static uint64_t closeGlobPositions(const GlobComponent *component, uint64_t positions) {
+    for (int t = 0; t < component->token_count; t++) {
+        if ((positions >> t & 1) && component->tokens[t].type == GLOB_STAR) {
+            positions |= (uint64_t)1 << (t + 1);
+        }
+    }
+    return positions;
+}
+
+/**
+ * @brief Builds the DFA of a component by subset construction, leaving
+ * 'start_state' 0 if the component is too large for one.
+ *
+ * @return 0 on success, -1 if out of memory.
+ */
+static int buildGlobDfa(GlobComponent *component) {
+    int n = component->token_count;
+    if (n > GLOB_DFA_MAX_TOKENS) {
+        return 0;
+    }
+    // Bytes accepted by the same tokens behave alike: give them one column
+    uint64_t signatures[256];
+    unsigned char representative[256];
+    for (int b = 0; b < 256; b++) {
+        uint64_t signature = 0;
+        for (int t = 0; t < n; t++) {
+            if (globTokenAccepts(&component->tokens[t], (unsigned char)b)) {
+                signature |= (uint64_t)1 << t;
+            }
+        }
+        int c = 0;
+        while (c < component->class_count && signatures[c] != signature) {
+            c++;
+        }
+        if (c == component->class_count) {
+            signatures[c] = signature;
+            representative[c] = (unsigned char)b;
+            component->class_count++;
+        }
+        component->byte_class[b] = (unsigned char)c;
+    }
+
+    uint64_t *states = malloc(GLOB_DFA_MAX_STATES * sizeof(uint64_t));
+    component->transitions = malloc((size_t)GLOB_DFA_MAX_STATES * component->class_count * sizeof(uint16_t));
+    component->accepting = calloc(GLOB_DFA_MAX_STATES, 1);
+    if (states == NULL || component->transitions == NULL || component->accepting == NULL) {
+        free(states);
+        return -1;
+    }
+    int count = 2;
+    states[0] = 0; // Dead: no position left
+    states[1] = closeGlobPositions(component, 1);
+    for (int s = 0; s < count; s++) {
+        component->accepting[s] = (states[s] >> n) & 1;
+        for (int c = 0; c < component->class_count; c++) {
+            uint64_t next = 0;
+            for (int t = 0; t < n; t++) {
+                if (!(states[s] >> t & 1)) {
+                    continue;
+                }
+                if (component->tokens[t].type == GLOB_STAR) {
+                    next |= (uint64_t)1 << t;
+                } else if (globTokenAccepts(&component->tokens[t], representative[c])) {
+                    next |= (uint64_t)1 << (t + 1);
+                }
+            }
+            next = closeGlobPositions(component, next);
+            int target = 0;
+            while (target < count && states[target] != next) {
+                target++;
+            }
+            if (target == count) {
+                if (count == GLOB_DFA_MAX_STATES) {
+                    free(states);
+                    return 0; // Too many states: backtrack instead
+                }
+                states[count++] = next;
+            }
+            component->transitions[s * component->class_count + c] = (uint16_t)target;
+        }
+    }
+    free(states);
+    component->start_state = 1;
+    return 0;
+}
+
+/**
+ * @brief Frees a compiled component.
+ */
+static void freeGlobComponent(GlobComponent *component) {
+    free(component->text);
+    free(component->tokens);
+    free(component->literal);
+    free(component->bytes);
+    free(component->transitions);
+    free(component->accepting);
+    free(component);
+}
+
+/**
+ * @brief Compiles one path component of a glob pattern into tokens, its
+ * prefilters and its DFA.
+ *
+ * @param text The component, without slashes.
+ *
+ * @return The component, or NULL if out of memory.
+ */
+static GlobComponent *compileGlobComponent(const char *text) {
+    size_t length = strlen(text);
+    GlobComponent *component = calloc(1, sizeof(GlobComponent));
+    if (component == NULL) {
+        return NULL;
+    }
+    component->text = strdup(text);
+    component->tokens = malloc((length + 1) * sizeof(GlobToken));
+    component->bytes = malloc(length + 1);
+    if (component->text == NULL || component->tokens == NULL || component->bytes == NULL) {
+        freeGlobComponent(component);
+        return NULL;
+    }
+    component->globstar = strcmp(text, "**") == 0;
+    int wildcards = 0;
+    for (const char *p = text; *p != '\0';) {
+        GlobToken *token = &component->tokens[component->token_count];
+        const char *next;
+        token->c = 0;
+        if (*p == '*') {
+            token->type = GLOB_STAR;
+            while (*p == '*') {
+                p++; // Consecutive stars match what one does
+            }
+        } else if (*p == '?') {
+            token->type = GLOB_ANY;
+            p++;
+        } else if (*p == '[' && (next = parseGlobBracket(p + 1, token)) != NULL) {
+            p = next;
+        } else {
+            if (*p == '\\' && p[1] != '\0') {
+                p++;
+            }
+            token->type = GLOB_LITERAL;
+            token->c = (unsigned char)*p++;
+        }
+        wildcards |= token->type != GLOB_LITERAL;
+        component->has_star |= token->type == GLOB_STAR;
+        component->min_length += token->type != GLOB_STAR;
+        component->bytes[component->token_count++] = (char)token->c;
+    }
+    const GlobToken *tokens = component->tokens;
+    int count = component->token_count;
+    component->leading_dot = count > 0 && tokens[0].type == GLOB_LITERAL && tokens[0].c == '.';
+    if (!wildcards) {
+        component->literal = malloc(count + 1);
+        if (component->literal == NULL) {
+            freeGlobComponent(component);
+            return NULL;
+        }
+        memcpy(component->literal, component->bytes, count);
+        component->literal[count] = '\0';
+        return component;
+    }
+
+    while (component->prefix_length < count && tokens[component->prefix_length].type == GLOB_LITERAL) {
+        component->prefix_length++;
+    }
+    while (component->has_star && component->suffix_length < count
+           && tokens[count - 1 - component->suffix_length].type == GLOB_LITERAL) {
+        component->suffix_length++;
+    }
+    for (int t = component->prefix_length, run = 0; t < count - component->suffix_length; t++) {
+        run = tokens[t].type == GLOB_LITERAL ? run + 1 : 0;
+        if (run > component->needle_length) {
+            component->needle_length = run;
+            component->needle_start = t + 1 - run;
+        }
+    }
+    if (buildGlobDfa(component) != 0) {
+        freeGlobComponent(component);
+        return NULL;
+    }
+    return component;
+}
+
+/**
+ * @brief Finds a compiled component in 'glob_components', compiling and
+ * adding it the first time.
+ *
+ * @return The component, or NULL if out of memory.
+ */
+static GlobComponent *lookupGlobComponent(const char *text) {
+    if (glob_components.count * 2 >= glob_components.capacity) {
+        int capacity = glob_components.capacity > 0 ? glob_components.capacity * 2 : 64;
+        GlobComponent **table = calloc(capacity, sizeof(GlobComponent *));
+        if (table == NULL) {
+            return NULL;
+        }
+        for (int i = 0; i < glob_components.capacity; i++) {
+            GlobComponent *component = glob_components.table[i];
+            if (component != NULL) {
+                int k = (int)(hashGlobPath(component->text) & (capacity - 1));
+                while (table[k] != NULL) {
+                    k = (k + 1) & (capacity - 1);
+                }
+                table[k] = component;
+            }
+        }
+        free(glob_components.table);
+        glob_components.table = table;
+        glob_components.capacity = capacity;
+    }
+    int mask = glob_components.capacity - 1;
+    int k = (int)(hashGlobPath(text) & mask);
+    while (glob_components.table[k] != NULL) {
+        if (strcmp(glob_components.table[k]->text, text) == 0) {
+            return glob_components.table[k];
+        }
+        k = (k + 1) & mask;
+    }
+    GlobComponent *component = compileGlobComponent(text);
+    if (component != NULL) {
+        glob_components.table[k] = component;
+        glob_components.count++;
+    }
+    return component;
+}
+
+/**
+ * @brief Empties 'glob_components'; no compiled pattern may be in use.
+ */
+static void clearGlobComponents(void) {
+    for (int i = 0; i < glob_components.capacity; i++) {
+        if (glob_components.table[i] != NULL) {
+            freeGlobComponent(glob_components.table[i]);
+        }
+    }
+    free(glob_components.table);
+    memset(&glob_components, 0, sizeof(glob_components));
+}
+
+/**
+ * @brief Frees what 'compileGlobPattern' allocated.
+ */
+static void freeGlobPattern(GlobPattern *pattern) {
+    free(pattern->components);
+    pattern->components = NULL;
+    pattern->count = 0;
+}
+
+/**
+ * @brief Compiles a glob pattern: splits it into path components and looks
+ * each up in 'glob_components', compiling those not seen before (see
+ * 'compileGlobComponent'), so every directory entry is matched without
+ * parsing the pattern again.
+ *
+ * @return 0 on success, -1 if out of memory.
+ */
+static int compileGlobPattern(const char *text, GlobPattern *pattern) {
+    memset(pattern, 0, sizeof(*pattern));
+    pattern->absolute = text[0] == '/';
+    size_t length = strlen(text);
+    pattern->dir_only = length > 1 && text[length - 1] == '/';
+    pattern->components = malloc((length / 2 + 1) * sizeof(GlobComponent *));
+    char *copy = strdup(text);
+    if (pattern->components == NULL || copy == NULL) {
+        free(pattern->components);
+        free(copy);
+        pattern->components = NULL;
+        return -1;
+    }
+    char *save = NULL;
+    for (char *part = strtok_r(copy, "/", &save); part != NULL; part = strtok_r(NULL, "/", &save)) {
+        if ((pattern->components[pattern->count++] = lookupGlobComponent(part)) == NULL) {
+            freeGlobPattern(pattern);
+            free(copy);
+            return -1;
+        }
+    }
+    free(copy);
+    return 0;
+}
+
+/**
+ * @brief Matches a name against tokens, backtracking only to the latest
+ * '*', so it runs in O(name length * tokens) at worst.
+ */
+static int globTokensMatch(const GlobToken *tokens, int count, const char *name) {
+    int t = 0, star = -1;
+    const char *s = name, *star_s = NULL;
+    while (*s != '\0') {
+        if (t < count && tokens[t].type == GLOB_STAR) {
+            star = ++t;
+            star_s = s;
+        } else if (t < count && globTokenAccepts(&tokens[t], (unsigned char)*s)) {
+            t++;
+            s++;
+        } else if (star >= 0) {
+            t = star;
+            s = ++star_s;
+        } else {
+            return 0;
+        }
+    }
+    while (t < count && tokens[t].type == GLOB_STAR) {
+        t++;
+    }
+    return t == count;
+}
+
+/**
+ * @brief Matches a name against a compiled component: the literal prefix,
+ * the length, and the literal suffix and needle are checked first, then the DFA (or,
+ * without one, the tokens) decides. A name starting with '.' only matches
+ * if the pattern starts with a literal '.'.
+ *
+ * @return Non-zero if the whole name matches.
+ * @see https://man7.org/linux/man-pages/man3/memmem.3.html
+ */
+static int globComponentMatches(const GlobComponent *component, const char *name) {
+    if (name[0] == '.' && !component->leading_dot) {
+        return 0;
+    }
+    if (strncmp(name, component->bytes, component->prefix_length) != 0) {
+        return 0;
+    }
+    size_t length = strlen(name);
+    if (length < component->min_length || (!component->has_star && length != component->min_length)
+        || memcmp(name + length - component->suffix_length,
+                  component->bytes + component->token_count - component->suffix_length,
+                  component->suffix_length) != 0) {
+        return 0;
+    }
+    const char *middle = name + component->prefix_length;
+    size_t middle_length = length - component->prefix_length - component->suffix_length;
+    const char *needle = component->bytes + component->needle_start;
+    if (component->needle_length == 1 && memchr(middle, *needle, middle_length) == NULL) {
+        return 0;
+    }
+    if (component->needle_length > 1 && memmem(middle, middle_length, needle, component->needle_length) == NULL) {
+        return 0;
+    }
+    if (component->start_state == 0) {
+        return globTokensMatch(component->tokens, component->token_count, name);
+    }
+    const uint16_t *transitions = component->transitions;
+    int classes = component->class_count;
+    int state = component->start_state;
+    for (const unsigned char *p = (const unsigned char *)name; *p != '\0' && state != 0; p++) {
+        state = transitions[state * classes + component->byte_class[*p]];
+    }
+    return component->accepting[state];
+}
+
+/**
+ * @brief Finds the slot of a path in the directory cache: where it is, or
+ * the empty slot where it would go.
+ */
+static GlobDirectory *findGlobDirectory(GlobCache *cache, const char *path, uint64_t hash) {
+    int mask = cache->capacity - 1;
+    for (int i = (int)(hash & mask);; i = (i + 1) & mask) {
+        GlobDirectory *dir = &cache->table[i];
+        if (dir->path == NULL || (dir->hash == hash && strcmp(dir->path, path) == 0)) {
+            return dir;
+        }
+    }
+}
+
+/**
+ * A record returned by getdents64.
+ */
+typedef struct {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} GlobDirent64;
+
+/**
+ * @brief Reads all entries of an open directory with getdents64, keeping
+ * the raw records as the storage for the names instead of copying each one.
+ *
+ * @param entries Receives the entries (NULL if there are none).
+ * @param names Receives the records, to be freed with the entries.
+ *
+ * @return 0 on success (a read error ends the listing early), -1 if out of
+ * memory.
+ * @see https://man7.org/linux/man-pages/man2/getdents.2.html
+ */
+static int listGlobDirectory(int fd, GlobEntry **entries, int *count, char **names) {
+    size_t used = 0, capacity = 0;
+    char *buffer = NULL;
+    *entries = NULL;
+    *count = 0;
+    *names = NULL;
+    while (1) {
+        if (capacity - used < 32768) {
+            char *grown = realloc(buffer, capacity = capacity * 2 + 32768);
+            if (grown == NULL) {
+                free(buffer);
+                return -1;
+            }
+            buffer = grown;
+        }
+        long n = syscall(SYS_getdents64, fd, buffer + used, capacity - used);
+        if (n <= 0) {
+            break;
+        }
+        used += (size_t)n;
+    }
+    int records = 0;
+    for (size_t offset = 0; offset < used; offset += ((GlobDirent64 *)(buffer + offset))->d_reclen) {
+        records++;
+    }
+    if (records > 0 && (*entries = malloc(records * sizeof(GlobEntry))) == NULL) {
+        free(buffer);
+        return -1;
+    }
+    for (size_t offset = 0; offset < used; offset += ((GlobDirent64 *)(buffer + offset))->d_reclen) {
+        GlobDirent64 *record = (GlobDirent64 *)(buffer + offset);
+        (*entries)[*count].name = record->d_name;
+        (*entries)[(*count)++].type = record->d_type;
+    }
+    *names = buffer;
+    return 0;
+}
+
+/**
+ * @brief Finds the cache slot of a directory, taking an empty one for it
+ * (with no entries) if it is not there yet.
+ *
+ * @param created Set to whether the slot was taken now.
+ *
+ * @return The slot, or NULL if out of memory.
+ */
+static GlobDirectory *claimGlobDirectory(GlobCache *cache, const char *path, int *created) {
+    if (cache->count * 2 >= cache->capacity) {
+        GlobCache grown = {calloc(cache->capacity > 0 ? cache->capacity * 2 : 16, sizeof(GlobDirectory)),
+                           cache->capacity > 0 ? cache->capacity * 2 : 16, cache->count};
+        if (grown.table == NULL) {
+            return NULL;
+        }
+        for (int i = 0; i < cache->capacity; i++) {
+            if (cache->table[i].path != NULL) {
+                *findGlobDirectory(&grown, cache->table[i].path, cache->table[i].hash) = cache->table[i];
+            }
+        }
+        free(cache->table);
+        *cache = grown;
+    }
+    uint64_t hash = hashGlobPath(path);
+    GlobDirectory *dir = findGlobDirectory(cache, path, hash);
+    *created = dir->path == NULL;
+    if (*created) {
+        if ((dir->path = strdup(path)) == NULL) {
+            return NULL;
+        }
+        dir->hash = hash;
+        cache->count++;
+    }
+    return dir;
+}
+
+/**
+ * @brief Lists a directory, reading it only the first time it is asked for
+ * while the cache lives.
+ *
+ * @param path The directory; "" is the current one.
+ *
+ * @return The listing (with no entries if the directory cannot be read), or
+ * NULL if out of memory.
+ */
+static GlobDirectory *readGlobDirectory(GlobCache *cache, const char *path) {
+    int created;
+    GlobDirectory *dir = claimGlobDirectory(cache, path, &created);
+    if (dir != NULL && created) {
+        int fd = open(path[0] != '\0' ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0) {
+            int status = listGlobDirectory(fd, &dir->entries, &dir->count, &dir->names);
+            close(fd);
+            if (status != 0) {
+                return NULL;
+            }
+        }
+    }
+    return dir;
+}
+
+/**
+ * @brief Frees the directory listings of a cache.
+ */
+static void freeGlobCache(GlobCache *cache) {
+    for (int i = 0; i < cache->capacity; i++) {
+        free(cache->table[i].entries);
+        free(cache->table[i].names);
+        free(cache->table[i].path);
+    }
+    free(cache->table);
+    memset(cache, 0, sizeof(*cache));
+}
+
+/**
+ * @brief Appends a name to a path in a PATH_MAX buffer, with a '/' between
+ * them unless the path is empty or already ends with one.
+ *
+ * @return The new length, or 0 if it would not fit.
+ */
+static size_t joinGlobPath(char *path, size_t length, const char *name) {
+    size_t n = strlen(name);
+    int slash = length > 0 && path[length - 1] != '/';
+    if (length + slash + n >= PATH_MAX) {
+        return 0;
+    }
+    if (slash) {
+        path[length++] = '/';
+    }
+    memcpy(path + length, name, n + 1);
+    return length + n;
+}
+
+/**
+ * @brief Tells whether the entry at 'path' is a directory, from its 'd_type'
+ * when the file system gives one.
+ *
+ * @param follow Whether a symbolic link to a directory counts.
+ */
+static int isGlobDirectory(const char *path, unsigned char type, int follow) {
+    struct stat st;
+    if (type == DT_DIR) {
+        return 1;
+    }
+    if ((type == DT_LNK && follow) || type == DT_UNKNOWN) {
+        return (follow ? stat(path, &st) : lstat(path, &st)) == 0 && S_ISDIR(st.st_mode);
+    }
+    return 0;
+}
+
+/**
+ * @brief Adds a copy of a matched path, with a trailing '/' if the pattern
+ * asks for directories only.
+ *
+ * @return 0 on success, -1 if out of memory.
+ */
+static int addGlobMatch(GlobMatches *matches, const char *path, int dir_only) {
+    if (matches->count == matches->capacity) {
+        size_t capacity = matches->capacity > 0 ? matches->capacity * 2 : 16;
+        char **paths = realloc(matches->paths, capacity * sizeof(char *));
+        if (paths == NULL) {
+            return -1;
+        }
+        matches->paths = paths;
+        matches->capacity = capacity;
+    }
+    size_t length = strlen(path);
+    char *copy = malloc(length + 2);
+    if (copy == NULL) {
+        return -1;
+    }
+    memcpy(copy, path, length);
+    copy[length] = '/';
+    copy[length + dir_only] = '\0';
+    matches->paths[matches->count++] = copy;
+    return 0;
+}
+
+#define GLOB_WALKERS_MAX 16
+
+/**
+ * A directory found by a parallel '**' walk (see 'walkGlobTree'), with its
+ * listing once read. 'parent' links lead back to where the walk started.
+ */
+typedef struct GlobTreeNode {
+    char *path;
+    struct GlobTreeNode *parent;
+    dev_t dev;
+    ino_t ino;
+    GlobEntry *entries;
+    int count;
+    char *names;
+    struct GlobTreeNode *next;   // in the list of nodes read by a walker
+} GlobTreeNode;
+
+/**
+ * One thread of a parallel walk: a deque of directories to read, which it
+ * takes from at the tail and other walkers steal from at the head, and the
+ * directories it has read.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    GlobTreeNode **tasks;
+    int head;
+    int tail;
+    int capacity;
+    GlobTreeNode *done;
+    int failed;                  // ran out of memory
+    struct GlobTreeWalk *walk;
+    int index;
+} GlobWalker;
+
+/**
+ * A parallel walk of a directory tree. 'pending' counts the directories
+ * queued or being read; the walk is over when it drops to zero.
+ */
+typedef struct GlobTreeWalk {
+    GlobWalker walkers[GLOB_WALKERS_MAX];
+    int count;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    long pending;
+    long generation;             // bumped whenever directories are queued
+    int idle;
+} GlobTreeWalk;
+
+/**
+ * @brief Adds a directory to the tail of a walker's deque.
+ *
+ * @return 0 on success, -1 if out of memory.
+ */
+static int pushGlobTask(GlobWalker *walker, GlobTreeNode *node) {
+    pthread_mutex_lock(&walker->mutex);
+    if (walker->tail == walker->capacity) {
+        if (walker->head > 0) {
+            memmove(walker->tasks, walker->tasks + walker->head, (walker->tail - walker->head) * sizeof(GlobTreeNode *));
+            walker->tail -= walker->head;
+            walker->head = 0;
+        } else {
+            int capacity = walker->capacity > 0 ? walker->capacity * 2 : 64;
+            GlobTreeNode **tasks = realloc(walker->tasks, capacity * sizeof(GlobTreeNode *));
+            if (tasks == NULL) {
+                pthread_mutex_unlock(&walker->mutex);
+                return -1;
+            }
+            walker->tasks = tasks;
+            walker->capacity = capacity;
+        }
+    }
+    walker->tasks[walker->tail++] = node;
+    pthread_mutex_unlock(&walker->mutex);
+    return 0;
+}
+
+/**
+ * @brief Takes a directory from a walker's deque: the newest one for the
+ * walker itself, which keeps its work depth-first and its paths in cache,
+ * the oldest one (nearest the top of the tree, so likely the most work)
+ * for a thief.
+ *
+ * @return The directory, or NULL if the deque is empty.
+ */
+static GlobTreeNode *takeGlobTask(GlobWalker *walker, int steal) {
+    GlobTreeNode *node = NULL;
+    pthread_mutex_lock(&walker->mutex);
+    if (walker->head < walker->tail) {
+        node = steal ? walker->tasks[walker->head++] : walker->tasks[--walker->tail];
+        if (walker->head == walker->tail) {
+            walker->head = walker->tail = 0;
+        }
+    }
+    pthread_mutex_unlock(&walker->mutex);
+    return node;
+}
+
+/**
+ * @brief Reads one directory of a parallel walk and queues its
+ * subdirectories (hidden ones excepted, as '**' skips them) on the
+ * walker's deque.
+ *
+ * Symbolic links below the root of the walk are not followed. A directory
+ * with the same device and inode as one of its ancestors (a loop through a
+ * bind mount) is left with no entries, so the walk ends there.
+ *
+ * @return The number of subdirectories queued. If out of memory, the
+ * walker is marked as failed.
+ * @see https://man7.org/linux/man-pages/man2/fstatat.2.html
+ */
+static int readGlobTreeNode(GlobWalker *walker, GlobTreeNode *node) {
+    // A link naming the walk's root is followed, like a link the pattern spells out
+    int follow = node->parent == NULL ? 0 : O_NOFOLLOW;
+    int fd = open(node->path[0] != '\0' ? node->path : ".", O_RDONLY | O_DIRECTORY | follow | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0) {
+        return 0;
+    }
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return 0;
+    }
+    node->dev = st.st_dev;
+    node->ino = st.st_ino;
+    for (const GlobTreeNode *up = node->parent; up != NULL; up = up->parent) {
+        if (up->dev == node->dev && up->ino == node->ino) {
+            close(fd);
+            return 0;
+        }
+    }
+    if (listGlobDirectory(fd, &node->entries, &node->count, &node->names) != 0) {
+        walker->failed = 1;
+        close(fd);
+        return 0;
+    }
+
+    int queued = 0;
+    char path[PATH_MAX];
+    size_t length = strlen(node->path);
+    memcpy(path, node->path, length + 1);
+    for (int e = 0; e < node->count; e++) {
+        GlobEntry *entry = &node->entries[e];
+        if (entry->type == DT_UNKNOWN) {
+            // Record the type, so matching against the listing needs no lstat
+            if (fstatat(fd, entry->name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                entry->type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+            }
+        }
+        if (entry->type != DT_DIR || entry->name[0] == '.') {
+            continue;
+        }
+        if (joinGlobPath(path, length, entry->name) == 0) {
+            continue; // Too long a path
+        }
+        GlobTreeNode *child = calloc(1, sizeof(GlobTreeNode));
+        if (child != NULL) {
+            child->path = strdup(path);
+            child->parent = node;
+        }
+        path[length] = '\0';
+        if (child == NULL || child->path == NULL || pushGlobTask(walker, child) != 0) {
+            if (child != NULL) {
+                free(child->path);
+            }
+            free(child);
+            walker->failed = 1;
+            break;
+        }
+        queued++;
+    }
+    close(fd);
+    return queued;
+}
+
+/**
+ * @brief Thread function of a parallel walk's walker.
+ *
+ * Reads directories from its own deque, steals from the other walkers' when
+ * it is empty, and sleeps when every deque is empty but directories are
+ * still being read, since those may queue more.
+ *
+ * @param arg A pointer to its 'GlobWalker'.
+ *
+ * @return A pointer to void.  Returns NULL.
+ */
+static void *globWalkerThread(void *arg) {
+    GlobWalker *walker = arg;
+    GlobTreeWalk *walk = walker->walk;
+    while (1) {
+        long generation = __atomic_load_n(&walk->generation, __ATOMIC_ACQUIRE);
+        GlobTreeNode *node = takeGlobTask(walker, 0);
+        for (int k = 1; node == NULL && k < walk->count; k++) {
+            node = takeGlobTask(&walk->walkers[(walker->index + k) % walk->count], 1);
+        }
+        if (node == NULL) {
+            pthread_mutex_lock(&walk->mutex);
+            if (walk->pending == 0) {
+                pthread_mutex_unlock(&walk->mutex);
+                break;
+            }
+            // Unless directories were queued since the deques were looked at
+            if (walk->generation == generation) {
+                walk->idle++;
+                pthread_cond_wait(&walk->cond, &walk->mutex);
+                walk->idle--;
+            }
+            pthread_mutex_unlock(&walk->mutex);
+            continue;
+        }
+
+        int queued = readGlobTreeNode(walker, node);
+        node->next = walker->done;
+        walker->done = node;
+        pthread_mutex_lock(&walk->mutex);
+        walk->pending += queued - 1;
+        if (queued > 0) {
+            __atomic_store_n(&walk->generation, walk->generation + 1, __ATOMIC_RELEASE);
+        }
+        if ((walk->pending == 0 || queued > 0) && walk->idle > 0) {
+            pthread_cond_broadcast(&walk->cond);
+        }
+        pthread_mutex_unlock(&walk->mutex);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Reads the whole directory tree below 'path' into the cache in
+ * parallel, for '**' to match against without touching the disk again.
+ *
+ * A pool of walkers (one per CPU, up to GLOB_WALKERS_MAX) share the work by
+ * work stealing: each reads directories with getdents64 from its own deque
+ * and queues the subdirectories it finds there, and an idle walker steals
+ * the oldest directory from another's deque. Results are not ordered; the
+ * matches are sorted afterwards. Directories already in the cache keep
+ * their listing.
+ *
+ * @return 0 on success, -1 if out of memory.
+ * @see https://man7.org/linux/man-pages/man2/sched_getaffinity.2.html
+ */
+static int walkGlobTree(GlobCache *cache, const char *path) {
+    int created;
+    if (cache->capacity > 0 && findGlobDirectory(cache, path, hashGlobPath(path))->walked) {
+        return 0; // An empty slot is never walked
+    }
+    GlobTreeNode *root = calloc(1, sizeof(GlobTreeNode));
+    if (root == NULL || (root->path = strdup(path)) == NULL) {
+        free(root);
+        return -1;
+    }
+
+    GlobTreeWalk *walk = calloc(1, sizeof(GlobTreeWalk));
+    cpu_set_t allowed;
+    if (walk == NULL) {
+        free(root->path);
+        free(root);
+        return -1;
+    }
+    walk->count = sched_getaffinity(0, sizeof(allowed), &allowed) == 0 ? CPU_COUNT(&allowed) : 1;
+    walk->count = walk->count < 1 ? 1 : walk->count > GLOB_WALKERS_MAX ? GLOB_WALKERS_MAX : walk->count;
+    pthread_mutex_init(&walk->mutex, NULL);
+    pthread_cond_init(&walk->cond, NULL);
+    for (int w = 0; w < walk->count; w++) {
+        pthread_mutex_init(&walk->walkers[w].mutex, NULL);
+        walk->walkers[w].walk = walk;
+        walk->walkers[w].index = w;
+    }
+    walk->pending = 1;
+    int status = pushGlobTask(&walk->walkers[0], root);
+    if (status != 0) {
+        free(root->path);
+        free(root);
+        walk->pending = 0;
+    }
+
+    // The calling thread is the first walker
+    pthread_t threads[GLOB_WALKERS_MAX];
+    int started = 1;
+    for (; status == 0 && started < walk->count; started++) {
+        if (pthread_create(&threads[started], NULL, globWalkerThread, &walk->walkers[started]) != 0) {
+            break; // Fewer walkers will do
+        }
+    }
+    if (status == 0) {
+        globWalkerThread(&walk->walkers[0]);
+    }
+    for (int w = 1; w < started; w++) {
+        pthread_join(threads[w], NULL);
+    }
+
+    // Move the listings into the cache
+    for (int w = 0; w < walk->count; w++) {
+        GlobWalker *walker = &walk->walkers[w];
+        status |= walker->failed ? -1 : 0;
+        for (GlobTreeNode *node = walker->done, *next; node != NULL; node = next) {
+            next = node->next;
+            GlobDirectory *dir = status == 0 ? claimGlobDirectory(cache, node->path, &created) : NULL;
+            if (dir == NULL) {
+                status = -1;
+            } else {
+                if (created) {
+                    dir->entries = node->entries;
+                    dir->count = node->count;
+                    dir->names = node->names;
+                    node->entries = NULL;
+                    node->names = NULL;
+                }
+                dir->walked = 1;
+            }
+            free(node->entries);
+            free(node->names);
+            free(node->path);
+            free(node);
+        }
+        free(walker->tasks);
+        pthread_mutex_destroy(&walker->mutex);
+    }
+    pthread_mutex_destroy(&walk->mutex);
+    pthread_cond_destroy(&walk->cond);
+    free(walk);
+    return status;
+}
+
+/**
+ * @brief Adds everything below a directory, hidden names excepted, for a
+ * trailing "**". Symbolic links to directories are listed but not followed.
+ *
+ * @param path A PATH_MAX buffer holding the directory; restored on return.
+ *
+ * @return 0 on success, -1 if out of memory.
+ */
+static int globEverything(GlobCache *cache, char *path, size_t length, int dir_only, GlobMatches *matches) {
+    GlobDirectory *dir = readGlobDirectory(cache, path);
+    if (dir == NULL) {
+        return -1;
+    }
+    // The listing may move when the cache grows, so walk a snapshot of it
+    int count = dir->count;
+    GlobEntry *entries = dir->entries;
+    int status = 0;
+    for (int e = 0; e < count && status == 0; e++) {
+        size_t joined = entries[e].name[0] != '.' ? joinGlobPath(path, length, entries[e].name) : 0;
+        if (joined == 0) {
+            continue;
+        }
+        int is_dir = isGlobDirectory(path, entries[e].type, 0);
+        if (is_dir || !dir_only || isGlobDirectory(path, entries[e].type, 1)) {
+            status = addGlobMatch(matches, path, dir_only);
+        }
+        if (status == 0 && is_dir) {
+            status = globEverything(cache, path, joined, dir_only, matches);
+        }
+        path[length] = '\0';
+    }
+    return status;
+}
+
+/**
+ * @brief Matches components 'index' onwards of a pattern below the path
+ * matched so far.
+ *
+ * A literal component is appended without reading the directory (a final
+ * one must exist); a wildcard component is matched against the cached
+ * listing of the directory, descending only into entries that may be
+ * directories; "**" tries the rest of the pattern here and in every
+ * directory below, without following symbolic links, once the tree has been
+ * read in parallel by 'walkGlobTree'.
+ *
+ * @param path A PATH_MAX buffer holding the path matched so far ("" for the
+ * current directory); restored on return.
+ *
+ * @return 0 on success, -1 if out of memory.
+ */
+static int globWalk(GlobCache *cache, const GlobPattern *pattern, int index, char *path, size_t length,
+                    GlobMatches *matches) {
+    const GlobComponent *component = pattern->components[index];
+    int last = index == pattern->count - 1;
+    struct stat st;
+    int status = 0;
+
+    if (component->literal != NULL) {
+        size_t joined = joinGlobPath(path, length, component->literal);
+        if (joined == 0) {
+            return 0;
+        }
+        if (!last) {
+            status = globWalk(cache, pattern, index + 1, path, joined, matches);
+        } else if (pattern->dir_only ? stat(path, &st) == 0 && S_ISDIR(st.st_mode) : lstat(path, &st) == 0) {
+            status = addGlobMatch(matches, path, pattern->dir_only);
+        }
+        path[length] = '\0';
+        return status;
+    }
+    if (component->globstar && walkGlobTree(cache, path) != 0) {
+        return -1;
+    }
+    if (component->globstar && last) {
+        return globEverything(cache, path, length, pattern->dir_only, matches);
+    }
+    if (component->globstar && globWalk(cache, pattern, index + 1, path, length, matches) != 0) {
+        return -1;
+    }
+
+    GlobDirectory *dir = readGlobDirectory(cache, path);
+    if (dir == NULL) {
+        return -1;
+    }
+    int count = dir->count;
+    GlobEntry *entries = dir->entries;
+    for (int e = 0; e < count && status == 0; e++) {
+        const GlobEntry *entry = &entries[e];
+        int match = component->globstar ? entry->name[0] != '.' : globComponentMatches(component, entry->name);
+        size_t joined = match ? joinGlobPath(path, length, entry->name) : 0;
+        if (joined == 0) {
+            continue;
+        }
+        if (component->globstar) {
+            if (isGlobDirectory(path, entry->type, 0)) {
+                status = globWalk(cache, pattern, index, path, joined, matches);
+            }
+        } else if (last) {
+            if (!pattern->dir_only || isGlobDirectory(path, entry->type, 1)) {
+                status = addGlobMatch(matches, path, pattern->dir_only);
+            }
+        } else if (entry->type == DT_DIR || entry->type == DT_LNK || entry->type == DT_UNKNOWN) {
+            status = globWalk(cache, pattern, index + 1, path, joined, matches);
+        }
+        path[length] = '\0';
+    }
+    return status;
+}
+
+/**
+ * A path with its first eight bytes as a big-endian integer, so most
+ * comparisons while sorting are one integer comparison.
+ */
+typedef struct {
+    uint64_t key;
+    char *path;
+} GlobSortItem;
+
+/**
+ * @brief Orders sort items bytewise, as strcmp does.
+ */
+static int compareGlobSortItems(const void *a, const void *b) {
+    const GlobSortItem *x = a, *y = b;
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+    return strcmp(x->path, y->path);
+}
+
+/**
+ * @brief Sorts matched paths in byte order, the order of glob(3) in the C
+ * locale the shell runs in, and drops duplicates (which repeated "**" can
+ * produce).
+ *
+ * @return 0 on success, -1 if out of memory.
+ * @see https://man7.org/linux/man-pages/man3/qsort.3.html
+ */
+static int sortGlobMatches(GlobMatches *matches) {
+    if (matches->count < 2) {
+        return 0;
+    }
+    GlobSortItem *items = malloc(matches->count * sizeof(GlobSortItem));
+    if (items == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < matches->count; i++) {
+        const unsigned char *p = (const unsigned char *)matches->paths[i];
+        uint64_t key = 0;
+        int k = 0;
+        for (; k < 8 && p[k] != '\0'; k++) {
+            key = key << 8 | p[k];
+        }
+        items[i].key = k < 8 ? key << (8 * (8 - k)) : key;
+        items[i].path = matches->paths[i];
+    }
+    qsort(items, matches->count, sizeof(GlobSortItem), compareGlobSortItems);
+    size_t kept = 0;
+    for (size_t i = 0; i < matches->count; i++) {
+        if (kept > 0 && strcmp(matches->paths[kept - 1], items[i].path) == 0) {
+            free(items[i].path);
+        } else {
+            matches->paths[kept++] = items[i].path;
+        }
+    }
+    matches->count = kept;
+    free(items);
+    return 0;
+}
+
+/**
+ * @brief Expands a leading '~' or '~user' of a word, as GLOB_TILDE does.
+ *
+ * @return 'word' itself if it has no tilde prefix or the user is unknown,
+ * otherwise 'buf'.
+ * @see https://man7.org/linux/man-pages/man3/getpwnam.3.html
+ */
+static const char *expandGlobTilde(const char *word, char *buf, size_t size) {
+    if (word[0] != '~') {
+        return word;
+    }
+    const char *rest = strchr(word, '/');
+    size_t name_length = rest != NULL ? (size_t)(rest - word - 1) : strlen(word + 1);
+    const char *home = NULL;
+    if (name_length == 0) {
+        home = getenv("HOME");
+        if (home == NULL) {
+            struct passwd *pw = getpwuid(getuid());
+            home = pw != NULL ? pw->pw_dir : NULL;
+        }
+    } else {
+        char user[256];
+        if (name_length < sizeof(user)) {
+            memcpy(user, word + 1, name_length);
+            user[name_length] = '\0';
+            struct passwd *pw = getpwnam(user);
+            home = pw != NULL ? pw->pw_dir : NULL;
+        }
+    }
+    if (home == NULL || (size_t)snprintf(buf, size, "%s%s", home, rest != NULL ? rest : "") >= size) {
+        return word;
+    }
+    return buf;
+}
+
+/**
+ * @brief Expands one glob pattern, replacing glob(3): the pattern is
+ * compiled once, directories are listed through 'cache', and "**" matches
+ * any number of directories.
+ *
+ * @param matches Receives the matching paths, sorted; none if nothing
+ * matched.
+ *
+ * @return 0 on success, -1 if out of memory.
+ */
+static int expandGlobPattern(GlobCache *cache, const char *word, GlobMatches *matches) {
+    char expanded[PATH_MAX];
+    char path[PATH_MAX];
+    GlobPattern pattern;
+    if (compileGlobPattern(expandGlobTilde(word, expanded, sizeof(expanded)), &pattern) != 0) {
+        return -1;
+    }
+    int status = 0;
+    strcpy(path, pattern.absolute ? "/" : "");
+    if (pattern.count > 0) {
+        status = globWalk(cache, &pattern, 0, path, strlen(path), matches);
+    }
+    freeGlobPattern(&pattern);
+    return status == 0 ? sortGlobMatches(matches) : -1;
+}
+
+/**
+ * @brief Appends a word to a growing argument array.
+ *
+ * @return 0 on success, -1 if out of memory (the word is then freed).
+ */
+static int appendExpandedArg(char ***expanded_args, size_t *num_expanded, char *arg) {
+    char **temp_expanded_args = realloc(*expanded_args, (*num_expanded + 1) * sizeof(char *));
+    if (temp_expanded_args == NULL) {
+        perror("realloc");
+        free(arg);
+        return -1;
+    }
+    *expanded_args = temp_expanded_args;
+    (*expanded_args)[(*num_expanded)++] = arg;
+    return 0;
+}
+
+/**
+ * @brief Expands wildcards in command arguments using globbing.
+ *
+ * This function takes an array of command arguments ('args') and expands any
+ * arguments that contain wildcard characters (*, ?, [], and "**" to match
+ * any number of directories) with 'expandGlobPattern'. Each argument's
+ * matches are sorted; an argument that matches nothing is kept as it is.
+ * Directory listings are shared by all the arguments, so each directory is
+ * read at most once per command. It dynamically allocates memory for the
+ * expanded arguments.
+ *
+ * @param args A null-terminated array of character pointers representing the
+ * command arguments.
+ * @param expanded_args A pointer to a pointer to an array of character pointers.
+ * This will be updated to point to the dynamically allocated array of expanded
+ * arguments.  It is the caller's responsibility to free this memory.
+ *
+ * @return The number of expanded arguments, or -1 on error.
+ */
+int expandWildcards(char **args, char ***expanded_args) {
+    GlobCache cache = {NULL, 0, 0};
+    size_t num_expanded = 0;
+    int status = 0;
+    *expanded_args = NULL;
+    if (glob_components.count > GLOB_COMPONENT_CACHE_MAX) {
+        clearGlobComponents();
+    }
+
+    for (int i = 0; args[i] != NULL && status == 0; i++) {
+        // Check if the argument contains any wildcard characters
+        if (strchr(args[i], '*') != NULL || strchr(args[i], '?') != NULL || strchr(args[i], '[') != NULL) {
+            GlobMatches matches = {NULL, 0, 0};
+            if (expandGlobPattern(&cache, args[i], &matches) != 0) {
+                fprintf(stderr, "glob: %s: out of memory\n", args[i]);
+                status = -1;
+            }
+            size_t j = 0;
+            for (; j < matches.count && status == 0; j++) {
+                status = appendExpandedArg(expanded_args, &num_expanded, matches.paths[j]);
+            }
+            for (; j < matches.count; j++) {
+                free(matches.paths[j]); // Not handed over because of an error
+            }
+            free(matches.paths);
+            if (matches.count > 0 || status != 0) {
+                continue;
+            }
+        }
+        // No wildcard, or no match: the argument is kept as it is
+        char *new_arg = strdup(args[i]);
+        if (new_arg == NULL) {
+            perror("strdup");
+            status = -1;
+        } else {
+            status = appendExpandedArg(expanded_args, &num_expanded, new_arg);
+        }
+    }
+    freeGlobCache(&cache);
+
+    if (status == 0) {
+        char **temp_expanded_args = realloc(*expanded_args, (num_expanded + 1) * sizeof(char *));
+        if (temp_expanded_args == NULL) {
+            perror("realloc");
+            status = -1;
+        } else {
+            *expanded_args = temp_expanded_args;
+            (*expanded_args)[num_expanded] = NULL;
+            return (int)num_expanded;
+        }
+    }
+    for (size_t k = 0; k < num_expanded; k++) {
+        free((*expanded_args)[k]);
+    }
+    free(*expanded_args);
+    *expanded_args = NULL;
+    return -1;
+}
+
+
+/**
+ * @brief Swaps two heap entries, keeping the commands' 'heap_index' in sync.
+ */
+static void swapDelayedHandles(DelayedQueue *queue, int a, int b) {
+    DelayedHandle tmp = queue->heap[a];
+    queue->heap[a] = queue->heap[b];
+    queue->heap[b] = tmp;
+    queue->slots[queue->heap[a].slot].heap_index = a;
+    queue->slots[queue->heap[b].slot].heap_index = b;
+}
+
+/**
+ * @brief Moves the heap entry at 'index' up until its parent is not later.
+ */
+static int delayedHandleBefore(const DelayedHandle *a, const DelayedHandle *b) {
+    return a->deadline < b->deadline || (a->deadline == b->deadline && a->priority < b->priority);
+}
+
+static void siftDelayedUp(DelayedQueue *queue, int index) {
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        if (!delayedHandleBefore(&queue->heap[index], &queue->heap[parent])) {
+            break;
+        }
+        swapDelayedHandles(queue, parent, index);
+        index = parent;
+    }
+}
+
+/**
+ * @brief Moves the heap entry at 'index' down until no child is earlier.
+ */
+static void siftDelayedDown(DelayedQueue *queue, int index) {
+    while (1) {
+        int smallest = index;
+        int left = 2 * index + 1, right = left + 1;
+        if (left < queue->count && delayedHandleBefore(&queue->heap[left], &queue->heap[smallest])) {
+            smallest = left;
+        }
+        if (right < queue->count && delayedHandleBefore(&queue->heap[right], &queue->heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == index) {
+            break;
+        }
+        swapDelayedHandles(queue, index, smallest);
+        index = smallest;
+    }
+}
+
+/**
+ * @brief Returns the home bucket of a job ID in the index.
+ */
+static int delayedIndexBucket(const DelayedQueue *queue, long id) {
+    return (int)(((uint64_t)id * 0x9E3779B97F4A7C15ULL) >> 32) & (queue->index_capacity - 1);
+}
+
+/**
+ * @brief Looks up the slot of a job ID; the caller must hold the queue's mutex.
+ *
+ * @return The slot, or -1 if no queued command has that ID.
+ */
+static int findDelayedSlot(const DelayedQueue *queue, long id) {
+    if (queue->index_capacity == 0) {
+        return -1;
+    }
+    for (int i = delayedIndexBucket(queue, id); queue->index[i].id != 0; i = (i + 1) & (queue->index_capacity - 1)) {
+        if (queue->index[i].id == id) {
+            return queue->index[i].slot;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Records the slot of a job ID, growing the index to keep it at most
+ * half full; the caller must hold the queue's mutex.
+ *
+ * A job stays in the index until it has finished, so the index is sized by
+ * its own count of IDs, not by the number of commands still in the heap.
+ *
+ * @return 0 on success, -1 if out of memory.
+ */
+static int indexDelayedSlot(DelayedQueue *queue, long id, int slot) {
+    if (2 * (queue->index_count + 1) > queue->index_capacity) {
+        int old_capacity = queue->index_capacity;
+        DelayedIndexEntry *old = queue->index;
+        int capacity = old_capacity ? old_capacity * 2 : 128;
+        DelayedIndexEntry *index = calloc(capacity, sizeof(DelayedIndexEntry));
+        if (index == NULL) {
+            return -1;
+        }
+        queue->index = index;
+        queue->index_capacity = capacity;
+        queue->index_count = 0; // Counted again as the entries are moved over
+        for (int i = 0; i < old_capacity; i++) {
+            if (old[i].id != 0) {
+                indexDelayedSlot(queue, old[i].id, old[i].slot);
+            }
+        }
+        free(old);
+    }
+    int i = delayedIndexBucket(queue, id);
+    while (queue->index[i].id != 0 && queue->index[i].id != id) {
+        i = (i + 1) & (queue->index_capacity - 1);
+    }
+    if (queue->index[i].id == 0) {
+        queue->index_count++;
+    }
+    queue->index[i].id = id;
+    queue->index[i].slot = slot;
+    return 0;
+}
+
+/**
+ * @brief Removes a job ID from the index; the caller must hold the queue's
+ * mutex. The entries after it in the probe sequence are shifted back, so
+ * the table never needs tombstones.
+ */
+static void unindexDelayedSlot(DelayedQueue *queue, long id) {
+    int mask = queue->index_capacity - 1;
+    int i = queue->index_capacity > 0 ? delayedIndexBucket(queue, id) : 0;
+    while (queue->index_capacity > 0 && queue->index[i].id != 0 && queue->index[i].id != id) {
+        i = (i + 1) & mask;
+    }
+    if (queue->index_capacity == 0 || queue->index[i].id == 0) {
+        return;
+    }
+    int hole = i;
+    for (int j = (i + 1) & mask; queue->index[j].id != 0; j = (j + 1) & mask) {
+        int home = delayedIndexBucket(queue, queue->index[j].id);
+        // Move the entry into the hole unless its home lies cyclically in (hole, j]
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            queue->index[hole] = queue->index[j];
+            hole = j;
+        }
+    }
+    queue->index[hole].id = 0;
+    queue->index_count--;
+}
+
+/**
+ * @brief Takes the command at heap position 'index' off the heap, in
+ * O(log n), leaving its slot in use; the caller must hold the queue's mutex.
+ *
+ * @return The slot of the command.
+ */
+static int unheapDelayedCommand(DelayedQueue *queue, int index) {
+    int slot = queue->heap[index].slot;
+    queue->count--;
+    if (index != queue->count) {
+        swapDelayedHandles(queue, index, queue->count);
+        siftDelayedDown(queue, index);
+        siftDelayedUp(queue, index);
+    }
+    if (queue->slots[slot].wall_time != 0) {
+        queue->wall_count--;
+    }
+    queue->slots[slot].heap_index = -1;
+    return slot;
+}
+
+/**
+ * @brief Returns the slot of a command that has left the heap to the free
+ * list; the caller must hold the queue's mutex.
+ */
+static void freeDelayedSlot(DelayedQueue *queue, int slot) {
+    DelayedCommand *command = &queue->slots[slot];
+    unindexDelayedSlot(queue, command->id);
+    if (command->schedule != NULL) {
+        freeRecurringSchedule(command->schedule);
+    }
+    free(command->schedule);
+    free(command->command);
+    free(command->dependents);
+    command->schedule = NULL;
+    command->command = NULL;
+    command->dependents = NULL;
+    command->next_free = queue->free_slot;
+    queue->free_slot = slot;
+}
+
+/**
+ * @brief Removes the command at heap position 'index' from the queue, in
+ * O(log n); the caller must hold the queue's mutex.
+ *
+ * @param id Receives the job ID of the command.
+ *
+ * @return The command string, owned by the caller.
+ */
+static char *removeDelayedCommand(DelayedQueue *queue, int index, long *id) {
+    int slot = unheapDelayedCommand(queue, index);
+    char *command = queue->slots[slot].command;
+    *id = queue->slots[slot].id;
+    queue->slots[slot].command = NULL;
+    freeDelayedSlot(queue, slot);
+    return command;
+}
+
+/**
+ * @brief Removes the earliest command from the heap to run it; the caller
+ * must hold the queue's mutex and the queue must not be empty. The command
+ * keeps its slot until 'finishDelayedCommand'.
+ *
+ * @param id Receives the job ID of the command.
+ *
+ * @return The command string, owned by the caller.
+ */
+static char *popDelayedCommand(DelayedQueue *queue, long *id) {
+    int slot = unheapDelayedCommand(queue, 0);
+    char *command = queue->slots[slot].command;
+    *id = queue->slots[slot].id;
+    queue->slots[slot].command = NULL;
+    return command;
+}
+
+/**
+ * @brief Inserts a command with a given job ID into the queue; the caller
+ * must hold the queue's mutex.
+ *
+ * The command is copied into a free slot and a handle to it is pushed onto
+ * the heap, in O(log n). The slot and heap arrays grow as needed, so the
+ * queue is limited only by memory.
+ *
+ * @return The slot of the command, or -1 if out of memory.
+ */
+static int insertDelayedCommand(DelayedQueue *queue, long id, int64_t deadline, time_t wall_time,
+                                const char *command) {
+    char *copy = strdup(command);
+    if (queue->free_slot < 0) {
+        int capacity = queue->slot_capacity ? queue->slot_capacity * 2 : 64;
+        DelayedCommand *slots = realloc(queue->slots, capacity * sizeof(DelayedCommand));
+        DelayedHandle *heap = slots != NULL ? realloc(queue->heap, capacity * sizeof(DelayedHandle)) : NULL;
+        if (slots != NULL) {
+            queue->slots = slots;
+        }
+        if (heap != NULL) {
+            queue->heap = heap;
+            queue->heap_capacity = capacity;
+            for (int i = capacity - 1; i >= queue->slot_capacity; i--) {
+                queue->slots[i].next_free = queue->free_slot;
+                queue->free_slot = i;
+            }
+            queue->slot_capacity = capacity;
+        }
+    }
+    if (copy == NULL || queue->free_slot < 0 || indexDelayedSlot(queue, id, queue->free_slot) != 0) {
+        free(copy);
+        return -1;
+    }
+    int slot = queue->free_slot;
+    queue->free_slot = queue->slots[slot].next_free;
+    queue->slots[slot].id = id;
+    queue->slots[slot].deadline = deadline;
+    queue->slots[slot].wall_time = wall_time;
+    queue->slots[slot].command = copy;
+    queue->slots[slot].schedule = NULL;
+    queue->slots[slot].batch = 0;
+    queue->slots[slot].priority = PRIORITY_NORMAL;
+    queue->slots[slot].queue = 0;
+    queue->slots[slot].batch_attempts = 0;
+    queue->slots[slot].dependents = NULL;
+    queue->slots[slot].dependent_count = 0;
+    queue->slots[slot].dependent_capacity = 0;
+    queue->slots[slot].after_count = 0;
+    queue->slots[slot].waiting = 0;
+    queue->slots[slot].heap_index = queue->count;
+    if (wall_time != 0) {
+        queue->wall_count++;
+    }
+    queue->heap[queue->count].deadline = deadline;
+    queue->heap[queue->count].slot = slot;
+    queue->heap[queue->count].priority = PRIORITY_NORMAL;
+    queue->count++;
+    siftDelayedUp(queue, queue->count - 1);
+    queue->metrics.inserted++;
+    if (queue->count > queue->metrics.max_depth) {
+        queue->metrics.max_depth = queue->count;
+    }
+    return slot;
+}
+
+/**
+ * @brief Sets how the command in 'slot' runs once due; the caller must hold
+ * the queue's mutex.
+ */
+static void applyDelayedJobOptions(DelayedQueue *queue, int slot, const DelayedJobOptions *options) {
+    DelayedCommand *command = &queue->slots[slot];
+    command->batch = options->batch;
+    command->priority = options->priority;
+    command->queue = options->queue;
+    queue->heap[command->heap_index].priority = options->priority;
+    siftDelayedUp(queue, command->heap_index);
+}
+
+/**
+ * @brief Makes a waiting command due now; the caller must hold the queue's
+ * mutex.
+ */
+static void releaseDelayedCommand(DelayedQueue *queue, int slot) {
+    DelayedCommand *command = &queue->slots[slot];
+    command->deadline = clockNanoseconds(CLOCK_MONOTONIC);
+    queue->heap[command->heap_index].deadline = command->deadline;
+    siftDelayedUp(queue, command->heap_index);
+    pthread_cond_signal(&queue->cond);
+}
+
+/**
+ * @brief Makes the command in 'slot' wait for the commands in
+ * 'options->after'; the caller must hold the queue's mutex.
+ *
+ * Each predecessor still queued or running gets an edge to the command;
+ * those already gone count as finished. A command left waiting for nothing
+ * is due right away.
+ *
+ * @return 0 on success, -1 if out of memory.
+ */
+static int linkDelayedCommand(DelayedQueue *queue, int slot, const DelayedJobOptions *options) {
+    DelayedCommand *command = &queue->slots[slot];
+    for (int k = 0; k < options->after_count; k++) {
+        int predecessor_slot = findDelayedSlot(queue, options->after[k].id);
+        if (predecessor_slot < 0) {
+            continue;
+        }
+        DelayedCommand *predecessor = &queue->slots[predecessor_slot];
+        if (predecessor->dependent_count == predecessor->dependent_capacity) {
+            int capacity = predecessor->dependent_capacity ? predecessor->dependent_capacity * 2 : 4;
+            DelayedEdge *edges = realloc(predecessor->dependents, capacity * sizeof(DelayedEdge));
+            if (edges == NULL) {
+                return -1;
+            }
+            predecessor->dependents = edges;
+            predecessor->dependent_capacity = capacity;
+        }
+        predecessor->dependents[predecessor->dependent_count++] = (DelayedEdge){command->id, options->after[k].on_success};
+        command->after[command->after_count++] = options->after[k];
+        command->waiting++;
+    }
+    if (command->waiting == 0 && command->deadline == DELAYED_HELD) {
+        releaseDelayedCommand(queue, slot);
+    }
+    return 0;
+}
+
+/**
+ * @brief Settles the commands waiting for the command in 'slot', which has
+ * finished with 'status', or was cancelled if 'status' is -1; the caller
+ * must hold the queue's mutex.
+ *
+ * Only the command's own edges are visited, so this takes O(out-degree)
+ * lookups. A waiting command is released once all it waits for have
+ * finished. It is cancelled instead, with everything waiting for it in
+ * turn, if one of them was cancelled, or failed and was needed to succeed
+ * ('--after-ok'). The slot is freed if the command is no longer on the heap.
+ *
+ * @param cancelled Receives a new array of the IDs of cancelled commands,
+ * or NULL if there are none.
+ *
+ * @return The number of cancelled commands.
+ */
+static int settleDelayedCommand(DelayedQueue *queue, int slot, int status, long **cancelled) {
+    typedef struct {
+        int slot;
+        int status;
+    } SettleStep;
+    SettleStep *stack = malloc(sizeof(SettleStep));
+    int depth = 0, capacity = 1, cancelled_count = 0;
+    *cancelled = NULL;
+    if (stack != NULL) {
+        stack[depth++] = (SettleStep){slot, status};
+    }
+    while (depth > 0) {
+        depth--;
+        DelayedCommand *command = &queue->slots[stack[depth].slot];
+        int finished_status = stack[depth].status;
+        long id = command->id;
+        DelayedEdge *edges = command->dependents;
+        int count = command->dependent_count;
+        command->dependents = NULL;
+        command->dependent_count = command->dependent_capacity = 0;
+        if (command->heap_index < 0) {
+            freeDelayedSlot(queue, stack[depth].slot);
+        }
+
+        for (int e = 0; e < count; e++) {
+            int waiting_slot = findDelayedSlot(queue, edges[e].id);
+            if (waiting_slot < 0 || queue->slots[waiting_slot].heap_index < 0) {
+                continue; // Cancelled already
+            }
+            DelayedCommand *waiting = &queue->slots[waiting_slot];
+            for (int k = 0; k < waiting->after_count; k++) {
+                if (waiting->after[k].id == id) {
+                    waiting->after[k].id = 0;
+                }
+            }
+            if (finished_status < 0 || (finished_status != 0 && edges[e].on_success)) {
+                if (depth == capacity) {
+                    capacity *= 2;
+                    SettleStep *grown = realloc(stack, capacity * sizeof(SettleStep));
+                    if (grown == NULL) {
+                        continue;
+                    }
+                    stack = grown;
+                }
+                long *ids = realloc(*cancelled, (cancelled_count + 1) * sizeof(long));
+                if (ids != NULL) {
+                    *cancelled = ids;
+                    ids[cancelled_count++] = waiting->id;
+                }
+                unheapDelayedCommand(queue, waiting->heap_index);
+                stack[depth++] = (SettleStep){waiting_slot, -1};
+            } else if (--waiting->waiting == 0) {
+                releaseDelayedCommand(queue, waiting_slot);
+            }
+        }
+        free(edges);
+    }
+    free(stack);
+    return cancelled_count;
+}
+
+
+/**
+ * @brief Reads 'clock' in nanoseconds.
+ *
+ * @see https://man7.org/linux/man-pages/man2/clock_gettime.2.html
+ */
+int64_t clockNanoseconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Initializes an empty delayed queue whose condition variable waits
+ * on CLOCK_MONOTONIC.
+ *
+ * @see https://man7.org/linux/man-pages/man3/pthread_condattr_setclock.3p.html
+ */
+void initDelayedQueue(DelayedQueue *queue) {
+    pthread_condattr_t attr;
+    memset(queue, 0, sizeof(*queue));
+    queue->free_slot = -1;
+    queue->clock_offset = clockNanoseconds(CLOCK_REALTIME) - clockNanoseconds(CLOCK_MONOTONIC);
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&queue->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&queue->ready.mutex, NULL);
+    pthread_cond_init(&queue->ready.cond, NULL);
+    snprintf(queue->ready.named[0].name, sizeof(queue->ready.named[0].name), "default");
+    queue->ready.named_count = 1;
+    queue->metrics.since = clockNanoseconds(CLOCK_MONOTONIC);
+}
+
+/**
+ * @brief Adds a duration to a histogram.
+ */
+static void recordLatency(LatencyHistogram *histogram, int64_t ns) {
+    int bucket = 0;
+    if (ns < 0) {
+        ns = 0;
+    }
+    while (bucket < LATENCY_BUCKETS - 1 && ns >> (bucket + 1) != 0) {
+        bucket++;
+    }
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    histogram->sum += ns;
+    if (ns > histogram->max) {
+        histogram->max = ns;
+    }
+}
+
+/**
+ * @brief Estimates a percentile of a histogram, interpolating linearly
+ * within the bucket holding it, but no more than the largest duration
+ * recorded.
+ *
+ * @param percentile Between 0 and 100.
+ */
+int64_t latencyPercentile(const LatencyHistogram *histogram, double percentile) {
+    double rank = histogram->count * percentile / 100;
+    long seen = 0;
+    for (int k = 0; k < LATENCY_BUCKETS; k++) {
+        long in_bucket = histogram->buckets[k];
+        if (in_bucket > 0 && seen + in_bucket >= rank) {
+            double low = k == 0 ? 0 : (double)((int64_t)1 << k);
+            double estimate = low + low * (rank - seen) / in_bucket;
+            return estimate < histogram->max ? (int64_t)estimate : histogram->max;
+        }
+        seen += in_bucket;
+    }
+    return histogram->max;
+}
+
+/**
+ * @brief Locks a delayed queue's mutex, counting contention and how long it
+ * was waited for and then held (see 'unlockDelayedQueue').
+ *
+ * @see https://man7.org/linux/man-pages/man3/pthread_mutex_trylock.3p.html
+ */
+void lockDelayedQueue(DelayedQueue *queue) {
+    if (pthread_mutex_trylock(&queue->mutex) != 0) {
+        int64_t start = clockNanoseconds(CLOCK_MONOTONIC);
+        pthread_mutex_lock(&queue->mutex);
+        queue->metrics.locked_at = clockNanoseconds(CLOCK_MONOTONIC);
+        queue->metrics.contended++;
+        recordLatency(&queue->metrics.lock_wait, queue->metrics.locked_at - start);
+    } else {
+        queue->metrics.locked_at = clockNanoseconds(CLOCK_MONOTONIC);
+    }
+}
+
+/**
+ * @brief Unlocks a delayed queue's mutex locked with 'lockDelayedQueue'.
+ */
+void unlockDelayedQueue(DelayedQueue *queue) {
+    recordLatency(&queue->metrics.lock_hold, clockNanoseconds(CLOCK_MONOTONIC) - queue->metrics.locked_at);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+/**
+ * @brief Waits on a delayed queue's condition variable until signalled or,
+ * if 'until' is not NULL, until that CLOCK_MONOTONIC time. The time spent
+ * waiting does not count as holding the mutex.
+ */
+static void waitDelayedQueue(DelayedQueue *queue, const struct timespec *until) {
+    recordLatency(&queue->metrics.lock_hold, clockNanoseconds(CLOCK_MONOTONIC) - queue->metrics.locked_at);
+    if (until != NULL) {
+        pthread_cond_timedwait(&queue->cond, &queue->mutex, until);
+    } else {
+        pthread_cond_wait(&queue->cond, &queue->mutex);
+    }
+    queue->metrics.locked_at = clockNanoseconds(CLOCK_MONOTONIC);
+    queue->metrics.wakeups++;
+}
+
+/**
+ * @brief Counts a command leaving the queue at 'now', 'lateness' after its
+ * deadline; the caller must hold the queue's mutex.
+ */
+static void recordDelayedDispatch(DelayedQueue *queue, int64_t now, int64_t lateness) {
+    DelayedMetrics *metrics = &queue->metrics;
+    int64_t second = (now - metrics->since) / 1000000000;
+    if (second != metrics->last_second) {
+        // Clear the seconds skipped since the last dispatch, at most a minute's worth
+        for (int64_t s = second; s > metrics->last_second && s > second - 60; s--) {
+            metrics->per_second[s % 60] = 0;
+        }
+        metrics->last_second = second;
+    }
+    metrics->per_second[second % 60]++;
+    metrics->dispatched++;
+    recordLatency(&metrics->lateness, lateness);
+}
+
+/**
+ * @brief Takes the next command a worker may start from the ready list; the
+ * caller must hold its mutex.
+ *
+ * That is the earliest dispatched command of the highest priority class
+ * among the named queues still below their concurrency limit. The queue of
+ * the command counts it as running.
+ *
+ * @return The command, or NULL if none may start now.
+ */
+static ReadyCommand *takeReadyCommand(ReadyQueue *ready) {
+    for (int priority = 0; priority < PRIORITY_CLASSES; priority++) {
+        NamedQueue *best = NULL;
+        for (int q = 0; q < ready->named_count; q++) {
+            NamedQueue *named = &ready->named[q];
+            if (named->head[priority] != NULL && (named->limit == 0 || named->running < named->limit)
+                && (best == NULL || named->head[priority]->sequence < best->head[priority]->sequence)) {
+                best = named;
+            }
+        }
+        if (best != NULL) {
+            ReadyCommand *job = best->head[priority];
+            best->head[priority] = job->next;
+            if (best->head[priority] == NULL) {
+                best->tail[priority] = NULL;
+            }
+            best->running++;
+            ready->count--;
+            return job;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Thread function of a delayed command worker.
+ *
+ * Takes due commands from the queue's ready list (see 'takeReadyCommand')
+ * and executes them (with the queue's 'execute' function, if set), so a
+ * long-running delayed command only occupies its own worker. Exits when idle
+ * and the pool has been shrunk below the current size.
+ *
+ * @param arg A pointer to the 'DelayedQueue' whose commands to execute.
+ *
+ * @return A pointer to void.  Returns NULL.
+ */
+static void *delayedWorker(void *arg) {
+    DelayedQueue *queue = arg;
+    ReadyQueue *ready = &queue->ready;
+    pthread_mutex_lock(&ready->mutex);
+    while (1) {
+        ReadyCommand *job;
+        while ((job = takeReadyCommand(ready)) == NULL && ready->worker_count <= ready->worker_target) {
+            pthread_cond_wait(&ready->cond, &ready->mutex);
+        }
+        if (job == NULL) {
+            break; // The pool was shrunk
+        }
+        ready->busy++;
+        recordLatency(&queue->metrics.start_delay, clockNanoseconds(CLOCK_MONOTONIC) - job->dispatched);
+        pthread_mutex_unlock(&ready->mutex);
+
+        int status = queue->execute != NULL ? queue->execute(job->id, job->command)
+                                            : executeDelayedCommand(job->id, job->command);
+        free(job->command);
+        finishDelayedCommand(queue, job->id, status);
+
+        pthread_mutex_lock(&ready->mutex);
+        ready->busy--;
+        ready->named[job->queue].running--;
+        free(job);
+    }
+    ready->worker_count--;
+    pthread_mutex_unlock(&ready->mutex);
+    return NULL;
+}
+
+/**
+ * @brief Resizes the pool of threads that execute due delayed commands.
+ *
+ * New workers are started right away; surplus workers exit once they have
+ * finished their current command.
+ *
+ * @param queue The queue whose pool to resize.
+ * @param count The number of workers wanted, at least 1.
+ *
+ * @return 0 on success, -1 if a thread could not be started.
+ * @see https://man7.org/linux/man-pages/man3/pthread_detach.3.html
+ */
+int setDelayedWorkers(DelayedQueue *queue, int count) {
+    ReadyQueue *ready = &queue->ready;
+    int status = 0;
+    pthread_mutex_lock(&ready->mutex);
+    ready->worker_target = count;
+    while (ready->worker_count < count) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, delayedWorker, queue) != 0) {
+            perror("pthread_create");
+            status = -1;
+            break;
+        }
+        pthread_detach(thread);
+        ready->worker_count++;
+    }
+    pthread_cond_broadcast(&ready->cond);
+    pthread_mutex_unlock(&ready->mutex);
+    return status;
+}
+
+/**
+ * @brief Hands due commands to the worker pool.
+ *
+ * Each is appended to the FIFO of its priority class in its named queue, and
+ * as many idle workers are woken as there are commands.
+ *
+ * @param queue The queue the commands came from.
+ * @param due The commands; their 'command' strings are taken over.
+ * @param count The number of commands.
+ */
+static void dispatchDelayedCommands(DelayedQueue *queue, const ReadyCommand *due, int count) {
+    ReadyQueue *ready = &queue->ready;
+    pthread_mutex_lock(&ready->mutex);
+    int64_t now = clockNanoseconds(CLOCK_MONOTONIC);
+    for (int i = 0; i < count; i++) {
+        ReadyCommand *job = malloc(sizeof(ReadyCommand));
+        if (job == NULL) {
+            perror("malloc");
+            free(due[i].command);
+            continue;
+        }
+        *job = due[i];
+        job->sequence = ready->next_sequence++;
+        job->dispatched = now;
+        job->next = NULL;
+        NamedQueue *named = &ready->named[job->queue];
+        if (named->tail[job->priority] != NULL) {
+            named->tail[job->priority]->next = job;
+        } else {
+            named->head[job->priority] = job;
+        }
+        named->tail[job->priority] = job;
+        ready->count++;
+        pthread_cond_signal(&ready->cond);
+    }
+    if (ready->count > queue->metrics.max_ready) {
+        queue->metrics.max_ready = ready->count;
+    }
+    pthread_mutex_unlock(&ready->mutex);
+}
+
+/**
+ * @brief Finds a named queue of the ready list, creating it if 'create' is
+ * set.
+ *
+ * @return Its index, or -1 if it does not exist or there are too many.
+ */
+int findNamedQueue(ReadyQueue *ready, const char *name, int create) {
+    pthread_mutex_lock(&ready->mutex);
+    int index = 0;
+    while (index < ready->named_count && strcmp(ready->named[index].name, name) != 0) {
+        index++;
+    }
+    if (index == ready->named_count) {
+        if (!create || index == MAX_NAMED_QUEUES || strlen(name) >= sizeof(ready->named[index].name)) {
+            index = -1;
+        } else {
+            snprintf(ready->named[index].name, sizeof(ready->named[index].name), "%s", name);
+            ready->named_count++;
+        }
+    }
+    pthread_mutex_unlock(&ready->mutex);
+    return index;
+}
+
+static const char *priority_names[PRIORITY_CLASSES] = {"high", "normal", "low"};
+
+/**
+ * @brief Parses the options that set how a delayed command runs:
+ * '--priority high|normal|low', '--queue NAME' and, as 'allowed' by
+ * JOB_OPTION_* flags, '--batch', '--after ID' and '--after-ok ID'. Unknown
+ * named queues are created.
+ *
+ * @param args The words to parse, starting with the first possible option.
+ * @param name The command name for error messages.
+ * @param options Receives the options; defaults apply to those not given.
+ *
+ * @return The number of words consumed, or -1 (an error is printed).
+ */
+int parseDelayedJobOptions(char **args, const char *name, int allowed, DelayedJobOptions *options) {
+    int used = 0;
+    options->batch = 0;
+    options->priority = PRIORITY_NORMAL;
+    options->queue = 0;
+    options->after_count = 0;
+    while (args[used] != NULL) {
+        int on_success = strcmp(args[used], "--after-ok") == 0;
+        if ((allowed & JOB_OPTION_BATCH) && strcmp(args[used], "--batch") == 0) {
+            options->batch = 1;
+            used++;
+        } else if ((allowed & JOB_OPTION_AFTER) && (on_success || strcmp(args[used], "--after") == 0)
+                   && args[used + 1] != NULL) {
+            char *end;
+            long id = strtol(args[used + 1], &end, 10);
+            if (*end != '\0' || id <= 0 || options->after_count == MAX_DEPENDENCIES) {
+                fprintf(stderr, "%s: %s: invalid job ID, or more than %d jobs to wait for\n", name,
+                        args[used + 1], MAX_DEPENDENCIES);
+                return -1;
+            }
+            options->after[options->after_count++] = (DelayedEdge){id, on_success};
+            used += 2;
+        } else if (strcmp(args[used], "--priority") == 0 && args[used + 1] != NULL) {
+            int priority = 0;
+            while (priority < PRIORITY_CLASSES && strcmp(args[used + 1], priority_names[priority]) != 0) {
+                priority++;
+            }
+            if (priority == PRIORITY_CLASSES) {
+                fprintf(stderr, "%s: %s: priority must be high, normal or low\n", name, args[used + 1]);
+                return -1;
+            }
+            options->priority = priority;
+            used += 2;
+        } else if (strcmp(args[used], "--queue") == 0 && args[used + 1] != NULL) {
+            options->queue = findNamedQueue(&delayed_queue.ready, args[used + 1], 1);
+            if (options->queue < 0) {
+                fprintf(stderr, "%s: %s: too many queues, or the name is too long\n", name, args[used + 1]);
+                return -1;
+            }
+            used += 2;
+        } else {
+            break;
+        }
+    }
+    return used;
+}
+
+/**
+ * @brief Formats the non-default priority and named queue of a command, and
+ * the commands it still waits for, as the options that set them, followed by
+ * a space, for the journal.
+ */
+static void formatDelayedJobOptions(const DelayedQueue *queue, const DelayedCommand *command,
+                                    char *buf, size_t size) {
+    int used = 0;
+    buf[0] = '\0';
+    if (command->priority != PRIORITY_NORMAL) {
+        used = snprintf(buf, size, "--priority %s ", priority_names[command->priority]);
+    }
+    if (command->queue != 0) {
+        used += snprintf(buf + used, size - used, "--queue %s ", queue->ready.named[command->queue].name);
+    }
+    for (int k = 0; k < command->after_count && used < (int)size; k++) {
+        if (command->after[k].id != 0) {
+            used += snprintf(buf + used, size - used, "%s %ld ",
+                             command->after[k].on_success ? "--after-ok" : "--after", command->after[k].id);
+        }
+    }
+}
+
+/**
+ * @brief Reads the options written by 'formatDelayedJobOptions' at the start
+ * of a journal record's text.
+ *
+ * @return The text after the options.
+ */
+static char *parseJournalJobOptions(char *text, DelayedJobOptions *options) {
+    char option[16], value[64], flag[24];
+    int offset;
+    options->batch = 0;
+    options->priority = PRIORITY_NORMAL;
+    options->queue = 0;
+    options->after_count = 0;
+    while (offset = 0, sscanf(text, "--%15s %63s %n", option, value, &offset) == 2 && offset > 0) {
+        snprintf(flag, sizeof(flag), "--%s", option);
+        char *words[] = {flag, value, NULL};
+        DelayedJobOptions parsed;
+        if (parseDelayedJobOptions(words, "journal", JOB_OPTION_AFTER, &parsed) != 2) {
+            break;
+        }
+        if (strcmp(option, "priority") == 0) {
+            options->priority = parsed.priority;
+        } else if (strcmp(option, "queue") == 0) {
+            options->queue = parsed.queue;
+        } else if (options->after_count < MAX_DEPENDENCIES) {
+            options->after[options->after_count++] = parsed.after[0];
+        }
+        text += offset;
+    }
+    return text;
+}
+
+/**
+ * @brief Moves wall-clock commands if the system time was changed.
+ *
+ * When the offset between CLOCK_REALTIME and CLOCK_MONOTONIC has moved by
+ * more than 100ms since it was last seen (the clock was set, or stepped by
+ * NTP), every command scheduled with 'delay --at' gets its deadline
+ * recomputed from its wall-clock time and the heap is rebuilt. The caller
+ * must hold the queue's mutex.
+ */
+static void rebaseWallClockCommands(DelayedQueue *queue) {
+    int64_t offset = clockNanoseconds(CLOCK_REALTIME) - clockNanoseconds(CLOCK_MONOTONIC);
+    int64_t drift = offset - queue->clock_offset;
+    if (drift > -100000000 && drift < 100000000) {
+        return;
+    }
+    queue->clock_offset = offset;
+    for (int i = 0; i < queue->count; i++) {
+        DelayedCommand *command = &queue->slots[queue->heap[i].slot];
+        if (command->wall_time != 0) {
+            command->deadline = (int64_t)command->wall_time * 1000000000 - offset;
+            queue->heap[i].deadline = command->deadline;
+        }
+    }
+    for (int i = queue->count / 2 - 1; i >= 0; i--) {
+        siftDelayedDown(queue, i);
+    }
+}
+
+static const char *const cron_month_names[] = {
+    "jan", "feb", "mar", "apr", "may", "jun", "jul", "aug", "sep", "oct", "nov", "dec", NULL
+};
+static const char *const cron_weekday_names[] = {"sun", "mon", "tue", "wed", "thu", "fri", "sat", NULL};
+
+/**
+ * @brief Parses one value of a cron field: a number, or a three-letter
+ * month or weekday name if 'names' is given ('base' is the first name's value).
+ *
+ * @return The value, or -1 if there is none at 'str'.
+ */
+static int parseCronValue(const char *str, char **end, int base, const char *const *names) {
+    for (int k = 0; names != NULL && names[k] != NULL; k++) {
+        if (strncasecmp(str, names[k], 3) == 0) {
+            *end = (char *)str + 3;
+            return base + k;
+        }
+    }
+    if (!isdigit((unsigned char)*str)) {
+        return -1;
+    }
+    return (int)strtol(str, end, 10);
+}
+
+/**
+ * @brief Compiles one cron field into a bitset.
+ *
+ * A field is a comma-separated list of '*', 'a', 'a-b', each optionally
+ * followed by '/step' ('a/step' means 'a-max/step').
+ *
+ * @param field The field as typed.
+ * @param min The smallest allowed value.
+ * @param max The largest allowed value.
+ * @param names Value names accepted in place of numbers, or NULL.
+ * @param base The value of the first name.
+ * @param bits Receives one bit per allowed value.
+ *
+ * @return 0 on success, -1 if the field is invalid.
+ */
+static int parseCronField(const char *field, int min, int max, const char *const *names, int base,
+                          uint64_t *bits) {
+    char *copy = strdup(field);
+    char *save = NULL;
+    *bits = 0;
+    if (copy == NULL) {
+        perror("strdup");
+        return -1;
+    }
+    for (char *item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+        int lo = min, hi = max, step = 1;
+        char *p = item;
+        if (*p == '*') {
+            p++;
+        } else {
+            lo = hi = parseCronValue(p, &p, base, names);
+            if (lo >= 0 && *p == '-') {
+                hi = parseCronValue(p + 1, &p, base, names);
+            } else if (lo >= 0 && *p == '/') {
+                hi = max;
+            }
+        }
+        if (*p == '/') {
+            step = (int)strtol(p + 1, &p, 10);
+        }
+        if (*p != '\0' || lo < min || hi > max || lo > hi || step <= 0) {
+            free(copy);
+            return -1;
+        }
+        for (int v = lo; v <= hi; v += step) {
+            *bits |= 1ULL << v;
+        }
+    }
+    free(copy);
+    return *bits != 0 ? 0 : -1;
+}
+
+/**
+ * @brief Stores the words of a schedule, joined by spaces, as its text.
+ *
+ * @return 'count', or -1 if out of memory.
+ */
+static int setRecurringSpec(RecurringSchedule *schedule, char **words, int count) {
+    size_t length = 0;
+    for (int k = 0; k < count; k++) {
+        length += strlen(words[k]) + 1;
+    }
+    schedule->spec = malloc(length);
+    if (schedule->spec == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    schedule->spec[0] = '\0';
+    for (int k = 0; k < count; k++) {
+        if (k > 0) {
+            strcat(schedule->spec, " ");
+        }
+        strcat(schedule->spec, words[k]);
+    }
+    return count;
+}
+
+/**
+ * @brief Compiles the schedule at the start of 'words' ("every <duration>",
+ * "cron <min> <hour> <day> <month> <weekday>" or "cron @hourly", "@daily",
+ * "@weekly", "@monthly", "@yearly").
+ *
+ * On success 'schedule->spec' is allocated; free it with
+ * 'freeRecurringSchedule'.
+ *
+ * @return The number of words of the schedule, or -1 if it is invalid (an
+ * error is printed).
+ */
+int parseRecurringSchedule(char **words, RecurringSchedule *schedule) {
+    memset(schedule, 0, sizeof(*schedule));
+    if (strcmp(words[0], "every") == 0) {
+        double seconds;
+        if (words[1] == NULL || parseDuration(words[1], &seconds) != 0 || seconds < 0.001) {
+            fprintf(stderr, "every: invalid interval '%s'\n", words[1] != NULL ? words[1] : "");
+            return -1;
+        }
+        schedule->interval = (int64_t)(seconds * 1e9);
+        return setRecurringSpec(schedule, words, 2);
+    }
+
+    static const struct {
+        const char *name;
+        const char *fields[5];
+    } macros[] = {
+        {"@hourly", {"0", "*", "*", "*", "*"}},
+        {"@daily", {"0", "0", "*", "*", "*"}},
+        {"@midnight", {"0", "0", "*", "*", "*"}},
+        {"@weekly", {"0", "0", "*", "*", "0"}},
+        {"@monthly", {"0", "0", "1", "*", "*"}},
+        {"@yearly", {"0", "0", "1", "1", "*"}},
+        {"@annually", {"0", "0", "1", "1", "*"}},
+    };
+    const char *fields[5];
+    int consumed = 6;
+    if (words[1] != NULL && words[1][0] == '@') {
+        int found = 0;
+        for (size_t k = 0; k < sizeof(macros) / sizeof(macros[0]); k++) {
+            if (strcmp(words[1], macros[k].name) == 0) {
+                memcpy(fields, macros[k].fields, sizeof(fields));
+                found = 1;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "cron: unknown schedule '%s'\n", words[1]);
+            return -1;
+        }
+        consumed = 2;
+    } else {
+        for (int k = 0; k < 5; k++) {
+            if (words[k + 1] == NULL) {
+                fprintf(stderr, "cron: expected five fields: minute hour day month weekday\n");
+                return -1;
+            }
+            fields[k] = words[k + 1];
+        }
+    }
+
+    uint64_t minutes, hours, days, months, weekdays;
+    if (parseCronField(fields[0], 0, 59, NULL, 0, &minutes) != 0
+        || parseCronField(fields[1], 0, 23, NULL, 0, &hours) != 0
+        || parseCronField(fields[2], 1, 31, NULL, 0, &days) != 0
+        || parseCronField(fields[3], 1, 12, cron_month_names, 1, &months) != 0
+        || parseCronField(fields[4], 0, 7, cron_weekday_names, 0, &weekdays) != 0) {
+        fprintf(stderr, "cron: invalid schedule\n");
+        return -1;
+    }
+    schedule->minutes = minutes;
+    schedule->hours = (uint32_t)hours;
+    schedule->days = (uint32_t)days;
+    schedule->months = (uint16_t)months;
+    schedule->weekdays = (uint8_t)((weekdays | weekdays >> 7) & 0x7f); // 7 is Sunday too
+    schedule->any_day = strcmp(fields[2], "*") == 0;
+    schedule->any_weekday = strcmp(fields[4], "*") == 0;
+    if (nextCronTime(schedule, time(NULL)) < 0) {
+        fprintf(stderr, "cron: schedule never fires\n");
+        return -1;
+    }
+    return setRecurringSpec(schedule, words, consumed);
+}
+
+/**
+ * @brief Frees the text of a schedule filled in by 'parseRecurringSchedule'.
+ */
+void freeRecurringSchedule(RecurringSchedule *schedule) {
+    free(schedule->spec);
+    schedule->spec = NULL;
+}
+
+/**
+ * @brief Whether a day matches a cron schedule. As in cron, when both the
+ * day-of-month and the day-of-week fields are restricted, either may match.
+ */
+static int cronDayMatches(const RecurringSchedule *schedule, const struct tm *tm) {
+    int day = (schedule->days >> tm->tm_mday) & 1;
+    int weekday = (schedule->weekdays >> tm->tm_wday) & 1;
+    if (schedule->any_day) {
+        return weekday;
+    }
+    if (schedule->any_weekday) {
+        return day;
+    }
+    return day || weekday;
+}
+
+/**
+ * @brief Computes the first time after 'after' at which a cron schedule
+ * fires, in local time.
+ *
+ * Rather than testing minute after minute, each step jumps straight to the
+ * next set bit of the first field that does not match (month, then day,
+ * hour and minute) and resets the smaller fields, so a next firing time is
+ * found in a handful of steps.
+ *
+ * @return The firing time, or -1 if the schedule never fires (e.g. on
+ * February 30th).
+ * @see https://man7.org/linux/man-pages/man5/crontab.5.html
+ */
+time_t nextCronTime(const RecurringSchedule *schedule, time_t after) {
+    time_t t = after - after % 60 + 60;
+    struct tm tm;
+    localtime_r(&t, &tm);
+    for (int step = 0; step < 100000; step++) {
+        if (!((schedule->months >> (tm.tm_mon + 1)) & 1)) {
+            unsigned later = schedule->months >> (tm.tm_mon + 2);
+            if (later != 0) {
+                tm.tm_mon += 1 + __builtin_ctz(later);
+            } else {
+                tm.tm_year++;
+                tm.tm_mon = __builtin_ctz(schedule->months) - 1;
+            }
+            tm.tm_mday = 1;
+            tm.tm_hour = 0;
+            tm.tm_min = 0;
+        } else if (!cronDayMatches(schedule, &tm)) {
+            tm.tm_mday++;
+            tm.tm_hour = 0;
+            tm.tm_min = 0;
+        } else if (!((schedule->hours >> tm.tm_hour) & 1)) {
+            uint32_t later = tm.tm_hour < 23 ? schedule->hours >> (tm.tm_hour + 1) : 0;
+            if (later != 0) {
+                tm.tm_hour += 1 + __builtin_ctz(later);
+            } else {
+                tm.tm_mday++;
+                tm.tm_hour = 0;
+            }
+            tm.tm_min = 0;
+        } else if (!((schedule->minutes >> tm.tm_min) & 1)) {
+            uint64_t later = tm.tm_min < 59 ? schedule->minutes >> (tm.tm_min + 1) : 0;
+            if (later != 0) {
+                tm.tm_min += 1 + __builtin_ctzll(later);
+            } else {
+                tm.tm_hour++;
+                tm.tm_min = 0;
+            }
+        } else {
+            tm.tm_isdst = -1;
+            time_t fire = mktime(&tm);
+            if (fire > after) {
+                return fire;
+            }
+            tm.tm_min++; // Repeated hour at the end of DST
+        }
+        tm.tm_sec = 0;
+        tm.tm_isdst = -1;
+        mktime(&tm); // Normalize the fields and recompute the weekday
+    }
+    return -1;
+}
+
+/**
+ * @brief Queues a recurring command under job ID 'id' at its first firing
+ * time; the caller must hold the queue's mutex.
+ *
+ * @return 0 on success, -1 if out of memory.
+ */
+static int armRecurringCommand(DelayedQueue *queue, long id, const RecurringSchedule *schedule,
+                               const char *command) {
+    RecurringSchedule *copy = malloc(sizeof(RecurringSchedule));
+    int64_t deadline;
+    time_t wall_time = 0;
+    if (schedule->interval > 0) {
+        deadline = clockNanoseconds(CLOCK_MONOTONIC) + schedule->interval;
+    } else {
+        wall_time = nextCronTime(schedule, time(NULL));
+        deadline = (int64_t)wall_time * 1000000000 - queue->clock_offset;
+    }
+    char *spec = strdup(schedule->spec);
+    int slot = copy != NULL && spec != NULL ? insertDelayedCommand(queue, id, deadline, wall_time, command) : -1;
+    if (slot < 0) {
+        free(copy);
+        free(spec);
+        return -1;
+    }
+    *copy = *schedule;
+    copy->spec = spec;
+    queue->slots[slot].schedule = copy;
+    return 0;
+}
+
+/**
+ * @brief Moves the earliest command, which is recurring and has just fired,
+ * to its next firing time; the caller must hold the queue's mutex.
+ */
+static void rescheduleRecurringCommand(DelayedQueue *queue, int64_t now) {
+    DelayedCommand *command = &queue->slots[queue->heap[0].slot];
+    const RecurringSchedule *schedule = command->schedule;
+    if (schedule->interval > 0) {
+        command->deadline += schedule->interval;
+        if (command->deadline <= now) {
+            command->deadline += ((now - command->deadline) / schedule->interval + 1) * schedule->interval;
+        }
+    } else {
+        time_t next = nextCronTime(schedule, command->wall_time);
+        if (next <= time(NULL)) {
+            next = nextCronTime(schedule, time(NULL));
+        }
+        command->wall_time = next;
+        command->deadline = (int64_t)next * 1000000000 - queue->clock_offset;
+    }
+    queue->heap[0].deadline = command->deadline;
+    siftDelayedDown(queue, 0);
+}
+
+/**
+ * @brief Implements the 'every' and 'cron' built-in commands.
+ *
+ * Usage:
+ * every [options] <duration> <command>
+ * cron [options] <minute> <hour> <day> <month> <weekday> <command>
+ * cron [options] @hourly|@daily|@weekly|@monthly|@yearly <command>
+ *
+ * Schedules 'command' to run repeatedly (see 'addRecurringCommand') and
+ * prints its job ID. Cron fields take '*', lists, ranges, steps and month
+ * and weekday names. The options are '--priority' and '--queue', as for
+ * 'delay'.
+ *
+ * @param args The arguments of the command, starting with "every" or "cron".
+ *
+ * @return 0 on success, 1 if the command could not be queued, 2 on a usage
+ * error or an invalid schedule.
+ */
+int recurringCommand(char **args) {
+    RecurringSchedule schedule;
+    DelayedJobOptions options;
+    int skip = parseDelayedJobOptions(args + 1, args[0], 0, &options);
+    if (skip < 0) {
+        return 2;
+    }
+    args[skip] = args[0]; // The schedule follows the options
+    args += skip;
+    int consumed = parseRecurringSchedule(args, &schedule);
+    if (consumed < 0 || args[consumed] == NULL) {
+        if (consumed >= 0) {
+            freeRecurringSchedule(&schedule);
+        }
+        fprintf(stderr, "Usage: every [options] <duration> <command> | "
+                        "cron [options] <minute> <hour> <day> <month> <weekday> <command>\n");
+        return 2;
+    }
+    char command[MAX_COMMAND_LENGTH];
+    command[0] = '\0';
+    for (int j = consumed; args[j] != NULL; j++) {
+        if (j > consumed) {
+            strncat(command, " ", sizeof(command) - strlen(command) - 1);
+        }
+        strncat(command, args[j], sizeof(command) - strlen(command) - 1);
+    }
+    long id = addRecurringCommand(&delayed_queue, &schedule, &options, command);
+    freeRecurringSchedule(&schedule);
+    if (id < 0) {
+        return 1;
+    }
+    printf("[Delayed] Job ID: %ld\n", id);
+    return 0;
+}
+
+#define JOURNAL_BATCH_WINDOW_NS 10000000  // how long a batch collects records
+#define JOURNAL_COMPACT_MIN 4096           // records before compaction is considered
+
+/**
+ * @brief Appends a formatted record to the journal's buffer and wakes the
+ * journal thread. Does nothing if the queue is not journaled.
+ */
+static void journalAppend(DelayedQueue *queue, const char *format, ...) {
+    DelayedJournal *journal = queue->journal;
+    if (journal == NULL) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, format);
+    int n = vsnprintf(NULL, 0, format, ap);
+    va_end(ap);
+    if (n < 0) {
+        return;
+    }
+    pthread_mutex_lock(&journal->mutex);
+    if (journal->length + n + 1 > journal->capacity) {
+        size_t capacity = journal->capacity ? journal->capacity * 2 : 8192;
+        while (capacity < journal->length + n + 1) {
+            capacity *= 2;
+        }
+        char *buffer = realloc(journal->buffer, capacity);
+        if (buffer == NULL) {
+            perror("journal");
+            pthread_mutex_unlock(&journal->mutex);
+            return;
+        }
+        journal->buffer = buffer;
+        journal->capacity = capacity;
+    }
+    // Formatted in place; the terminating null is overwritten by the next record
+    va_start(ap, format);
+    vsnprintf(journal->buffer + journal->length, n + 1, format, ap);
+    va_end(ap);
+    journal->length += n;
+    pthread_cond_signal(&journal->cond);
+    pthread_mutex_unlock(&journal->mutex);
+}
+
+#define JOURNAL_AT 1      // flag of an "A" record: scheduled with 'delay --at'
+#define JOURNAL_BATCH 2   // flag of an "A" record: a batch command
+#define JOURNAL_AFTER 4   // flag of an "A" record: waits for other commands, no time
+
+/**
+ * @brief Records that a command was added: "A <id> <realtime ns> <flags> <command>".
+ *
+ * The deadline is stored on CLOCK_REALTIME, the only clock that means
+ * anything after a restart; 'delay --at' commands store their wall-clock time.
+ */
+static void journalDelayedAdd(DelayedQueue *queue, long id, int64_t realtime, time_t wall_time,
+                              int batch, const char *options, const char *command) {
+    int held = realtime == DELAYED_HELD;
+    if (wall_time != 0) {
+        realtime = (int64_t)wall_time * 1000000000;
+    }
+    journalAppend(queue, "A %ld %lld %d %s%s\n", id, held ? 0LL : (long long)realtime,
+                  (wall_time != 0 ? JOURNAL_AT : 0) | (batch ? JOURNAL_BATCH : 0) | (held ? JOURNAL_AFTER : 0),
+                  options, command);
+}
+
+/**
+ * @brief Records that a command left the queue: "D <id>".
+ */
+static void journalDelayedDone(DelayedQueue *queue, long id) {
+    journalAppend(queue, "D %ld\n", id);
+}
+
+/**
+ * @brief Records the concurrency limit of a named queue: "Q <name> <limit>".
+ */
+static void journalQueueLimit(DelayedQueue *queue, const char *name, int limit) {
+    journalAppend(queue, "Q %s %d\n", name, limit);
+}
+
+/**
+ * @brief Writes all of 'length' bytes of 'data' to 'fd'.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int writeAll(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Replaces the journal with one holding only the pending commands
+ * and the limits of the named queues.
+ *
+ * The new journal is written to '<path>.tmp', synced and renamed over the
+ * old one, and the directory is synced so the rename itself is durable.
+ * Only the journal thread (or startup, before it runs) calls this, so
+ * records appended meanwhile simply go to the new file on the next flush;
+ * replay tolerates the duplicate or orphaned records this can produce.
+ *
+ * @return 0 on success, -1 on failure (the old journal is kept).
+ * @see https://man7.org/linux/man-pages/man2/rename.2.html
+ */
+static int compactDelayedJournal(DelayedQueue *queue) {
+    DelayedJournal *journal = queue->journal;
+    size_t length = 0, capacity = 8192;
+    char *data = malloc(capacity);
+    long records = 0;
+
+    // Fits: at most MAX_NAMED_QUEUES short records
+    ReadyQueue *ready = &queue->ready;
+    pthread_mutex_lock(&ready->mutex);
+    for (int q = 0; data != NULL && q < ready->named_count; q++) {
+        length += snprintf(data + length, capacity - length, "Q %s %d\n", ready->named[q].name,
+                           ready->named[q].limit);
+        records++;
+    }
+    pthread_mutex_unlock(&ready->mutex);
+
+    lockDelayedQueue(queue);
+    for (int i = 0; data != NULL && i < queue->count; i++) {
+        DelayedCommand *command = &queue->slots[queue->heap[i].slot];
+        int held = command->deadline == DELAYED_HELD;
+        int64_t realtime = command->wall_time != 0 ? (int64_t)command->wall_time * 1000000000
+                           : held ? 0 : command->deadline + queue->clock_offset;
+        size_t needed = strlen(command->command) + 600;
+        if (command->schedule != NULL) {
+            needed += strlen(command->schedule->spec);
+        }
+        while (data != NULL && capacity - length < needed) {
+            capacity *= 2;
+            char *grown = realloc(data, capacity);
+            if (grown == NULL) {
+                free(data);
+            }
+            data = grown;
+        }
+        if (data == NULL) {
+            break;
+        }
+        char options[512];
+        formatDelayedJobOptions(queue, command, options, sizeof(options));
+        if (command->schedule != NULL) {
+            length += snprintf(data + length, capacity - length, "R %ld %s%s %s\n", command->id,
+                               options, command->schedule->spec, command->command);
+        } else {
+            length += snprintf(data + length, capacity - length, "A %ld %lld %d %s%s\n", command->id,
+                               (long long)realtime,
+                               (command->wall_time != 0 ? JOURNAL_AT : 0) | (command->batch ? JOURNAL_BATCH : 0)
+                               | (held ? JOURNAL_AFTER : 0),
+                               options, command->command);
+        }
+        records++;
+    }
+    unlockDelayedQueue(queue);
+    if (data == NULL) {
+        perror("journal");
+        return -1;
+    }
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", journal->path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0 || writeAll(fd, data, length) != 0 || fdatasync(fd) != 0
+        || rename(tmp, journal->path) != 0) {
+        perror(tmp);
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+        free(data);
+        return -1;
+    }
+    free(data);
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", journal->path);
+    int dir_fd = open(dirname(dir), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    if (journal->fd >= 0) {
+        close(journal->fd);
+    }
+    journal->fd = fd;
+    journal->records = records;
+    return 0;
+}
+
+/**
+ * @brief Writes the buffered records out with one 'write' and 'fdatasync'.
+ */
+static void flushDelayedJournal(DelayedJournal *journal) {
+    pthread_mutex_lock(&journal->mutex);
+    char *data = journal->buffer;
+    size_t length = journal->length;
+    journal->buffer = NULL;
+    journal->length = 0;
+    journal->capacity = 0;
+    pthread_mutex_unlock(&journal->mutex);
+    if (length == 0) {
+        free(data);
+        return;
+    }
+    if (writeAll(journal->fd, data, length) != 0 || fdatasync(journal->fd) != 0) {
+        perror(journal->path);
+    }
+    for (size_t i = 0; i < length; i++) {
+        journal->records += data[i] == '\n';
+    }
+    free(data);
+}
+
+/**
+ * @brief Thread function of the journal writer.
+ *
+ * Waits for records, lets a batch collect for 'JOURNAL_BATCH_WINDOW_NS' so
+ * that a burst of 'delay' commands costs one 'fdatasync', and writes it
+ * out. Compacts the journal once it holds many more records than there are
+ * pending commands. A command is therefore durable within about 10ms of
+ * being queued.
+ *
+ * @param arg A pointer to the journaled 'DelayedQueue'.
+ *
+ * @return A pointer to void.  Returns NULL.
+ * @see https://man7.org/linux/man-pages/man2/fdatasync.2.html
+ */
+static void *delayedJournalThread(void *arg) {
+    DelayedQueue *queue = arg;
+    DelayedJournal *journal = queue->journal;
+    while (1) {
+        pthread_mutex_lock(&journal->mutex);
+        while (journal->length == 0 && !journal->stopping) {
+            pthread_cond_wait(&journal->cond, &journal->mutex);
+        }
+        int stopping = journal->stopping;
+        pthread_mutex_unlock(&journal->mutex);
+        if (!stopping) {
+            struct timespec window = {0, JOURNAL_BATCH_WINDOW_NS};
+            nanosleep(&window, NULL);
+        }
+        flushDelayedJournal(journal);
+        if (stopping) {
+            break;
+        }
+        lockDelayedQueue(queue);
+        long live = queue->count;
+        unlockDelayedQueue(queue);
+        if (journal->records > JOURNAL_COMPACT_MIN && journal->records > 4 * live) {
+            compactDelayedJournal(queue);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * A command read back from the journal.
+ */
+typedef struct {
+    long id;
+    long sequence;      // position in the journal: the last record of an ID wins
+    int64_t realtime;
+    int flags;          // JOURNAL_AT, JOURNAL_BATCH, JOURNAL_AFTER
+    int recurring;      // 'command' starts with the schedule
+    char *command;
+} JournalRecord;
+
+static int compareJournalRecords(const void *a, const void *b) {
+    const JournalRecord *x = a, *y = b;
+    if (x->id != y->id) {
+        return (x->id > y->id) - (x->id < y->id);
+    }
+    return (x->sequence > y->sequence) - (x->sequence < y->sequence);
+}
+
+static int compareLongs(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Makes a delayed queue durable with a write-ahead journal.
+ *
+ * Takes '<path>.lock' so only one shell uses the journal, replays the
+ * journal (the commands added and not yet dispatched are pending), rewrites
+ * it compacted, re-queues the pending commands under their old job IDs and
+ * starts the journal thread. Pending commands whose time passed while no
+ * shell was running are run right away if 'run_missed' is set, and are
+ * dropped with a message otherwise.
+ *
+ * @param queue The queue to journal; must not be processed yet.
+ * @param path The journal file.
+ * @param run_missed Whether missed commands are run or dropped.
+ *
+ * @return 0 on success, -1 if the journal cannot be used (the queue then
+ * stays in memory only).
+ * @see https://man7.org/linux/man-pages/man2/flock.2.html
+ */
+int openDelayedJournal(DelayedQueue *queue, const char *path, int run_missed) {
+    char lock_path[PATH_MAX];
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", path);
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lock_fd < 0) {
+        perror(lock_path);
+        return -1;
+    }
+    if (flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+        fprintf(stderr, "journal: %s is in use by another shell; delayed commands will not be journaled\n", path);
+        close(lock_fd);
+        return -1;
+    }
+
+    // Replay: pending = added minus dispatched, by job ID
+    JournalRecord *added = NULL;
+    long *done = NULL;
+    size_t added_count = 0, added_capacity = 0, done_count = 0, done_capacity = 0;
+    long max_id = 0;
+    FILE *f = fopen(path, "r");
+    char *line = NULL;
+    size_t line_size = 0;
+    while (f != NULL && getline(&line, &line_size, f) > 0) {
+        long id;
+        long long realtime;
+        int flags, offset = 0, limit;
+        char name[32];
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "A %ld %lld %d %n", &id, &realtime, &flags, &offset) == 3 && offset > 0) {
+            if (added_count == added_capacity) {
+                added_capacity = added_capacity ? added_capacity * 2 : 256;
+                added = realloc(added, added_capacity * sizeof(JournalRecord));
+            }
+            added[added_count] = (JournalRecord){id, (long)added_count, realtime, flags, 0, strdup(line + offset)};
+            added_count++;
+        } else if (sscanf(line, "R %ld %n", &id, &offset) == 1 && offset > 0) {
+            if (added_count == added_capacity) {
+                added_capacity = added_capacity ? added_capacity * 2 : 256;
+                added = realloc(added, added_capacity * sizeof(JournalRecord));
+            }
+            added[added_count] = (JournalRecord){id, (long)added_count, 0, 0, 1, strdup(line + offset)};
+            added_count++;
+        } else if (sscanf(line, "Q %31s %d", name, &limit) == 2) {
+            // Queue limits apply in journal order, so the last one wins
+            int index = findNamedQueue(&queue->ready, name, 1);
+            if (index >= 0) {
+                queue->ready.named[index].limit = limit > 0 ? limit : 0;
+            }
+            continue;
+        } else if (sscanf(line, "D %ld", &id) == 1) {
+            if (done_count == done_capacity) {
+                done_capacity = done_capacity ? done_capacity * 2 : 256;
+                done = realloc(done, done_capacity * sizeof(long));
+            }
+            done[done_count++] = id;
+        } else {
+            continue; // A torn last record from a crash
+        }
+        if (id > max_id) {
+            max_id = id;
+        }
+    }
+    free(line);
+    if (f != NULL) {
+        fclose(f);
+    }
+    qsort(added, added_count, sizeof(JournalRecord), compareJournalRecords);
+    qsort(done, done_count, sizeof(long), compareLongs);
+
+    int64_t real_now = clockNanoseconds(CLOCK_REALTIME);
+    int64_t mono_now = clockNanoseconds(CLOCK_MONOTONIC);
+    int pending = 0, missed = 0;
+    lockDelayedQueue(queue);
+    for (size_t i = 0; i < added_count; i++) {
+        JournalRecord *r = &added[i];
+        int duplicate = i + 1 < added_count && added[i + 1].id == r->id; // superseded
+        if (!duplicate && r->command != NULL && r->recurring
+            && bsearch(&r->id, done, done_count, sizeof(long), compareLongs) == NULL) {
+            // Recurring commands resume at their next firing time
+            char *words[MAX_ARGS];
+            char command[MAX_COMMAND_LENGTH];
+            char *save = NULL;
+            int count = 0;
+            DelayedJobOptions options;
+            for (char *w = strtok_r(parseJournalJobOptions(r->command, &options), " ", &save); w != NULL && count < MAX_ARGS - 1;
+                 w = strtok_r(NULL, " ", &save)) {
+                words[count++] = w;
+            }
+            words[count] = NULL;
+            RecurringSchedule schedule;
+            int consumed = count > 0 ? parseRecurringSchedule(words, &schedule) : -1;
+            if (consumed > 0 && consumed < count) {
+                command[0] = '\0';
+                for (int j = consumed; j < count; j++) {
+                    if (j > consumed) {
+                        strncat(command, " ", sizeof(command) - strlen(command) - 1);
+                    }
+                    strncat(command, words[j], sizeof(command) - strlen(command) - 1);
+                }
+                if (armRecurringCommand(queue, r->id, &schedule, command) == 0) {
+                    applyDelayedJobOptions(queue, findDelayedSlot(queue, r->id), &options);
+                    pending++;
+                }
+            }
+            if (consumed > 0) {
+                freeRecurringSchedule(&schedule);
+            }
+        } else if (!duplicate && r->command != NULL
+            && bsearch(&r->id, done, done_count, sizeof(long), compareLongs) == NULL) {
+            DelayedJobOptions options;
+            char *text = parseJournalJobOptions(r->command, &options);
+            int held = (r->flags & JOURNAL_AFTER) != 0;
+            int64_t deadline = held ? DELAYED_HELD : mono_now + (r->realtime - real_now);
+            if (!held && r->realtime <= real_now) {
+                missed++;
+                fprintf(stderr, "journal: job %ld missed its time: %s%s\n", r->id,
+                        text, run_missed ? "" : " (dropped)");
+                deadline = mono_now;
+            }
+            if (held || r->realtime > real_now || run_missed) {
+                time_t wall_time = (r->flags & JOURNAL_AT) && r->realtime > real_now
+                                   ? (time_t)(r->realtime / 1000000000) : 0;
+                int slot = insertDelayedCommand(queue, r->id, deadline, wall_time, text);
+                if (slot >= 0) {
+                    // Commands waited for that are gone finished before the restart
+                    options.batch = (r->flags & JOURNAL_BATCH) != 0;
+                    applyDelayedJobOptions(queue, slot, &options);
+                    linkDelayedCommand(queue, slot, &options);
+                    pending++;
+                }
+            }
+        }
+        free(r->command);
+    }
+    if (max_id > queue->next_id) {
+        queue->next_id = max_id;
+    }
+    unlockDelayedQueue(queue);
+    free(added);
+    free(done);
+
+    DelayedJournal *journal = calloc(1, sizeof(DelayedJournal));
+    if (journal == NULL) {
+        perror("journal");
+        close(lock_fd);
+        return -1;
+    }
+    journal->fd = -1;
+    journal->lock_fd = lock_fd;
+    journal->path = strdup(path);
+    pthread_mutex_init(&journal->mutex, NULL);
+    pthread_cond_init(&journal->cond, NULL);
+    queue->journal = journal;
+    if (compactDelayedJournal(queue) != 0) {
+        journal->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    }
+    if (journal->fd < 0 || pthread_create(&journal->thread, NULL, delayedJournalThread, queue) != 0) {
+        perror(path);
+        queue->journal = NULL;
+        close(lock_fd);
+        return -1;
+    }
+    if (pending > 0 || missed > 0) {
+        fprintf(stderr, "journal: restored %d delayed command(s) from %s\n", pending, path);
+    }
+    return 0;
+}
+
+/**
+ * @brief Flushes the journal and stops its thread. Commands still queued
+ * stay in the journal and are restored by the next shell.
+ */
+void closeDelayedJournal(DelayedQueue *queue) {
+    DelayedJournal *journal = queue->journal;
+    if (journal == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&journal->mutex);
+    journal->stopping = 1;
+    pthread_cond_signal(&journal->cond);
+    pthread_mutex_unlock(&journal->mutex);
+    pthread_join(journal->thread, NULL);
+    queue->journal = NULL;
+    close(journal->fd);
+    close(journal->lock_fd);
+    free(journal->buffer);
+    free(journal->path);
+    free(journal);
+}
+
+/**
+ * @brief Adds a recurring command to the delayed command queue.
+ *
+ * The command stays queued under one job ID: every time it fires, a copy
+ * is handed to the workers and its deadline moves to the next firing time.
+ * An 'every' schedule runs on CLOCK_MONOTONIC, keeping its phase (runs
+ * missed while the shell was busy are skipped, not bunched up); a cron
+ * schedule fires at wall-clock times. If the queue is journaled, the
+ * schedule is recorded as "R <id> <schedule> <command>".
+ *
+ * @param queue The queue to add the command to.
+ * @param schedule The compiled schedule (see 'parseRecurringSchedule').
+ * @param command The command to run.
+ *
+ * @return The job ID of the command, or -1 if it could not be queued.
+ */
+long addRecurringCommand(DelayedQueue *queue, const RecurringSchedule *schedule,
+                         const DelayedJobOptions *options, const char *command) {
+    lockDelayedQueue(queue);
+    long id = ++queue->next_id;
+    if (armRecurringCommand(queue, id, schedule, command) != 0) {
+        unlockDelayedQueue(queue);
+        fprintf(stderr, "Delayed command queue is full.\n");
+        return -1;
+    }
+    int slot = findDelayedSlot(queue, id);
+    char prefix[512];
+    applyDelayedJobOptions(queue, slot, options);
+    formatDelayedJobOptions(queue, &queue->slots[slot], prefix, sizeof(prefix));
+    pthread_cond_signal(&queue->cond);
+    unlockDelayedQueue(queue);
+    journalAppend(queue, "R %ld %s%s %s\n", id, prefix, schedule->spec, command);
+    return id;
+}
+
+/**
+ * @brief Reads the 1-minute load average from /proc/loadavg.
+ *
+ * @return 0 on success, -1 on failure.
+ * @see https://man7.org/linux/man-pages/man5/proc_loadavg.5.html
+ */
+static int readLoadAverage(double *load) {
+    FILE *f = fopen("/proc/loadavg", "r");
+    int ok = f != NULL && fscanf(f, "%lf", load) == 1;
+    if (f != NULL) {
+        fclose(f);
+    }
+    return ok ? 0 : -1;
+}
+
+/**
+ * @brief Reads the share of time some tasks stalled on 'resource' ("memory",
+ * "io" or "cpu") over the last 10 seconds, from /proc/pressure.
+ *
+ * @return 0 on success, -1 if pressure stall information is unavailable.
+ * @see https://docs.kernel.org/accounting/psi.html
+ */
+static int readPressure(const char *resource, double *avg10) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/pressure/%s", resource);
+    FILE *f = fopen(path, "r");
+    int ok = f != NULL && fscanf(f, "some avg10=%lf", avg10) == 1;
+    if (f != NULL) {
+        fclose(f);
+    }
+    return ok ? 0 : -1;
+}
+
+/**
+ * @brief Returns the load average limit of batch commands.
+ */
+static double batchLoadLimit() {
+    if (batch_policy.max_load > 0) {
+        return batch_policy.max_load;
+    }
+    cpu_set_t allowed;
+    int cpus = sched_getaffinity(0, sizeof(allowed), &allowed) == 0 ? CPU_COUNT(&allowed) : 1;
+    return 0.8 * cpus;
+}
+
+/**
+ * @brief Whether the system is idle enough for a batch command to start.
+ *
+ * The readings are cached for a second, so a burst of due batch commands
+ * does not read /proc once per command.
+ */
+static int batchGateOpen() {
+    static int64_t sampled = 0;
+    static int open = 1;
+    int64_t now = clockNanoseconds(CLOCK_MONOTONIC);
+    if (sampled != 0 && now - sampled < 1000000000) {
+        return open;
+    }
+    double load, memory = 0, io = 0;
+    open = (readLoadAverage(&load) != 0 || load < batchLoadLimit())
+           && (readPressure("memory", &memory) != 0 || memory < batch_policy.max_pressure)
+           && (readPressure("io", &io) != 0 || io < batch_policy.max_pressure);
+    sampled = now;
+    return open;
+}
+
+/**
+ * @brief Defers the earliest command, a batch command the system is too busy
+ * for, with exponential backoff; the caller must hold the queue's mutex.
+ *
+ * @return 1 if it was deferred, 0 if it has waited 'max_deferral' already
+ * and must start now.
+ */
+static int deferBatchCommand(DelayedQueue *queue, int64_t now) {
+    DelayedCommand *command = &queue->slots[queue->heap[0].slot];
+    if (command->batch_attempts == 0) {
+        command->batch_since = now;
+    }
+    if (now - command->batch_since >= (int64_t)(batch_policy.max_deferral * 1e9)) {
+        fprintf(stderr, "batch: job %ld started after waiting the maximum deferral\n", command->id);
+        return 0;
+    }
+    double backoff = batch_policy.backoff * pow(2, command->batch_attempts);
+    if (backoff > batch_policy.max_backoff) {
+        backoff = batch_policy.max_backoff;
+    }
+    command->batch_attempts++;
+    command->deadline = now + (int64_t)(backoff * 1e9);
+    if (command->wall_time != 0) {
+        command->wall_time = 0;
+        queue->wall_count--;
+    }
+    queue->heap[0].deadline = command->deadline;
+    siftDelayedDown(queue, 0);
+    return 1;
+}
+
+/**
+ * @brief Records the cancellation of commands that waited for a failed or
+ * cancelled command, in the journal and in their logs.
+ */
+static void reportCancelledCommands(DelayedQueue *queue, long predecessor, const long *cancelled, int count) {
+    char note[128];
+    for (int i = 0; i < count; i++) {
+        journalDelayedDone(queue, cancelled[i]);
+        snprintf(note, sizeof(note), "--- cancelled: job %ld, which it depends on, failed or was cancelled\n", predecessor);
+        noteJobLog(&delayed_logs, cancelled[i], note);
+    }
+}
+
+/**
+ * @brief Called by a worker when a run of job 'id' has finished with exit
+ * status 'status': releases or cancels the commands waiting for it (see
+ * 'settleDelayedCommand').
+ */
+void finishDelayedCommand(DelayedQueue *queue, long id, int status) {
+    long *cancelled = NULL;
+    int count = 0;
+    lockDelayedQueue(queue);
+    int slot = findDelayedSlot(queue, id);
+    if (slot >= 0) {
+        count = settleDelayedCommand(queue, slot, status, &cancelled);
+    }
+    unlockDelayedQueue(queue);
+    reportCancelledCommands(queue, id, cancelled, count);
+    free(cancelled);
+}
+
+#define DISPATCH_BATCH 64 // most commands handed over per lock of the queue
+
+/**
+ * @brief Cancellation cleanup handler that unlocks the delayed queue 'arg'.
+ */
+static void unlockDelayedQueueHandler(void *arg) {
+    unlockDelayedQueue(arg);
+}
+
+/**
+ * @brief Waits until at least one delayed command is due, then takes the due
+ * commands (up to DISPATCH_BATCH) out of the heap into 'due'.
+ *
+ * Recurring commands stay queued and are handed over as a copy. While
+ * wall-clock commands are queued it wakes at least once a second to notice
+ * changes to the system time. The queue's mutex is released if the thread
+ * is cancelled meanwhile; the count goes through 'due_count' rather than a
+ * local, so it survives the cleanup handler's 'setjmp'.
+ *
+ * @param queue The queue to take the commands from.
+ * @param due Receives the commands.
+ * @param due_count Receives the number of commands taken (0 if none was due
+ * after a wakeup).
+ */
+static void takeDueCommands(DelayedQueue *queue, ReadyCommand *due, int *due_count) {
+    *due_count = 0;
+    lockDelayedQueue(queue);
+    // Release the mutex if the thread is cancelled while waiting
+    pthread_cleanup_push(unlockDelayedQueueHandler, queue);
+    // If the queue is empty, wait until signaled.
+    while (queue->count == 0) {
+        waitDelayedQueue(queue, NULL);
+    }
+    if (queue->wall_count > 0) {
+        rebaseWallClockCommands(queue);
+    }
+    int64_t now = clockNanoseconds(CLOCK_MONOTONIC);
+    // Take every due command (up to a batch), so those due together are
+    // handed over in priority order
+    while (queue->count > 0 && *due_count < DISPATCH_BATCH && queue->heap[0].deadline <= now) {
+        int64_t deadline = queue->heap[0].deadline;
+        DelayedCommand *head = &queue->slots[queue->heap[0].slot];
+        ReadyCommand *job = &due[*due_count];
+        job->id = head->id;
+        job->priority = head->priority;
+        job->queue = head->queue;
+        job->recurring = head->schedule != NULL;
+        if (job->recurring) {
+            // Recurring: run a copy and keep the command queued
+            job->command = strdup(head->command);
+            rescheduleRecurringCommand(queue, now);
+        } else if (head->batch && !batchGateOpen() && deferBatchCommand(queue, now)) {
+            continue; // Too busy for a batch command: it was moved back in the heap
+        } else {
+            job->command = popDelayedCommand(queue, &job->id);
+        }
+        recordDelayedDispatch(queue, now, now - deadline);
+        if (job->command != NULL) {
+            (*due_count)++;
+        }
+    }
+    if (*due_count == 0 && queue->count > 0 && queue->heap[0].deadline > now) {
+        // Sleep until the earliest command is due or a new one arrives.
+        int64_t deadline = queue->heap[0].deadline;
+        if (queue->wall_count > 0 && deadline - now > 1000000000) {
+            deadline = now + 1000000000;
+        }
+        struct timespec ts = {deadline / 1000000000, deadline % 1000000000};
+        waitDelayedQueue(queue, &ts);
+    }
+    pthread_cleanup_pop(1);
+}
+
+/**
+ * @brief Thread function to process delayed commands.
+ *
+ * This function is executed by a separate thread. It waits on the queue's
+ * condition variable (on CLOCK_MONOTONIC) until the earliest command in the
+ * heap is due, takes the due commands (see 'takeDueCommands') and hands them
+ * to the worker pool (see 'dispatchDelayedCommands'), so the thread keeps
+ * dispatching on time however long the commands run.
+ *
+ * @param arg A pointer to the 'DelayedQueue' to process.
+ *
+ * @return A pointer to void.  Returns NULL.
+ * @see https://man7.org/linux/man-pages/man3/pthread_create.3.html
+ * @see https://man7.org/linux/man-pages/man3/pthread_mutex_lock.3.html
+ * @see https://man7.org/linux/man-pages/man3/pthread_cond_wait.3.html
+ * @see https://man7.org/linux/man-pages/man3/pthread_mutex_unlock.3.html
+ */
+void *processDelayedCommands(void *arg) {
+    DelayedQueue *queue = arg;
+    ReadyCommand due[DISPATCH_BATCH];
+    while (1) {
+        int due_count;
+        takeDueCommands(queue, due, &due_count);
+        for (int i = 0; i < due_count; i++) {
+            if (!due[i].recurring) {
+                journalDelayedDone(queue, due[i].id);
+            }
+        }
+        dispatchDelayedCommands(queue, due, due_count);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Adds a command to the delayed command queue.
+ *
+ * The command gets the next job ID and is inserted with
+ * 'insertDelayedCommand'; the processing thread is signalled so it can
+ * recompute how long to sleep. If the queue is journaled, the command is
+ * then recorded in the journal.
+ *
+ * @param queue The queue to add the command to.
+ * @param deadline When the command should run, in nanoseconds on
+ * CLOCK_MONOTONIC (see 'clockNanoseconds').
+ * @param wall_time For a command scheduled at a wall-clock time, that time
+ * (the deadline then follows changes to the system time), otherwise 0.
+ * @param options Whether the command waits for the system to be idle enough
+ * once it is due (see 'BatchPolicy'), its priority class and named queue,
+ * and the commands it waits for, in which case 'deadline' is ignored: it is
+ * due when they have finished (see 'settleDelayedCommand').
+ * @param command A pointer to a null-terminated string representing the
+ * command to be executed.
+ *
+ * @return The job ID of the command, or -1 if it could not be queued.
+ * @see https://man7.org/linux/man-pages/man3/pthread_mutex_lock.3.html
+ * @see https://man7.org/linux/man-pages/man3/pthread_mutex_unlock.3.html
+ * @see https://man7.org/linux/man-pages/man3/pthread_cond_signal.3.html
+ */
+long addDelayedCommand(DelayedQueue *queue, int64_t deadline, time_t wall_time, const DelayedJobOptions *options,
+                       const char *command) {
+    lockDelayedQueue(queue);
+    for (int k = 0; k < options->after_count; k++) {
+        if (findDelayedSlot(queue, options->after[k].id) < 0) {
+            unlockDelayedQueue(queue);
+            fprintf(stderr, "delay: job %ld is not queued or running\n", options->after[k].id);
+            return -1;
+        }
+    }
+    if (options->after_count > 0) {
+        deadline = DELAYED_HELD;
+        wall_time = 0;
+    }
+    long id = ++queue->next_id;
+    int slot = insertDelayedCommand(queue, id, deadline, wall_time, command);
+    if (slot < 0 || linkDelayedCommand(queue, slot, options) != 0) {
+        if (slot >= 0) {
+            long removed;
+            free(removeDelayedCommand(queue, queue->slots[slot].heap_index, &removed));
+        }
+        unlockDelayedQueue(queue);
+        fprintf(stderr, "Delayed command queue is full.\n");
+        return -1;
+    }
+    char prefix[512];
+    applyDelayedJobOptions(queue, slot, options);
+    formatDelayedJobOptions(queue, &queue->slots[slot], prefix, sizeof(prefix));
+    int64_t realtime = deadline == DELAYED_HELD ? DELAYED_HELD : deadline + queue->clock_offset;
+    // Signal the worker thread that a new command has been added.
+    pthread_cond_signal(&queue->cond);
+    unlockDelayedQueue(queue);
+    journalDelayedAdd(queue, id, realtime, wall_time, options->batch, prefix, command);
+    return id;
+}
+
+/**
+ * @brief Parses a wall-clock time of day, "HH:MM" or "HH:MM:SS".
+ *
+ * @return The next time (today, or tomorrow if it has passed) with that
+ * time of day, or -1 if 'str' is not a valid time.
+ * @see https://man7.org/linux/man-pages/man3/mktime.3.html
+ */
+static time_t parseTimeOfDay(const char *str) {
+    int hour, minute, second = 0;
+    char extra;
+    int n = sscanf(str, "%d:%d:%d%c", &hour, &minute, &second, &extra);
+    if ((n != 2 && n != 3) || hour < 0 || hour > 23 || minute < 0 || minute > 59
+        || second < 0 || second > 59) {
+        return -1;
+    }
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    tm.tm_hour = hour;
+    tm.tm_min = minute;
+    tm.tm_sec = second;
+    tm.tm_isdst = -1;
+    time_t at = mktime(&tm);
+    if (at <= now) {
+        tm.tm_mday++; // mktime normalizes the day and the DST change
+        tm.tm_hour = hour;
+        tm.tm_min = minute;
+        tm.tm_sec = second;
+        tm.tm_isdst = -1;
+        at = mktime(&tm);
+    }
+    return at;
+}
+
+/**
+ * @brief Parses when a delayed command should run: "<duration>" or
+ * "--at HH:MM[:SS]", at the start of 'args'.
+ *
+ * @param args The words to parse.
+ * @param name The built-in, for error messages.
+ * @param deadline Receives the deadline on CLOCK_MONOTONIC, in nanoseconds.
+ * @param wall_time Receives the wall-clock time for '--at', otherwise 0.
+ *
+ * @return The number of words used (1 or 2), or -1 if they are invalid (an
+ * error is printed).
+ */
+static int parseDelayTime(char **args, const char *name, int64_t *deadline, time_t *wall_time) {
+    *wall_time = 0;
+    if (strcmp(args[0], "--at") == 0) {
+        *wall_time = args[1] != NULL ? parseTimeOfDay(args[1]) : -1;
+        if (*wall_time < 0) {
+            fprintf(stderr, "%s: invalid time '%s'\n", name, args[1] != NULL ? args[1] : "");
+            return -1;
+        }
+        *deadline = (int64_t)*wall_time * 1000000000
+                    - (clockNanoseconds(CLOCK_REALTIME) - clockNanoseconds(CLOCK_MONOTONIC));
+        return 2;
+    }
+    double seconds;
+    if (parseDuration(args[0], &seconds) != 0 || seconds <= 0) {
+        fprintf(stderr, "%s: invalid duration '%s'\n", name, args[0]);
+        return -1;
+    }
+    *deadline = clockNanoseconds(CLOCK_MONOTONIC) + (int64_t)(seconds * 1e9);
+    return 1;
+}
+
+/**
+ * @brief Implements the 'delay' and 'batch' built-in commands.
+ *
+ * Usage:
+ * delay [options] <duration> <command>
+ * delay [options] --at HH:MM[:SS] <command>
+ * delay [options] --after ID <command>
+ * batch [options] <command>
+ *
+ * The duration is given as for 'parseDuration' ("10", "250ms", "1.5s",
+ * "5m"), and is measured on CLOCK_MONOTONIC, so it is unaffected by changes
+ * to the system time. With '--at', the command runs at the next occurrence
+ * of that local time of day, and follows changes to the system time. With
+ * '--batch' (and for 'batch', which is due right away), the command also
+ * waits for the system load to allow it (see 'BatchPolicy').
+ * '--priority high|normal|low' sets the order in which due commands start,
+ * and '--queue NAME' puts the command in a named queue whose concurrency
+ * 'delayqueue' can limit. '--after ID' (repeatable) makes the command wait,
+ * with no duration, until job ID has finished; '--after-ok ID' also cancels
+ * it if that job fails. The job ID of the command is printed, for 'delayq',
+ * 'delayrm' and 'delaymv'.
+ *
+ * @param args The arguments of the command, starting with "delay" or "batch".
+ *
+ * @return 0 on success, 1 for an invalid duration or time, 2 on a usage error.
+ */
+int delayCommand(char **args) {
+    int batch = strcmp(args[0], "batch") == 0;
+    DelayedJobOptions options;
+    int first = parseDelayedJobOptions(args + 1, args[0], JOB_OPTION_AFTER | (batch ? 0 : JOB_OPTION_BATCH),
+                                       &options);
+    if (first < 0) {
+        return 2;
+    }
+    first++;
+    int64_t deadline = clockNanoseconds(CLOCK_MONOTONIC);
+    time_t wall_time = 0;
+    if (!batch && options.after_count == 0) {
+        int at = args[first] != NULL && strcmp(args[first], "--at") == 0;
+        if (args[first] == NULL || args[first + 1] == NULL || (at && args[first + 2] == NULL)) {
+            fprintf(stderr, "Usage: delay [--batch] [--priority P] [--queue NAME] <duration> <command> | "
+                            "delay [options] --at HH:MM[:SS] <command> | "
+                            "delay [options] --after[-ok] ID <command>\n");
+            return 2;
+        }
+        int used = parseDelayTime(args + first, "delay", &deadline, &wall_time);
+        if (used < 0) {
+            return 1;
+        }
+        first += used;
+    } else if (args[first] == NULL) {
+        fprintf(stderr, "Usage: %s [options] <command>\n", args[0]);
+        return 2;
+    }
+    options.batch |= batch;
+
+    char delayed_command[MAX_COMMAND_LENGTH];
+    delayed_command[0] = '\0';
+    for (int j = first; args[j] != NULL; j++) {
+        if (j > first) {
+            strncat(delayed_command, " ", sizeof(delayed_command) - strlen(delayed_command) - 1);
+        }
+        strncat(delayed_command, args[j], sizeof(delayed_command) - strlen(delayed_command) - 1);
+    }
+    long id = addDelayedCommand(&delayed_queue, deadline, wall_time, &options, delayed_command);
+    if (id < 0) {
+        return 1;
+    }
+    printf("[Delayed] Job ID: %ld\n", id);
+    return 0;
+}
+
+/**
+ * @brief Formats a time span compactly: "250ms", "4.2s", "12m03s", "3h05m", "2d04h".
+ */
+static void formatTimeSpan(double seconds, char *buf, size_t size) {
+    long s = (long)seconds;
+    if (seconds < 1) {
+        snprintf(buf, size, "%ldms", (long)(seconds * 1000));
+    } else if (seconds < 60) {
+        snprintf(buf, size, "%.1fs", seconds);
+    } else if (seconds < 3600) {
+        snprintf(buf, size, "%ldm%02lds", s / 60, s % 60);
+    } else if (seconds < 86400) {
+        snprintf(buf, size, "%ldh%02ldm", s / 3600, s % 3600 / 60);
+    } else {
+        snprintf(buf, size, "%ldd%02ldh", s / 86400, s % 86400 / 3600);
+    }
+}
+
+/**
+ * A queued command as listed by 'delayq'.
+ */
+typedef struct {
+    long id;
+    int64_t deadline;
+    char *spec;
+    char class_name[48]; // priority, and named queue unless "default"
+    char *command;
+} DelayedListing;
+
+static int compareDelayedListings(const void *a, const void *b) {
+    const DelayedListing *x = a, *y = b;
+    if (x->deadline != y->deadline) {
+        return (x->deadline > y->deadline) - (x->deadline < y->deadline);
+    }
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+/**
+ * @brief Implements the 'delayq' built-in, which lists the delayed queue.
+ *
+ * Usage: delayq
+ *
+ * Prints the job ID, time remaining, schedule (for recurring commands) and
+ * command of every queued command, earliest first. The queue is copied
+ * under its mutex and sorted afterwards, so the scheduler is held up only
+ * for the copy.
+ *
+ * @param args The arguments of the command, starting with "delayq".
+ *
+ * @return 0 on success, 1 if out of memory.
+ */
+int delayqCommand(char **args) {
+    (void)args;
+    DelayedQueue *queue = &delayed_queue;
+    lockDelayedQueue(queue);
+    int count = queue->count;
+    DelayedListing *list = malloc((count > 0 ? count : 1) * sizeof(DelayedListing));
+    for (int i = 0; list != NULL && i < count; i++) {
+        const DelayedCommand *command = &queue->slots[queue->heap[i].slot];
+        list[i].id = command->id;
+        list[i].deadline = command->deadline;
+        const char *spec = command->schedule != NULL ? command->schedule->spec : command->batch ? "batch" : "-";
+        size_t size = strlen(spec) + 1 + command->after_count * 32; // ", after-ok <id>" each
+        list[i].spec = malloc(size);
+        if (list[i].spec != NULL) {
+            int used = snprintf(list[i].spec, size, "%s", spec);
+            used = command->after_count > 0 ? 0 : used;
+            for (int k = 0; k < command->after_count; k++) {
+                if (command->after[k].id != 0) {
+                    used += snprintf(list[i].spec + used, size - used, "%s%s %ld", used > 0 ? ", " : "",
+                                     command->after[k].on_success ? "after-ok" : "after", command->after[k].id);
+                }
+            }
+        }
+        snprintf(list[i].class_name, sizeof(list[i].class_name), "%s%s%s", priority_names[command->priority],
+                 command->queue != 0 ? "/" : "", command->queue != 0 ? queue->ready.named[command->queue].name : "");
+        list[i].command = strdup(command->command);
+    }
+    unlockDelayedQueue(queue);
+    if (list == NULL) {
+        perror("delayq");
+        return 1;
+    }
+
+    qsort(list, count, sizeof(DelayedListing), compareDelayedListings);
+    int64_t now = clockNanoseconds(CLOCK_MONOTONIC);
+    if (count > 0) {
+        printf("%-8s %-10s %-24s %-16s %s\n", "ID", "DUE IN", "SCHEDULE", "CLASS", "COMMAND");
+    }
+    for (int i = 0; i < count; i++) {
+        char due[32];
+        formatTimeSpan(list[i].deadline > now ? (list[i].deadline - now) / 1e9 : 0, due, sizeof(due));
+        if (list[i].deadline == DELAYED_HELD) {
+            snprintf(due, sizeof(due), "-");
+        }
+        printf("%-8ld %-10s %-24s %-16s %s\n", list[i].id, due, list[i].spec != NULL ? list[i].spec : "",
+               list[i].class_name, list[i].command != NULL ? list[i].command : "");
+        free(list[i].spec);
+        free(list[i].command);
+    }
+    free(list);
+    return 0;
+}
+
+/**
+ * @brief Implements the 'delayrm' built-in, which cancels delayed commands.
+ *
+ * Usage: delayrm <id>...
+ *
+ * Each command is found through the queue's job ID index and removed from
+ * the heap in O(log n). Recurring commands are cancelled altogether, and so
+ * are the commands waiting for a cancelled one ('delay --after').
+ *
+ * @param args The arguments of the command, starting with "delayrm".
+ *
+ * @return 0 if every job was cancelled, 1 if some job ID was not queued, 2
+ * on a usage error.
+ */
+int delayrmCommand(char **args) {
+    if (args[1] == NULL) {
+        fprintf(stderr, "Usage: delayrm <id>...\n");
+        return 2;
+    }
+    int status = 0;
+    for (int j = 1; args[j] != NULL; j++) {
+        long id = atol(args[j]);
+        long *cancelled = NULL;
+        int count = 0;
+        lockDelayedQueue(&delayed_queue);
+        int slot = id > 0 ? findDelayedSlot(&delayed_queue, id) : -1;
+        int queued = slot >= 0 && delayed_queue.slots[slot].heap_index >= 0;
+        if (queued) {
+            unheapDelayedCommand(&delayed_queue, delayed_queue.slots[slot].heap_index);
+            count = settleDelayedCommand(&delayed_queue, slot, -1, &cancelled);
+            pthread_cond_signal(&delayed_queue.cond); // The earliest deadline may have changed
+        }
+        unlockDelayedQueue(&delayed_queue);
+        if (!queued) {
+            fprintf(stderr, "delayrm: %s: %s\n", args[j], slot >= 0 ? "already running" : "no such job");
+            status = 1;
+            continue;
+        }
+        journalDelayedDone(&delayed_queue, id);
+        reportCancelledCommands(&delayed_queue, id, cancelled, count);
+        free(cancelled);
+    }
+    return status;
+}
+
+/**
+ * @brief Implements the 'delaymv' built-in, which reschedules a delayed command.
+ *
+ * Usage: delaymv <id> <duration> | delaymv <id> --at HH:MM[:SS]
+ *
+ * The new time is relative to now, as for 'delay'. The command keeps its
+ * job ID and is moved within the heap in O(log n). For a recurring command,
+ * only its next run moves.
+ *
+ * @param args The arguments of the command, starting with "delaymv".
+ *
+ * @return 0 on success, 1 if the job ID is not queued or the time is
+ * invalid, 2 on a usage error.
+ */
+int delaymvCommand(char **args) {
+    if (args[1] == NULL || args[2] == NULL) {
+        fprintf(stderr, "Usage: delaymv <id> <duration> | delaymv <id> --at HH:MM[:SS]\n");
+        return 2;
+    }
+    int64_t deadline;
+    time_t wall_time;
+    if (parseDelayTime(args + 2, "delaymv", &deadline, &wall_time) < 0) {
+        return 1;
+    }
+
+    DelayedQueue *queue = &delayed_queue;
+    long id = atol(args[1]);
+    lockDelayedQueue(queue);
+    int slot = id > 0 ? findDelayedSlot(queue, id) : -1;
+    if (slot < 0 || queue->slots[slot].heap_index < 0 || queue->slots[slot].waiting > 0) {
+        unlockDelayedQueue(queue);
+        fprintf(stderr, "delaymv: %s: %s\n", args[1], slot < 0 ? "no such job"
+                : queue->slots[slot].heap_index < 0 ? "already running" : "waits for other jobs");
+        return 1;
+    }
+    DelayedCommand *command = &queue->slots[slot];
+    int recurring = command->schedule != NULL;
+    if (recurring && command->schedule->interval > 0) {
+        wall_time = 0; // 'every' runs on the monotonic clock
+    } else if (recurring && wall_time == 0) {
+        wall_time = (time_t)((deadline + queue->clock_offset) / 1000000000); // cron stays on wall-clock time
+    }
+    queue->wall_count += (wall_time != 0) - (command->wall_time != 0);
+    command->wall_time = wall_time;
+    command->deadline = deadline;
+    queue->heap[command->heap_index].deadline = deadline;
+    siftDelayedUp(queue, command->heap_index);
+    siftDelayedDown(queue, command->heap_index);
+    int64_t offset = queue->clock_offset;
+    char *text = recurring ? NULL : strdup(command->command);
+    int batch = command->batch;
+    char prefix[512];
+    formatDelayedJobOptions(queue, command, prefix, sizeof(prefix));
+    pthread_cond_signal(&queue->cond);
+    unlockDelayedQueue(queue);
+    if (text != NULL) {
+        journalDelayedAdd(queue, id, deadline + offset, wall_time, batch, prefix, text); // Supersedes the old record
+        free(text);
+    }
+    return 0;
+}
+
+/**
+ * @brief Implements the 'batchload' built-in command.
+ *
+ * Usage: batchload [--load N] [--pressure PCT] [--backoff DUR]
+ * [--max-backoff DUR] [--max-defer DUR]
+ *
+ * Sets when batch commands may start (see 'BatchPolicy'), then prints the
+ * limits next to the current readings. '--load 0' restores the default of
+ * 0.8 per CPU.
+ *
+ * @param args The arguments of the command, starting with "batchload".
+ *
+ * @return 0 on success, 2 on a usage error.
+ */
+int batchloadCommand(char **args) {
+    BatchPolicy policy = batch_policy;
+    for (int j = 1; args[j] != NULL; j += 2) {
+        double value;
+        char *end;
+        int ok = args[j + 1] != NULL;
+        if (ok && strcmp(args[j], "--load") == 0) {
+            value = strtod(args[j + 1], &end);
+            ok = end != args[j + 1] && *end == '\0' && isfinite(value) && value >= 0;
+            policy.max_load = value;
+        } else if (ok && strcmp(args[j], "--pressure") == 0) {
+            value = strtod(args[j + 1], &end);
+            ok = end != args[j + 1] && *end == '\0' && value > 0 && value <= 100;
+            policy.max_pressure = value;
+        } else if (ok && strcmp(args[j], "--backoff") == 0) {
+            ok = parseDuration(args[j + 1], &policy.backoff) == 0 && policy.backoff > 0;
+        } else if (ok && strcmp(args[j], "--max-backoff") == 0) {
+            ok = parseDuration(args[j + 1], &policy.max_backoff) == 0 && policy.max_backoff > 0;
+        } else if (ok && strcmp(args[j], "--max-defer") == 0) {
+            ok = parseDuration(args[j + 1], &policy.max_deferral) == 0;
+        } else {
+            ok = 0;
+        }
+        if (!ok) {
+            fprintf(stderr, "Usage: batchload [--load N] [--pressure PCT] [--backoff DUR] "
+                            "[--max-backoff DUR] [--max-defer DUR]\n");
+            return 2;
+        }
+    }
+    batch_policy = policy;
+
+    double load = 0, memory = 0, io = 0;
+    int have_load = readLoadAverage(&load) == 0;
+    int have_memory = readPressure("memory", &memory) == 0;
+    int have_io = readPressure("io", &io) == 0;
+    printf("load average:    %6.2f (limit %.2f)\n", have_load ? load : 0, batchLoadLimit());
+    if (have_memory && have_io) {
+        printf("memory pressure: %6.2f%% (limit %.2f%%)\n", memory, policy.max_pressure);
+        printf("I/O pressure:    %6.2f%% (limit %.2f%%)\n", io, policy.max_pressure);
+    } else {
+        printf("pressure:        unavailable\n");
+    }
+    printf("backoff %gs up to %gs, started anyway after %gs\n", policy.backoff, policy.max_backoff,
+           policy.max_deferral);
+    return 0;
+}
+
+/**
+ * @brief Formats a duration in nanoseconds with a unit suited to its size.
+ */
+static void formatNanoseconds(int64_t ns, char *buf, size_t size) {
+    if (ns < 1000) {
+        snprintf(buf, size, "%ldns", (long)ns);
+    } else if (ns < 1000000) {
+        snprintf(buf, size, "%.1fus", ns / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(buf, size, "%.2fms", ns / 1e6);
+    } else {
+        snprintf(buf, size, "%.2fs", ns / 1e9);
+    }
+}
+
+/**
+ * @brief Prints one row of the 'delaystats' latency table.
+ */
+void printLatencyRow(const char *name, const LatencyHistogram *histogram) {
+    char mean[32], p50[32], p90[32], p99[32], max[32]; // room for any int64_t
+    formatNanoseconds(histogram->count > 0 ? histogram->sum / histogram->count : 0, mean, sizeof(mean));
+    formatNanoseconds(latencyPercentile(histogram, 50), p50, sizeof(p50));
+    formatNanoseconds(latencyPercentile(histogram, 90), p90, sizeof(p90));
+    formatNanoseconds(latencyPercentile(histogram, 99), p99, sizeof(p99));
+    formatNanoseconds(histogram->max, max, sizeof(max));
+    printf("%-16s %9ld %9s %9s %9s %9s %9s\n", name, histogram->count, mean, p50, p90, p99, max);
+}
+
+/**
+ * @brief Sums the commands dispatched in the last 'window' seconds (up to 60)
+ * before second 'now' of the metrics.
+ */
+static long recentDispatches(const DelayedMetrics *metrics, int64_t now, int window) {
+    long total = 0;
+    for (int64_t s = now; s > now - window && s >= 0; s--) {
+        if (s <= metrics->last_second && s > metrics->last_second - 60) {
+            total += metrics->per_second[s % 60];
+        }
+    }
+    return total;
+}
+
+/**
+ * @brief Implements the 'delaystats' built-in command.
+ *
+ * Usage: delaystats [reset]
+ *
+ * Prints how well the delayed command scheduler keeps up: the commands
+ * queued and dispatched and the rate of dispatch, the high-water marks of
+ * the queue and of the list of due commands waiting for a worker, how often
+ * the scheduler thread woke up, and the distribution of
+ * - lateness: from a command's deadline until it was dispatched,
+ * - dispatch->start: from then until a worker started it,
+ * - lock wait and lock hold: time spent waiting for (when contended) and
+ * holding the queue's mutex.
+ * 'reset' clears the statistics.
+ *
+ * @param args The arguments of the command, starting with "delaystats".
+ *
+ * @return 0 on success, 2 on a usage error.
+ */
+int delaystatsCommand(char **args) {
+    DelayedQueue *queue = &delayed_queue;
+    int reset = args[1] != NULL && strcmp(args[1], "reset") == 0;
+    if ((args[1] != NULL && !reset) || (reset && args[2] != NULL)) {
+        fprintf(stderr, "Usage: delaystats [reset]\n");
+        return 2;
+    }
+
+    DelayedMetrics metrics;
+    lockDelayedQueue(queue);
+    pthread_mutex_lock(&queue->ready.mutex);
+    int64_t now = clockNanoseconds(CLOCK_MONOTONIC);
+    if (reset) {
+        int64_t locked_at = queue->metrics.locked_at;
+        memset(&queue->metrics, 0, sizeof(queue->metrics));
+        queue->metrics.since = now;
+        queue->metrics.locked_at = locked_at;
+    } else {
+        metrics = queue->metrics;
+    }
+    int depth = queue->count;
+    int ready = queue->ready.count;
+    pthread_mutex_unlock(&queue->ready.mutex);
+    unlockDelayedQueue(queue);
+    if (reset) {
+        return 0;
+    }
+
+    double elapsed = (now - metrics.since) / 1e9;
+    int64_t second = (now - metrics.since) / 1000000000;
+    double window10 = elapsed < 10 ? elapsed : 10, window60 = elapsed < 60 ? elapsed : 60;
+    printf("over the last %.1fs: %ld queued, %ld dispatched, %d pending, %d waiting for a worker\n",
+           elapsed, metrics.inserted, metrics.dispatched, depth, ready);
+    printf("dispatched/s: %.2f overall, %.2f last 10s, %.2f last 60s\n",
+           elapsed > 0 ? metrics.dispatched / elapsed : 0,
+           window10 > 0 ? recentDispatches(&metrics, second, 10) / window10 : 0,
+           window60 > 0 ? recentDispatches(&metrics, second, 60) / window60 : 0);
+    printf("high-water: %d queued, %d waiting for a worker\n", metrics.max_depth, metrics.max_ready);
+    printf("scheduler wakeups: %ld, contended locks: %ld\n", metrics.wakeups, metrics.contended);
+    printf("%-16s %9s %9s %9s %9s %9s %9s\n", "", "count", "mean", "p50", "p90", "p99", "max");
+    printLatencyRow("lateness", &metrics.lateness);
+    printLatencyRow("dispatch->start", &metrics.start_delay);
+    printLatencyRow("lock wait", &metrics.lock_wait);
+    printLatencyRow("lock hold", &metrics.lock_hold);
+    return 0;
+}
+
+#define BENCH_RANDOM 0      // deadlines spread uniformly over the span
+#define BENCH_CLUSTERED 1   // bunched around a few instants, as with 'every'
+#define BENCH_INCREASING 2  // in insertion order, as with a steady stream of 'delay'
+#define BENCH_PATTERNS 3
+#define BENCH_CLUSTERS 16
+
+static const char *const bench_pattern_names[BENCH_PATTERNS] = {"random", "clustered", "increasing"};
+
+/**
+ * One producer thread of 'delaybench': it inserts timers 'first' to
+ * 'first + count - 1' of 'total'.
+ */
+typedef struct {
+    DelayedQueue *queue;
+    int pattern;
+    long first;
+    long count;
+    long total;
+    int64_t start;   // the earliest deadline, on CLOCK_MONOTONIC
+    int64_t spread;  // the span of the deadlines
+    unsigned int seed;
+} DelayBenchProducer;
+
+/**
+ * Executions counted by the stub that replaces 'executeDelayedCommand' in
+ * the queues of 'delaybench'.
+ */
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    long executed;
+    long target;       // 'cond' is signalled when 'executed' reaches it
+    int64_t first;     // CLOCK_MONOTONIC times of the first and last execution
+    int64_t last;
+} delay_bench = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, 0};
+
+/**
+ * @brief Stands in for 'executeDelayedCommand' in 'delaybench': counts the
+ * command instead of running it.
+ */
+static int delayBenchExecute(long id, char *command) {
+    (void)id;
+    (void)command;
+    int64_t now = clockNanoseconds(CLOCK_MONOTONIC);
+    pthread_mutex_lock(&delay_bench.mutex);
+    if (delay_bench.executed++ == 0) {
+        delay_bench.first = now;
+    }
+    delay_bench.last = now;
+    if (delay_bench.executed == delay_bench.target) {
+        pthread_cond_signal(&delay_bench.cond);
+    }
+    pthread_mutex_unlock(&delay_bench.mutex);
+    return 0;
+}
+
+/**
+ * @brief Thread function of a 'delaybench' producer: inserts its timers
+ * through 'addDelayedCommand'.
+ *
+ * @param arg A pointer to its 'DelayBenchProducer'.
+ *
+ * @return A pointer to void.  Returns NULL.
+ * @see https://man7.org/linux/man-pages/man3/rand_r.3.html
+ */
+static void *delayBenchProducer(void *arg) {
+    DelayBenchProducer *producer = arg;
+    DelayedJobOptions options;
+    memset(&options, 0, sizeof(options));
+    options.priority = PRIORITY_NORMAL;
+    for (long i = producer->first; i < producer->first + producer->count; i++) {
+        int64_t offset;
+        if (producer->pattern == BENCH_INCREASING) {
+            offset = (int64_t)((double)producer->spread * i / producer->total);
+        } else if (producer->pattern == BENCH_CLUSTERED) {
+            // Within a millisecond of one of the cluster instants
+            int cluster = rand_r(&producer->seed) % BENCH_CLUSTERS;
+            offset = producer->spread * cluster / BENCH_CLUSTERS + rand_r(&producer->seed) % 1000000;
+        } else {
+            offset = (int64_t)(producer->spread * (rand_r(&producer->seed) / (RAND_MAX + 1.0)));
+        }
+        if (addDelayedCommand(producer->queue, producer->start + offset, 0, &options, "true") < 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Runs one 'delaybench' measurement on a private queue and prints
+ * its results.
+ *
+ * The queue gets its own scheduler thread and worker pool, exactly as the
+ * shell's queue does, but its workers count commands with
+ * 'delayBenchExecute' instead of running them. The timers are inserted by
+ * 'producers' threads at once; the first is due when they start, the last
+ * 'spread' nanoseconds later.
+ *
+ * @return 0 on success, 1 if the threads could not be started.
+ * @see https://man7.org/linux/man-pages/man3/pthread_cancel.3.html
+ */
+static int runDelayBench(int pattern, long timers, int producers, int workers, int64_t spread) {
+    DelayedQueue *queue = malloc(sizeof(DelayedQueue));
+    DelayBenchProducer *threads = calloc(producers, sizeof(DelayBenchProducer));
+    pthread_t *ids = calloc(producers, sizeof(pthread_t));
+    pthread_t scheduler;
+    if (queue == NULL || threads == NULL || ids == NULL) {
+        perror("malloc");
+        free(queue);
+        free(threads);
+        free(ids);
+        return 1;
+    }
+    initDelayedQueue(queue);
+    queue->execute = delayBenchExecute;
+    pthread_mutex_lock(&delay_bench.mutex);
+    delay_bench.executed = 0;
+    delay_bench.target = timers;
+    pthread_mutex_unlock(&delay_bench.mutex);
+
+    int status = 0;
+    if (setDelayedWorkers(queue, workers) != 0
+        || pthread_create(&scheduler, NULL, processDelayedCommands, queue) != 0) {
+        perror("delaybench");
+        setDelayedWorkers(queue, 0);
+        status = 1;
+    }
+    int started = 0;
+    int64_t start = clockNanoseconds(CLOCK_MONOTONIC);
+    for (int p = 0; status == 0 && p < producers; p++) {
+        threads[p].queue = queue;
+        threads[p].pattern = pattern;
+        threads[p].first = timers * p / producers;
+        threads[p].count = timers * (p + 1) / producers - threads[p].first;
+        threads[p].total = timers;
+        threads[p].start = start;
+        threads[p].spread = spread;
+        threads[p].seed = (unsigned int)(start + p);
+        if (pthread_create(&ids[p], NULL, delayBenchProducer, &threads[p]) != 0) {
+            perror("pthread_create");
+            break;
+        }
+        started++;
+    }
+    for (int p = 0; p < started; p++) {
+        pthread_join(ids[p], NULL);
+    }
+    int64_t inserted_at = clockNanoseconds(CLOCK_MONOTONIC);
+
+    if (status == 0) {
+        // Wait for everything inserted to have been executed
+        lockDelayedQueue(queue);
+        long inserted = queue->metrics.inserted;
+        unlockDelayedQueue(queue);
+        pthread_mutex_lock(&delay_bench.mutex);
+        delay_bench.target = inserted;
+        while (delay_bench.executed < inserted) {
+            pthread_cond_wait(&delay_bench.cond, &delay_bench.mutex);
+        }
+        pthread_mutex_unlock(&delay_bench.mutex);
+        pthread_cancel(scheduler);
+        pthread_join(scheduler, NULL);
+        setDelayedWorkers(queue, 0);
+    }
+    // Surplus workers exit once idle; wait for them before freeing the queue
+    struct timespec pause = {0, 1000000};
+    pthread_mutex_lock(&queue->ready.mutex);
+    while (queue->ready.worker_count > 0) {
+        pthread_mutex_unlock(&queue->ready.mutex);
+        nanosleep(&pause, NULL);
+        pthread_mutex_lock(&queue->ready.mutex);
+    }
+    pthread_mutex_unlock(&queue->ready.mutex);
+
+    if (status == 0) {
+        const DelayedMetrics *metrics = &queue->metrics;
+        double insert_time = (inserted_at - start) / 1e9;
+        double execute_time = (delay_bench.last - delay_bench.first) / 1e9;
+        printf("%s: %ld timers from %d producer(s), %d worker(s), spread %.3gs\n",
+               bench_pattern_names[pattern], metrics->inserted, producers, workers, spread / 1e9);
+        printf("insert: %.0f/s (%.3fs), pop: %.0f/s, all executed after %.3fs\n",
+               insert_time > 0 ? metrics->inserted / insert_time : 0, insert_time,
+               execute_time > 0 ? metrics->dispatched / execute_time : 0, (delay_bench.last - start) / 1e9);
+        printf("scheduler wakeups: %ld, contended locks: %ld of %ld, high-water %d queued, %d ready\n",
+               metrics->wakeups, metrics->contended, metrics->lock_hold.count, metrics->max_depth,
+               metrics->max_ready);
+        printf("%-16s %9s %9s %9s %9s %9s %9s\n", "", "count", "mean", "p50", "p90", "p99", "max");
+        printLatencyRow("lateness", &metrics->lateness);
+        printLatencyRow("dispatch->start", &metrics->start_delay);
+        printLatencyRow("lock wait", &metrics->lock_wait);
+        printLatencyRow("lock hold", &metrics->lock_hold);
+    }
+
+    free(queue->heap);
+    free(queue->slots);
+    free(queue->index);
+    pthread_mutex_destroy(&queue->mutex);
+    pthread_cond_destroy(&queue->cond);
+    pthread_mutex_destroy(&queue->ready.mutex);
+    pthread_cond_destroy(&queue->ready.cond);
+    free(queue);
+    free(threads);
+    free(ids);
+    return status;
+}
+
+/**
+ * @brief Implements the 'delaybench' built-in, a stress benchmark of the
+ * delayed command scheduler.
+ *
+ * Usage: delaybench [-n timers] [-p producers] [-w workers] [-s spread]
+ * [random|clustered|increasing...]
+ *
+ * For each deadline pattern (default: all three), inserts 'timers' commands
+ * (default 100000) into a fresh queue with 'addDelayedCommand', first from
+ * one producer thread and then from 'producers' (default 4) at once, while
+ * the queue's scheduler thread dispatches them to 'workers' workers
+ * (default 4) that count rather than run them. The deadlines span 'spread'
+ * (a duration as for 'parseDuration', default 1s); with 0 they are all due
+ * at once, so the pop rate is what the scheduler can sustain. Prints the
+ * insert and pop rates, the scheduler's wakeups, how often the queue's
+ * mutex was contended, and the latency table of 'delaystats'. The shell's
+ * own queue is not touched.
+ *
+ * @param args The arguments of the command, starting with "delaybench".
+ *
+ * @return 0 on success, 1 if a run failed, 2 on a usage error.
+ */
+int delaybenchCommand(char **args) {
+    long timers = 100000;
+    int producers = 4, workers = 4;
+    double spread = 1;
+    int patterns[BENCH_PATTERNS], pattern_count = 0;
+    int j = 1;
+    for (; args[j] != NULL && args[j][0] == '-' && args[j + 1] != NULL; j += 2) {
+        if (strcmp(args[j], "-n") == 0) {
+            timers = atol(args[j + 1]);
+        } else if (strcmp(args[j], "-p") == 0) {
+            producers = atoi(args[j + 1]);
+        } else if (strcmp(args[j], "-w") == 0) {
+            workers = atoi(args[j + 1]);
+        } else if (strcmp(args[j], "-s") != 0 || parseDuration(args[j + 1], &spread) != 0) {
+            break;
+        }
+    }
+    for (; args[j] != NULL && pattern_count < BENCH_PATTERNS; j++) {
+        int p = 0;
+        while (p < BENCH_PATTERNS && strcmp(args[j], bench_pattern_names[p]) != 0) {
+            p++;
+        }
+        if (p == BENCH_PATTERNS) {
+            break;
+        }
+        patterns[pattern_count++] = p;
+    }
+    if (args[j] != NULL || timers <= 0 || timers > INT_MAX / 2 || producers <= 0 || producers > 256
+        || workers <= 0 || spread < 0) {
+        fprintf(stderr, "Usage: delaybench [-n timers] [-p producers] [-w workers] [-s spread] "
+                        "[random|clustered|increasing...]\n");
+        return 2;
+    }
+    if (pattern_count == 0) {
+        for (int p = 0; p < BENCH_PATTERNS; p++) {
+            patterns[pattern_count++] = p;
+        }
+    }
+
+    int producer_counts[2] = {1, producers};
+    for (int i = 0; i < pattern_count; i++) {
+        for (int k = 0; k < (producers > 1 ? 2 : 1); k++) {
+            if (i > 0 || k > 0) {
+                printf("\n");
+            }
+            if (runDelayBench(patterns[i], timers, producer_counts[k], workers, (int64_t)(spread * 1e9)) != 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Implements the 'delayqueue' built-in command.
+ *
+ * Usage: delayqueue [name [limit]]
+ *
+ * Without arguments, lists the named queues of delayed commands with their
+ * concurrency limit, the number of their commands running and the number
+ * due but waiting. With a name, creates that queue if needed and, given a
+ * limit, lets at most that many of its commands run at once (0 for no
+ * limit). Queues and their limits are kept in the journal, if there is one,
+ * like the commands.
+ *
+ * @param args The arguments of the command, starting with "delayqueue".
+ *
+ * @return 0 on success, 1 if the queue could not be created, 2 on a usage
+ * error.
+ */
+int delayqueueCommand(char **args) {
+    ReadyQueue *ready = &delayed_queue.ready;
+    char *end = NULL;
+    long limit = args[1] != NULL && args[2] != NULL ? strtol(args[2], &end, 10) : 0;
+    if ((end != NULL && (*end != '\0' || limit < 0)) || (args[1] != NULL && args[2] != NULL && args[3] != NULL)) {
+        fprintf(stderr, "Usage: delayqueue [name [limit]]\n");
+        return 2;
+    }
+    if (args[1] != NULL) {
+        int index = findNamedQueue(ready, args[1], 1);
+        if (index < 0) {
+            fprintf(stderr, "delayqueue: %s: too many queues, or the name is too long\n", args[1]);
+            return 1;
+        }
+        pthread_mutex_lock(&ready->mutex);
+        if (args[2] != NULL) {
+            ready->named[index].limit = (int)limit;
+            pthread_cond_broadcast(&ready->cond); // Waiting commands may start now
+        }
+        int current = ready->named[index].limit;
+        pthread_mutex_unlock(&ready->mutex);
+        journalQueueLimit(&delayed_queue, args[1], current);
+        return 0;
+    }
+
+    printf("%-16s %6s %8s %8s\n", "QUEUE", "LIMIT", "RUNNING", "WAITING");
+    pthread_mutex_lock(&ready->mutex);
+    for (int q = 0; q < ready->named_count; q++) {
+        const NamedQueue *named = &ready->named[q];
+        int waiting = 0;
+        for (int priority = 0; priority < PRIORITY_CLASSES; priority++) {
+            for (const ReadyCommand *job = named->head[priority]; job != NULL; job = job->next) {
+                waiting++;
+            }
+        }
+        char limit_text[16];
+        snprintf(limit_text, sizeof(limit_text), named->limit > 0 ? "%d" : "-", named->limit);
+        printf("%-16s %6s %8d %8d\n", named->name, limit_text, named->running, waiting);
+    }
+    pthread_mutex_unlock(&ready->mutex);
+    return 0;
+}
+
+/**
+ * @brief Implements the 'delayworkers' built-in command.
+ *
+ * Usage: delayworkers [count]
+ *
+ * Without an argument, shows the size of the pool of workers that execute
+ * due delayed commands, how many are busy and how many commands wait for
+ * one. With a count, resizes the pool (the initial size comes from
+ * 'NORSEISH_DELAY_WORKERS', default 4).
+ *
+ * @param args The arguments of the command, starting with "delayworkers".
+ *
+ * @return 0 on success, 1 on failure, 2 on a usage error.
+ */
+int delayworkersCommand(char **args) {
+    ReadyQueue *ready = &delayed_queue.ready;
+    if (args[1] == NULL) {
+        pthread_mutex_lock(&ready->mutex);
+        printf("delayed workers: %d (%d busy), %d due command(s) waiting\n",
+               ready->worker_target, ready->busy, ready->count);
+        pthread_mutex_unlock(&ready->mutex);
+        return 0;
+    }
+    int count = atoi(args[1]);
+    if (count <= 0 || args[2] != NULL) {
+        fprintf(stderr, "Usage: delayworkers [count]\n");
+        return 2;
+    }
+    return setDelayedWorkers(&delayed_queue, count) == 0 ? 0 : 1;
+}
+
+/**
+ * @brief Builds the path of a job's log; 'generation' 0 is the current file,
+ * 1 and up are the rotated ones, newest first.
+ *
+ * @return 0 on success, -1 with errno set to ENAMETOOLONG if the path does
+ * not fit in 'size' bytes.
+ */
+static int jobLogPath(const DelayedLogs *logs, long id, int generation, char *path, size_t size) {
+    int length;
+    if (generation == 0) {
+        length = snprintf(path, size, "%s/job-%ld.log", logs->dir, id);
+    } else {
+        length = snprintf(path, size, "%s/job-%ld.log.%d", logs->dir, id, generation);
+    }
+    if (length < 0 || (size_t)length >= size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Opens the current log of a job for appending.
+ *
+ * @param size Receives the size of the file.
+ *
+ * @return The descriptor, or -1 on failure.
+ */
+static int openJobLogFile(const DelayedLogs *logs, long id, off_t *size) {
+    char path[PATH_MAX];
+    struct stat st;
+    if (jobLogPath(logs, id, 0, path, sizeof(path)) != 0) {
+        *size = 0;
+        return -1;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    *size = fd >= 0 && fstat(fd, &st) == 0 ? st.st_size : 0;
+    return fd;
+}
+
+/**
+ * @brief Rotates a job's log: '.log.N-1' becomes '.log.N' and so on down to
+ * the current file, dropping the oldest, and every stream of the job is
+ * switched to a new, empty file. The caller must hold the logs' mutex.
+ *
+ * @see https://man7.org/linux/man-pages/man2/rename.2.html
+ */
+static void rotateJobLog(DelayedLogs *logs, long id) {
+    char from[PATH_MAX], to[PATH_MAX];
+    if (logs->keep == 0 && jobLogPath(logs, id, 0, from, sizeof(from)) == 0) {
+        unlink(from);
+    }
+    for (int k = logs->keep; k >= 1; k--) {
+        if (jobLogPath(logs, id, k - 1, from, sizeof(from)) == 0 && jobLogPath(logs, id, k, to, sizeof(to)) == 0) {
+            rename(from, to);
+        }
+    }
+    for (int i = 0; i < logs->count; i++) {
+        LogStream *stream = &logs->streams[i];
+        if (stream->id == id) {
+            close(stream->log_fd);
+            stream->log_fd = openJobLogFile(logs, id, &stream->size);
+        }
+    }
+}
+
+/**
+ * @brief Appends a line about a job that did not run to its log.
+ */
+void noteJobLog(DelayedLogs *logs, long id, const char *note) {
+    if (logs->dir[0] == '\0') {
+        fputs(note, stderr);
+        return;
+    }
+    off_t size;
+    pthread_mutex_lock(&logs->mutex);
+    int fd = openJobLogFile(logs, id, &size);
+    pthread_mutex_unlock(&logs->mutex);
+    if (fd >= 0) {
+        writeAll(fd, note, strlen(note));
+        close(fd);
+    }
+}
+
+/**
+ * @brief Thread function copying the output of running delayed commands into
+ * their logs.
+ *
+ * Polls the read end of every stream's pipe, plus 'wake_fd' which announces
+ * new streams. A stream is closed once every process holding its write end
+ * has exited. Streams are only ever appended by other threads, so the first
+ * 'count' of them still match the polled descriptors after 'poll' returns.
+ *
+ * @param arg A pointer to the 'DelayedLogs'.
+ *
+ * @return A pointer to void.  Returns NULL.
+ * @see https://man7.org/linux/man-pages/man2/poll.2.html
+ */
+static void *delayedLogThread(void *arg) {
+    DelayedLogs *logs = arg;
+    struct pollfd *fds = NULL;
+    int fds_capacity = 0;
+    static char buffer[65536];
+    while (1) {
+        pthread_mutex_lock(&logs->mutex);
+        int count = logs->count;
+        if (count + 1 > fds_capacity) {
+            struct pollfd *grown = realloc(fds, (count + 1) * 2 * sizeof(struct pollfd));
+            if (grown != NULL) {
+                fds = grown;
+                fds_capacity = (count + 1) * 2;
+            } else {
+                // Out of memory: serve the streams that fit, the others wait their turn
+                count = fds_capacity - 1;
+            }
+        }
+        if (count < 0) {
+            pthread_mutex_unlock(&logs->mutex);
+            struct timespec pause = {0, 10000000};
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        fds[0] = (struct pollfd){logs->wake_fd[0], POLLIN, 0};
+        for (int i = 0; i < count; i++) {
+            fds[i + 1] = (struct pollfd){logs->streams[i].pipe_fd, POLLIN, 0};
+        }
+        pthread_mutex_unlock(&logs->mutex);
+
+        if (poll(fds, count + 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        if (fds[0].revents != 0) {
+            read(logs->wake_fd[0], buffer, sizeof(buffer));
+        }
+        pthread_mutex_lock(&logs->mutex);
+        // Back to front, so removing a stream does not move unvisited ones
+        for (int i = count - 1; i >= 0; i--) {
+            if (fds[i + 1].revents == 0) {
+                continue;
+            }
+            LogStream *stream = &logs->streams[i];
+            ssize_t n = read(stream->pipe_fd, buffer, sizeof(buffer));
+            if (n > 0) {
+                if (stream->size > 0 && stream->size + n > logs->max_size) {
+                    rotateJobLog(logs, stream->id);
+                }
+                if (stream->log_fd >= 0 && writeAll(stream->log_fd, buffer, n) == 0) {
+                    stream->size += n;
+                }
+            } else if (n == 0 || errno != EINTR) {
+                close(stream->pipe_fd);
+                if (stream->log_fd >= 0) {
+                    close(stream->log_fd);
+                }
+                memmove(stream, stream + 1, (logs->count - i - 1) * sizeof(LogStream));
+                logs->count--;
+            }
+        }
+        pthread_mutex_unlock(&logs->mutex);
+    }
+    free(fds);
+    return NULL;
+}
+
+/**
+ * @brief Creates a directory and any missing parents, like 'mkdir -p'.
+ *
+ * @return 0 on success, -1 on failure.
+ * @see https://man7.org/linux/man-pages/man2/mkdir.2.html
+ */
+static int makeDirectories(const char *path) {
+    char partial[PATH_MAX];
+    snprintf(partial, sizeof(partial), "%s", path);
+    for (char *p = partial + 1; ; p++) {
+        if (*p == '/' || *p == '\0') {
+            char saved = *p;
+            *p = '\0';
+            if (mkdir(partial, 0700) != 0 && errno != EEXIST) {
+                return -1;
+            }
+            *p = saved;
+            if (saved == '\0') {
+                return 0;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Starts capturing the output of delayed commands into per-job logs.
+ *
+ * The directory is 'NORSEISH_DELAY_LOGS' if set (empty to leave output on
+ * the terminal), and '$XDG_STATE_HOME/norseish/jobs' or
+ * '~/.local/state/norseish/jobs' otherwise. On failure a warning is printed
+ * and delayed commands keep writing to the terminal.
+ *
+ * Each shell keeps its logs in a subdirectory of its own, so shells never
+ * write to or remove each other's logs. A shell with a journal uses
+ * 'journal-<hash of the journal's path>', which a later shell with the same
+ * journal (only one at a time holds its lock) picks up again; logs left
+ * there for job IDs above 'last_id' are removed, since those IDs will be
+ * given to new jobs. Any other shell uses a new 'shell-<time>-<pid>'.
+ *
+ * @param logs The logs to set up.
+ * @param journal_path The path of the shell's journal, or NULL if it has none.
+ * @param last_id The highest job ID in use (restored from the journal).
+ *
+ * @return 0 on success, -1 if output is not captured.
+ * @see https://man7.org/linux/man-pages/man3/readdir.3.html
+ */
+int openDelayedLogs(DelayedLogs *logs, const char *journal_path, long last_id) {
+    const char *dir = getenv("NORSEISH_DELAY_LOGS");
+    const char *state = getenv("XDG_STATE_HOME");
+    const char *home = getenv("HOME");
+    char base[PATH_MAX];
+    if (dir != NULL) {
+        snprintf(base, sizeof(base), "%s", dir);
+    } else if (state != NULL && state[0] == '/') {
+        snprintf(base, sizeof(base), "%s/norseish/jobs", state);
+    } else if (home != NULL && home[0] != '\0') {
+        snprintf(base, sizeof(base), "%s/.local/state/norseish/jobs", home);
     } else {
-        // Wrap around the history buffer
-        strcpy(history[history_count % MAX_HISTORY], command);
-        history_count++;
+        base[0] = '\0';
+    }
+    logs->dir[0] = '\0';
+    if (base[0] == '\0') {
+        return -1;
+    }
+
+    int length;
+    char journal[PATH_MAX];
+    if (journal_path != NULL) {
+        // FNV-1a of the absolute path, so the name is the same whatever the working directory
+        uint64_t hash = 14695981039346656037ULL;
+        const char *key = realpath(journal_path, journal) != NULL ? journal : journal_path;
+        for (const char *c = key; *c != '\0'; c++) {
+            hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+        }
+        length = snprintf(logs->dir, sizeof(logs->dir), "%s/journal-%016llx", base, (unsigned long long)hash);
+    } else {
+        char stamp[32];
+        time_t now = time(NULL);
+        struct tm local;
+        strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime_r(&now, &local));
+        length = snprintf(logs->dir, sizeof(logs->dir), "%s/shell-%s-%ld", base, stamp, (long)getpid());
+    }
+    if (length < 0 || (size_t)length >= sizeof(logs->dir)) {
+        fprintf(stderr, "delay: cannot keep job logs in %s: %s\n", base, strerror(ENAMETOOLONG));
+        logs->dir[0] = '\0';
+        return -1;
+    }
+
+    pthread_t thread;
+    if (makeDirectories(logs->dir) != 0 || pipe2(logs->wake_fd, O_CLOEXEC | O_NONBLOCK) != 0) {
+        fprintf(stderr, "delay: cannot keep job logs in %s: %s\n", logs->dir, strerror(errno));
+        logs->dir[0] = '\0';
+        return -1;
+    }
+    DIR *dir_stream = journal_path != NULL ? opendir(logs->dir) : NULL;
+    struct dirent *entry;
+    while (dir_stream != NULL && (entry = readdir(dir_stream)) != NULL) {
+        long id;
+        if (sscanf(entry->d_name, "job-%ld.log", &id) == 1 && id > last_id) {
+            unlinkat(dirfd(dir_stream), entry->d_name, 0);
+        }
     }
+    if (dir_stream != NULL) {
+        closedir(dir_stream);
+    }
+    if (pthread_create(&thread, NULL, delayedLogThread, logs) != 0) {
+        perror("pthread_create");
+        logs->dir[0] = '\0';
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
 }
 
 /**
- * @brief Displays the command history.
+ * @brief Starts a new stream into a job's log.
  *
- * This function iterates through the stored command history and prints each
- * command along with its index number to the standard output. If the history
- * contains more than 10 commands, it will only display the last 10 entries.
+ * @return The write end of the stream's pipe, for the job's standard output
+ * and error, or -1 if the job's output should go to the terminal (also when
+ * the stream cannot be set up).
  */
-void displayHistory() {
-    int start = 0;
-    if (history_count > 10) {
-        start = history_count - 10;
+static int startJobLog(DelayedLogs *logs, long id) {
+    if (logs->dir[0] == '\0') {
+        return -1;
     }
-    for (int i = start; i < history_count; i++) {
-        printf("  %d  %s\n", i + 1, history[i]);
+    int pipefd[2];
+    LogStream stream = {id, -1, -1, 0};
+    if (pipe2(pipefd, O_CLOEXEC) != 0) {
+        perror("delay: pipe");
+        return -1;
+    }
+    stream.pipe_fd = pipefd[0];
+    pthread_mutex_lock(&logs->mutex);
+    stream.log_fd = openJobLogFile(logs, id, &stream.size);
+    if (stream.log_fd < 0) {
+        fprintf(stderr, "delay: job %ld: cannot open log in %s: %s\n", id, logs->dir, strerror(errno));
+    }
+    if (logs->count == logs->capacity) {
+        int capacity = logs->capacity > 0 ? logs->capacity * 2 : 8;
+        LogStream *streams = realloc(logs->streams, capacity * sizeof(LogStream));
+        if (streams == NULL) {
+            pthread_mutex_unlock(&logs->mutex);
+            perror("delay: log");
+            if (stream.log_fd >= 0) {
+                close(stream.log_fd);
+            }
+            close(pipefd[0]);
+            close(pipefd[1]);
+            return -1;
+        }
+        logs->streams = streams;
+        logs->capacity = capacity;
     }
+    logs->streams[logs->count++] = stream;
+    pthread_mutex_unlock(&logs->mutex);
+    write(logs->wake_fd[1], "", 1);
+    return pipefd[1];
 }
 
 /**
- * @brief Expands wildcards in command arguments using globbing.
+ * @brief Executes a delayed command.
  *
- * This function takes an array of command arguments ('args') and expands any
- * arguments that contain wildcard characters (*, ?, []) using the 'glob'
- * function.  It dynamically allocates memory for the expanded arguments.
+ * The command is run like a command line typed at the prompt, at background
+ * priority unless it sets its own. Its standard input is /dev/null and its
+ * standard output and error go to the job's log (see 'DelayedLogs'), framed
+ * by a line giving the start time and command and one giving the exit status.
  *
- * @param args A null-terminated array of character pointers representing the
- * command arguments.
- * @param expanded_args A pointer to a pointer to an array of character pointers.
- * This will be updated to point to the dynamically allocated array of expanded
- * arguments.  It is the caller's responsibility to free this memory.
+ * @param id The job ID of the command.
+ * @param command A pointer to a null-terminated string representing the
+ * command to execute.
  *
- * @return The number of expanded arguments, or -1 on error.
- * @see https://man7.org/linux/man-pages/man3/glob.3.html
- * @see https://linux.die.net/man/3/globfree
+ * @return The exit status of the command.
  */
-int expandWildcards(char **args, char ***expanded_args) {
-    glob_t glob_result;
-    size_t num_expanded = 0;
-    *expanded_args = NULL;
+int executeDelayedCommand(long id, char *command) {
+    int log_fd = startJobLog(&delayed_logs, id);
+    if (log_fd >= 0) {
+        char stamp[32];
+        time_t now = time(NULL);
+        struct tm local;
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime_r(&now, &local));
+        dprintf(log_fd, "--- %s: %s\n", stamp, command);
+        job_stdin_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        job_output_fd = log_fd;
+    }
 
-    for (int i = 0; args[i] != NULL; i++) {
-        // Check if the argument contains any wildcard characters
-        if (strchr(args[i], '*') != NULL || strchr(args[i], '?') != NULL || strchr(args[i], '[') != NULL) {
-            // Perform globbing
-            int ret = glob(args[i], GLOB_NOCHECK | GLOB_TILDE, NULL, &glob_result);
-            if (ret == 0) {
-                // Success
-                for (size_t j = 0; j < glob_result.gl_pathc; j++) {
-                    // Add each expanded argument to the result
-                    char *new_arg = strdup(glob_result.gl_pathv[j]);
-                    if (new_arg == NULL) {
-                        perror("strdup");
-                        // Clean up already expanded arguments
-                        for (size_t k = 0; k < num_expanded; k++) {
-                            free((*expanded_args)[k]);
-                        }
-                        free(*expanded_args);
-                        globfree(&glob_result);
-                        return -1;
-                    }
-                    // Dynamically resize the expanded arguments array
-                    char **temp_expanded_args = realloc(*expanded_args, (num_expanded + 1) * sizeof(char *));
-                    if (temp_expanded_args == NULL) {
-                        perror("realloc");
-                        free(new_arg);
-                        for (size_t k = 0; k < num_expanded; k++) {
-                            free((*expanded_args)[k]);
-                        }
-                        free(*expanded_args);
-                        globfree(&glob_result);
-                        return -1;
-                    }
-                    *expanded_args = temp_expanded_args;
-                    (*expanded_args)[num_expanded++] = new_arg;
-                }
-            } else if (ret == GLOB_NOMATCH) {
-                // No matches found, keep the original argument
-                char *new_arg = strdup(args[i]);
-                if (new_arg == NULL)
-                {
-                    perror("strdup");
-                    return -1;
-                }
-                char **temp_expanded_args = realloc(*expanded_args, (num_expanded + 1) * sizeof(char *));
-                    if (temp_expanded_args == NULL) {
-                        perror("realloc");
-                        free(new_arg);
-                        for (size_t k = 0; k < num_expanded; k++) {
-                            free((*expanded_args)[k]);
-                        }
-                        free(*expanded_args);
-                        return -1;
-                    }
-                *expanded_args = temp_expanded_args;
-                (*expanded_args)[num_expanded++] = new_arg;
+    char *args[MAX_ARGS];
+    char *token;
+    char *save;
+    int i = 0;
+    // Delayed commands run on several worker threads at once
+    token = strtok_r(command, " ", &save);
+    while (token != NULL && i < MAX_ARGS - 1) {
+        args[i++] = token;
+        token = strtok_r(NULL, " ", &save);
+    }
+    args[i] = NULL;
+    // Check for background execution
+    int background = 0;
+    if (i > 0 && strcmp(args[i - 1], "&") == 0) {
+        background = 1;
+        i--; // Remove '&' from arguments
+        args[i] = NULL;
+    }
 
-            } else {
-                // Error during globbing
-                fprintf(stderr, "glob error: %d\n", ret);
-                globfree(&glob_result);
-                return -1;
-            }
-            globfree(&glob_result);
-        } else {
-            // No wildcard detected. We copy the original argument
-            char *new_arg = strdup(args[i]);
-             if (new_arg == NULL)
-                {
-                    perror("strdup");
-                    return -1;
-                }
-            char **temp_expanded_args = realloc(*expanded_args, (num_expanded + 1) * sizeof(char *));
-            if (temp_expanded_args == NULL) {
-                perror("realloc");
-                free(new_arg);
-                 for (size_t k = 0; k < num_expanded; k++) {
-                        free((*expanded_args)[k]);
-                    }
-                free(*expanded_args);
-                return -1;
-            }
-            *expanded_args = temp_expanded_args;
-            (*expanded_args)[num_expanded++] = new_arg;
+    SpawnAttributes attrs;
+    int skip = parseJobPrefixes(args, &attrs);
+    int code = 2;
+    if (skip >= 0) {
+        // Delayed jobs run at background priority unless they set their own
+        if (!attrs.priority.set) {
+            attrs.priority = background_priority;
         }
+        code = runCommandLine(args + skip, background, &attrs, NULL);
     }
 
-    char **temp_expanded_args = realloc(*expanded_args, (num_expanded + 1) * sizeof(char *));
-    if (temp_expanded_args == NULL)
-    {
-         perror("realloc");
-         for (size_t k = 0; k < num_expanded; k++) {
-                free((*expanded_args)[k]);
-            }
-        free(*expanded_args);
-        return -1;
+    if (log_fd >= 0) {
+        dprintf(log_fd, "--- exit status %d\n", code);
+        close(log_fd);
+        if (job_stdin_fd >= 0) {
+            close(job_stdin_fd);
+        }
+        job_stdin_fd = -1;
+        job_output_fd = -1;
     }
-    *expanded_args = temp_expanded_args;
-    (*expanded_args)[num_expanded] = NULL;
-    return num_expanded;
+    return code;
 }
 
-
 /**
- * @brief Thread function to process delayed commands.
+ * @brief Reads a whole file into a new buffer, appending it to 'data'.
  *
- * This function is executed by a separate thread. It continuously checks the
- * 'delayed_commands' queue for commands that are ready to be executed
- * (i.e., their scheduled time has arrived).  It uses a mutex and condition
- * variable for synchronization.
- *
- * @param arg A pointer to void, which is unused in this implementation.
- *
- * @return A pointer to void.  Returns NULL.
- * @see https://man7.org/linux/man-pages/man3/pthread_create.3.html
- * @see https://man7.org/linux/man-pages/man3/pthread_mutex_lock.3.html
- * @see https://man7.org/linux/man-pages/man3/pthread_cond_wait.3.html
- * @see https://man7.org/linux/man-pages/man3/pthread_mutex_unlock.3.html
- * @see https://man7.org/linux/man-pages/man3/pthread_self.3.html
+ * @return 0 on success (including a missing file), -1 on failure.
  */
-void *processDelayedCommands(void *arg) {
-    while (1) {
-        pthread_mutex_lock(&queue_mutex);
-        // If the queue is empty, wait until signaled.
-        while (delayed_command_count == 0) {
-            pthread_cond_wait(&queue_cond, &queue_mutex);
-        }
-        time_t now = time(NULL);
-        // Find the command with the earliest scheduled time.
-        int earliest_index = -1;
-        time_t earliest_time = now + 1;
-        for (int i = 0; i < delayed_command_count; i++) {
-            if (delayed_commands[i].scheduled_time <= now) {
-                earliest_index = i;
-                break; // Execute the first command that is ready
-            }
-            if (delayed_commands[i].scheduled_time < earliest_time) {
-                earliest_time = delayed_commands[i].scheduled_time;
-                earliest_index = i;
-            }
-        }
-        // If a command is ready to execute, execute it.
-        if (earliest_index != -1) {
-            DelayedCommand command_to_execute = delayed_commands[earliest_index];
-            // Remove the command from the queue.
-            if (earliest_index == 0) {
-                // If it's the first element, shift the array.
-                for (int i = 0; i < delayed_command_count - 1; i++) {
-                    delayed_commands[i] = delayed_commands[i + 1];
-                }
-            } else if (earliest_index == delayed_command_count - 1) {
-            // Do nothing.
-            } else {
-                for (int i = earliest_index; i < delayed_command_count - 1; i++) {
-                    delayed_commands[i] = delayed_commands[i + 1];
-                }
-            }
-            delayed_command_count--;
-            pthread_mutex_unlock(&queue_mutex);
-            // Execute command; make sure this is done outside the mutex lock.
-            executeDelayedCommand(command_to_execute.command);
-        } else {
-            // Calculate the time to wait until the next command is ready.
-            time_t now = time(NULL);
-            time_t time_to_wait = earliest_time - now;
-            if (time_to_wait > 0) {
-                // Use a timed wait.
-                struct timespec ts;
-                clock_gettime(CLOCK_REALTIME, &ts);
-                ts.tv_sec += time_to_wait;
-                pthread_cond_timedwait(&queue_cond, &queue_mutex, &ts);
-            }
-            pthread_mutex_unlock(&queue_mutex);
+static int appendFileContents(const char *path, char **data, size_t *length) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (fstat(fd, &st) != 0 || (*data = realloc(*data, *length + st.st_size + 1)) == NULL) {
+        close(fd);
+        return -1;
+    }
+    ssize_t n;
+    while ((n = read(fd, *data + *length, st.st_size)) > 0) {
+        *length += n;
+        st.st_size -= n;
+        if (st.st_size == 0) {
+            break;
         }
     }
-    return NULL;
+    close(fd);
+    return n < 0 ? -1 : 0;
 }
-    
 
 /**
- * @brief Adds a command to the delayed command queue.
+ * @brief Implements the 'delaylog' built-in command.
  *
- * This function adds a command to the 'delayed_commands' queue to be executed
- * at a later time. It stores the command and its scheduled execution time.
- * It uses a mutex to protect access to the queue and signals a condition
- * variable to wake up the thread that processes the queue.
+ * Usage:
+ * delaylog [-n lines] <id>
+ * delaylog [--size BYTES[K|M|G]] [--keep N]
  *
- * @param scheduled_time The time at which the command should be executed,
- * represented as a 'time_t' value.
- * @param command A pointer to a null-terminated string representing the
- * command to be executed.
- * @see https://man7.org/linux/man-pages/man3/pthread_mutex_lock.3.html
- * @see https://man7.org/linux/man-pages/man3/pthread_mutex_unlock.3.html
- * @see https://man7.org/linux/man-pages/man3/pthread_cond_signal.3.html
+ * The first form prints the last lines (10 by default) of the output of
+ * delayed job 'id', reaching back into its newest rotated log if needed. The
+ * second sets how large a log grows before it is rotated and how many
+ * rotated logs are kept, then prints the log settings.
+ *
+ * @param args The arguments of the command, starting with "delaylog".
+ *
+ * @return 0 on success, 1 if there is no log, 2 on a usage error.
  */
-void addDelayedCommand(time_t scheduled_time, const char *command) {
-    pthread_mutex_lock(&queue_mutex);
-    if (delayed_command_count < MAX_DELAYED_COMMANDS) {
-        // Find the correct position to insert the new command, maintaining sorted order.
-        int i;
-        for (i = 0; i < delayed_command_count; i++) {
-            if (scheduled_time < delayed_commands[i].scheduled_time) {
-                break;
+int delaylogCommand(char **args) {
+    DelayedLogs *logs = &delayed_logs;
+    long lines = 10;
+    long id = 0;
+    off_t max_size = logs->max_size;
+    int keep = logs->keep;
+    int settings = 0;
+    for (int j = 1; args[j] != NULL; j++) {
+        char *end = NULL;
+        if (strcmp(args[j], "-n") == 0 && args[j + 1] != NULL) {
+            lines = strtol(args[++j], &end, 10);
+        } else if (strcmp(args[j], "--size") == 0 && args[j + 1] != NULL) {
+            double size = strtod(args[++j], &end);
+            int shift = *end == 'K' ? 10 : *end == 'M' ? 20 : *end == 'G' ? 30 : 0;
+            end += shift != 0;
+            max_size = (off_t)(size * ((off_t)1 << shift));
+            settings = 1;
+        } else if (strcmp(args[j], "--keep") == 0 && args[j + 1] != NULL) {
+            keep = strtol(args[++j], &end, 10);
+            settings = 1;
+        } else if (id == 0) {
+            id = strtol(args[j], &end, 10);
+        }
+        if (end == NULL || *end != '\0' || lines < 0 || max_size <= 0 || keep < 0 || id < 0) {
+            fprintf(stderr, "Usage: delaylog [-n lines] <id> | delaylog [--size BYTES[K|M|G]] [--keep N]\n");
+            return 2;
+        }
+    }
+
+    if (id == 0) {
+        pthread_mutex_lock(&logs->mutex);
+        logs->max_size = max_size;
+        logs->keep = keep;
+        int active = logs->count;
+        pthread_mutex_unlock(&logs->mutex);
+        if (!settings) {
+            if (logs->dir[0] == '\0') {
+                printf("delayed job output: terminal\n");
+            } else {
+                printf("delayed job logs: %s/job-<id>.log\n", logs->dir);
             }
+            printf("rotated at %lld bytes, %d old log(s) kept, %d job(s) writing\n",
+                   (long long)max_size, keep, active);
         }
-        // Shift existing commands to make space for the new one.
-        for (int j = delayed_command_count; j > i; j--) {
-            delayed_commands[j] = delayed_commands[j - 1];
+        return 0;
+    }
+    if (logs->dir[0] == '\0') {
+        fprintf(stderr, "delaylog: delayed job output is not being logged\n");
+        return 1;
+    }
+
+    // The newest rotated log, then the current one
+    char path[PATH_MAX];
+    char *data = NULL;
+    size_t length = 0;
+    int status = jobLogPath(logs, id, 1, path, sizeof(path));
+    if (status == 0) {
+        status = appendFileContents(path, &data, &length);
+    }
+    if (status == 0) {
+        status = jobLogPath(logs, id, 0, path, sizeof(path));
+    }
+    if (status == 0) {
+        status = appendFileContents(path, &data, &length);
+    }
+    if (status != 0 || length == 0) {
+        if (status != 0) {
+            perror(path);
+        } else {
+            fprintf(stderr, "delaylog: no output logged for job %ld\n", id);
         }
-        delayed_commands[i].scheduled_time = scheduled_time;
-        strcpy(delayed_commands[i].command, command);
-        delayed_command_count++;
-        // Signal the worker thread that a new command has been added.
-        pthread_cond_signal(&queue_cond);
-    } else {
-        fprintf(stderr, "Delayed command queue is full.\n");
+        free(data);
+        return 1;
+    }
+    size_t start = length;
+    if (data[length - 1] == '\n') {
+        start--;
+    }
+    for (long n = 0; start > 0; start--) {
+        if (data[start - 1] == '\n' && ++n == lines) {
+            break;
+        }
+    }
+    if (lines > 0) {
+        fwrite(data + start, 1, length - start, stdout);
     }
-    pthread_mutex_unlock(&queue_mutex);
+    free(data);
+    return 0;
 }
 
 /**
- * @brief Executes a delayed command.
+ * @brief Records the exit status of a built-in command.
  *
- * This function executes the given command using the 'system' function.
- * It also adds the command to the command history.
+ * Built-ins do not go through 'runCommandLine', so this updates '$?' and
+ * 'PIPESTATUS' as if a single-stage pipeline had run.
  *
- * @param command A pointer to a null-terminated string representing the
- * command to execute.
- * @see https://man7.org/linux/man-pages/man3/system.3.html
+ * @param code The exit status of the built-in.
  */
-void executeDelayedCommand(char *command) {
-        char *args[MAX_ARGS];
-        char *token;
-        int i = 0;
-        token = strtok(command, " ");
-        while (token != NULL && i < MAX_ARGS - 1) {
-             args[i++] = token;
-             token = strtok(NULL, " ");
-        }
-        args[i] = NULL;
-        // Check for background execution
-         int background = 0;
-         if (i > 0 && strcmp(args[i - 1], "&") == 0) {
-             background = 1;
-         i--; // Remove '&' from arguments
-         args[i] = NULL;
-         }
-
-         int numCommands = 1;
-         for (int j = 0; j < i; j++) {
-             if (strcmp(args[j], "|") == 0)
-                 numCommands++;
-             }
-         if (numCommands > 1) {
-             handlePipes(args, numCommands, background);
-         } else {
-         executeCommand(args, background);
-         }
-    }    
+void recordBuiltinStatus(int code) {
+    last_exit_status = code;
+    last_pipeline.count = 1;
+    last_pipeline.status[0] = code;
+}
 
 /**
  * @brief The main entry point for the Norseish shell.
  *
  * This function initializes the shell, displays a welcome message,
  * and enters the main loop for processing user commands.
- * It handles built-in commands such as 'exit', 'cd', 'history', and 'delay',
- * as well as external commands, pipes, and background execution.
+ * It handles built-in commands such as 'exit', 'cd', 'history', 'set' and
+ * 'delay', as well as external commands, pipes, and background execution.
  * Signal handling is set up to ignore interrupt, quit, and stop signals,
  * and to handle child process termination. A separate thread is created
  * to process delayed commands.
  *
- * @return 0 if the shell exits normally.
+ * If a script path is given, or standard input is not a terminal, commands
+ * are read line by line from the script instead (blank lines and lines
+ * starting with '#' are skipped) and the title screen is not shown.
+ *
+ * After every command line the exit status is stored in '$?' and
+ * 'PIPESTATUS'; with 'set -e' the shell exits as soon as one fails.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments; 'argv[1]' is an optional script.
+ *
+ * @return The exit status of the last command line (or the 'exit' argument).
  */
-int main() {
-    titleScreen();
+int main(int argc, char *argv[]) {
+    FILE *script = NULL;
+    const char *script_path = NULL;
+    const char *env_fork_server = getenv("NORSEISH_FORK_SERVER");
+    int use_fork_server = env_fork_server != NULL && env_fork_server[0] != '\0'
+                          && strcmp(env_fork_server, "0") != 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--fork-server") == 0) {
+            use_fork_server = 1;
+        } else if (script_path == NULL) {
+            script_path = argv[i];
+        }
+    }
+    if (script_path != NULL) {
+        script = fopen(script_path, "r");
+        if (script == NULL) {
+            perror(script_path);
+            return 127;
+        }
+    } else if (!isatty(STDIN_FILENO)) {
+        script = stdin;
+    }
+
+    char line[MAX_COMMAND_LENGTH];
     char command[MAX_COMMAND_LENGTH];
     char *args[MAX_ARGS];
     char *token;
-    printf("Welcome to John and Jack's Seashell.\n");
-    printf("Type 'exit' to leave the shell.\n");
+    if (script == NULL) {
+        titleScreen();
+        printf("Welcome to John and Jack's Seashell.\n");
+        printf("Type 'exit' to leave the shell.\n");
+    }
 
     // Signal handling for the shell process itself.
     signal(SIGINT, SIG_IGN); // Ignore Ctrl+C
     signal(SIGQUIT, SIG_IGN); // ignore Ctrl+backslash
     signal(SIGTSTP, SIG_IGN); // Ignore Ctrl+Z
-    signal(SIGCHLD, SIG_DFL); // Clean up zombie processes
+    signal(SIGCHLD, SIG_DFL); // Children are reaped explicitly (see reapBackgroundJobs)
 
-    if (pthread_create(&delayed_commands_thread, NULL, processDelayedCommands, NULL) != 0) {
+    // The fork server must start before any thread exists
+    shell_umask = umask(0);
+    umask(shell_umask);
+    if (use_fork_server) {
+        startForkServer();
+    }
+
+    initDelayedQueue(&delayed_queue);
+    const char *env_workers = getenv("NORSEISH_DELAY_WORKERS");
+    int delay_workers = env_workers != NULL ? atoi(env_workers) : 0;
+    setDelayedWorkers(&delayed_queue, delay_workers > 0 ? delay_workers : DEFAULT_DELAY_WORKERS);
+    const char *journal_path = getenv("NORSEISH_JOURNAL");
+    if (journal_path != NULL && journal_path[0] != '\0') {
+        const char *missed = getenv("NORSEISH_JOURNAL_MISSED");
+        openDelayedJournal(&delayed_queue, journal_path, missed == NULL || strcmp(missed, "skip") != 0);
+    }
+    openDelayedLogs(&delayed_logs, delayed_queue.journal != NULL ? delayed_queue.journal->path : NULL, delayed_queue.next_id);
+    if (pthread_create(&delayed_commands_thread, NULL, processDelayedCommands, &delayed_queue) != 0) {
         perror("pthread_create");
         exit(1);
     }
 
     while (1) {
-        if (readLine("Norseish> ", command, sizeof(command)) <= 0) {
+        // set -e: stop at the first command line that failed
+        if (errexit_enabled && last_exit_status != 0) {
+            break;
+        }
+
+        reapBackgroundJobs();
+
+        if (script != NULL) {
+            if (fgets(line, sizeof(line), script) == NULL) {
+                break;
+            }
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] == '#') {
+                continue;
+            }
+        } else if (readLine("Norseish> ", line, sizeof(line)) <= 0) {
             printf("\n");
             break;
         }
 
-        if (command[0] == '\0') {
+        if (line[0] == '\0') {
             continue;
         }
 
-        addToHistory(command);
+        addToHistory(line);
 
+        expandStatusVariables(line, command, sizeof(command));
         removeQuotes(command);
 
         // Tokenize the command string into arguments
         int i = 0;
-        token = strtok(command, " ");
+        char *save;
+        token = strtok_r(command, " ", &save);
         while (token != NULL && i < MAX_ARGS - 1) {
             args[i++] = token;
-            token = strtok(NULL, " ");
+            token = strtok_r(NULL, " ", &save);
         }
         args[i] = NULL;
 
@@ -1415,32 +9280,132 @@ int main() {
             continue;
         }
 
-        // Delayed commands (main logic)
-        if (strcmp(args[0], "delay") == 0) {
-            if (i < 3) {
-                fprintf(stderr, "Usage: delay <seconds> <command>\n");
-                continue;
-            }
-            int delay_seconds = atoi(args[1]);
-            if (delay_seconds <= 0) {
-                fprintf(stderr, "delay: Invalid number of seconds\n");
+        // time keyword: run the rest of the line and report its resource usage
+        int timed = 0;
+        if (strcmp(args[0], "time") == 0) {
+            timed = 1;
+            memmove(args, args + 1, i * sizeof(char *));
+            i--;
+            if (i == 0) {
+                fprintf(stderr, "Usage: time <command> [| <command>...]\n");
+                recordBuiltinStatus(2);
                 continue;
             }
-            
-            char delayed_command[MAX_COMMAND_LENGTH];
-            strcpy(delayed_command, args[2]);
-            for (int j = 3; j < i; j++) {
-                strcat(delayed_command, " ");
-                strcat(delayed_command, args[j]);
+        }
+
+        // cpus on its own: show the CPUs jobs may be placed on
+        if (strcmp(args[0], "cpus") == 0 && i == 1) {
+            cpu_set_t allowed;
+            if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+                printf("allowed CPUs:");
+                for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                    if (CPU_ISSET(cpu, &allowed)) {
+                        printf(" %d", cpu);
+                    }
+                }
+                printf("\n");
             }
-            time_t scheduled_time = time(NULL) + delay_seconds;
-            addDelayedCommand(scheduled_time, delayed_command);
+            recordBuiltinStatus(0);
+            continue;
+        }
+
+        // Job prefixes (prio, cpus): per-job attributes for the rest of the line
+        SpawnAttributes attrs;
+        int skip = parseJobPrefixes(args, &attrs);
+        if (skip < 0) {
+            recordBuiltinStatus(2);
+            continue;
+        }
+        memmove(args, args + skip, (i - skip + 1) * sizeof(char *));
+        i -= skip;
+        if (background && !attrs.priority.set) {
+            attrs.priority = background_priority;
+        }
+
+        // Delayed commands (main logic)
+        if (strcmp(args[0], "delay") == 0 || strcmp(args[0], "batch") == 0) {
+            recordBuiltinStatus(delayCommand(args));
+            continue;
+        }
+
+        // Recurring commands
+        if (strcmp(args[0], "every") == 0 || strcmp(args[0], "cron") == 0) {
+            recordBuiltinStatus(recurringCommand(args));
+            continue;
+        }
+
+        // Delayed queue listing, cancellation and rescheduling
+        if (strcmp(args[0], "delayq") == 0) {
+            recordBuiltinStatus(delayqCommand(args));
+            continue;
+        }
+        if (strcmp(args[0], "delayrm") == 0) {
+            recordBuiltinStatus(delayrmCommand(args));
+            continue;
+        }
+        if (strcmp(args[0], "delaymv") == 0) {
+            recordBuiltinStatus(delaymvCommand(args));
+            continue;
+        }
+
+        // batchload command (when batch commands may start)
+        if (strcmp(args[0], "batchload") == 0) {
+            recordBuiltinStatus(batchloadCommand(args));
+            continue;
+        }
+
+        // delayqueue command (named queues and their concurrency limits)
+        if (strcmp(args[0], "delayqueue") == 0) {
+            recordBuiltinStatus(delayqueueCommand(args));
+            continue;
+        }
+
+        // delaybench command (scheduler stress benchmark)
+        if (strcmp(args[0], "delaybench") == 0) {
+            recordBuiltinStatus(delaybenchCommand(args));
+            continue;
+        }
+
+        // delaystats command (scheduler metrics)
+        if (strcmp(args[0], "delaystats") == 0) {
+            recordBuiltinStatus(delaystatsCommand(args));
+            continue;
+        }
+
+        // delaylog command (output of delayed jobs)
+        if (strcmp(args[0], "delaylog") == 0) {
+            recordBuiltinStatus(delaylogCommand(args));
+            continue;
+        }
+
+        // delayworkers command (size of the delayed command worker pool)
+        if (strcmp(args[0], "delayworkers") == 0) {
+            recordBuiltinStatus(delayworkersCommand(args));
             continue;
         }
 
         // History command
         if (strcmp(args[0], "history") == 0) {
             displayHistory();
+            recordBuiltinStatus(0);
+            continue;
+        }
+
+        // set command (shell options)
+        if (strcmp(args[0], "set") == 0) {
+            recordBuiltinStatus(setOptions(args));
+            continue;
+        }
+
+        // ulimit command
+        if (strcmp(args[0], "ulimit") == 0) {
+            recordBuiltinStatus(ulimitCommand(args));
+            continue;
+        }
+
+        // bgprio command (default priority of background and delayed jobs)
+        if (strcmp(args[0], "bgprio") == 0) {
+            recordBuiltinStatus(bgprioCommand(args));
             continue;
         }
 
@@ -1449,25 +9414,22 @@ int main() {
         int num_expanded_args = expandWildcards(args, &expanded_args);
         if (num_expanded_args < 0) {
             fprintf(stderr, "Error: Wildcard expansion failed.\n");
+            recordBuiltinStatus(1);
             continue;
         }
 
         // exit command
         if (strcmp(expanded_args[0], "exit") == 0) {
+            if (expanded_args[1] != NULL) {
+                last_exit_status = atoi(expanded_args[1]) & 0xff;
+            }
             for (int j = 0; j < num_expanded_args; j++) {
                 free(expanded_args[j]);
             }
             free(expanded_args);
-            if (pthread_cancel(delayed_commands_thread) != 0) {
-                perror("pthread_cancel");
-            }
-            // Join the delayed commands thread to ensure it has terminated
-            if (pthread_join(delayed_commands_thread, NULL) != 0) {
-                perror("pthread_join");
+            if (script == NULL) {
+                printf("Thank you for using the shell!\n");
             }
-            pthread_mutex_destroy(&queue_mutex);
-            pthread_cond_destroy(&queue_cond);
-            printf("Thank you for using the shell!\n");
             break;
         }
 
@@ -1477,6 +9439,7 @@ int main() {
             char expandedPath[MAX_COMMAND_LENGTH];
             if (expanded_args[1] == NULL) {
                 fprintf(stderr, "cd: missing argument\n");
+                recordBuiltinStatus(1);
                 // Free allocated memory
                 for (int j = 0; j < num_expanded_args; j++) {
                     free(expanded_args[j]);
@@ -1487,6 +9450,7 @@ int main() {
                 targetDir = getenv("HOME");
                 if (targetDir == NULL) {
                     fprintf(stderr, "cd: Your HOME environment is not set!\n");
+                    recordBuiltinStatus(1);
                     // Free allocated memory
                     for (int j = 0; j < num_expanded_args; j++) {
                         free(expanded_args[j]);
@@ -1498,6 +9462,7 @@ int main() {
                 char *home = getenv("HOME");
                 if (home == NULL) {
                     fprintf(stderr, "cd: HOME environment variable not set\n");
+                    recordBuiltinStatus(1);
                     // Free allocated memory
                     for (int j = 0; j < num_expanded_args; j++) {
                         free(expanded_args[j]);
@@ -1512,7 +9477,7 @@ int main() {
                 targetDir = expanded_args[1];
             }
             if (targetDir != NULL) {
-                cd(targetDir);
+                recordBuiltinStatus(cd(targetDir));
             }
             for (int j = 0; j < num_expanded_args; j++) {
                 free(expanded_args[j]);
@@ -1521,16 +9486,39 @@ int main() {
             continue; // Go to the next iteration of the loop
         }
 
-        int numCommands = 1;
-        for (int j = 0; j < num_expanded_args; j++) {
-            if (strcmp(expanded_args[j], "|") == 0)
-                numCommands++;
+        // timeout command
+        if (strcmp(expanded_args[0], "timeout") == 0) {
+            recordBuiltinStatus(timeoutCommand(expanded_args, background, &attrs));
+            for (int j = 0; j < num_expanded_args; j++) {
+                free(expanded_args[j]);
+            }
+            free(expanded_args);
+            continue;
+        }
+
+        // bench command
+        if (strcmp(expanded_args[0], "bench") == 0) {
+            recordBuiltinStatus(benchCommand(expanded_args));
+            for (int j = 0; j < num_expanded_args; j++) {
+                free(expanded_args[j]);
+            }
+            free(expanded_args);
+            continue;
+        }
+
+        // parallel command
+        if (strcmp(expanded_args[0], "parallel") == 0) {
+            recordBuiltinStatus(parallelCommand(expanded_args, &attrs));
+            for (int j = 0; j < num_expanded_args; j++) {
+                free(expanded_args[j]);
+            }
+            free(expanded_args);
+            continue;
         }
 
-        // Handle pipes
-        if (numCommands > 1) {
-            handlePipes(expanded_args, numCommands, background);
-            // Free allocated memory
+        // forkserver command
+        if (strcmp(expanded_args[0], "forkserver") == 0) {
+            recordBuiltinStatus(forkserverCommand(expanded_args));
             for (int j = 0; j < num_expanded_args; j++) {
                 free(expanded_args[j]);
             }
@@ -1538,7 +9526,14 @@ int main() {
             continue;
         }
 
-        executeCommand(expanded_args, background);
+        // External commands and pipelines
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        last_exit_status = runCommandLine(expanded_args, background, &attrs, &last_pipeline);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (timed) {
+            printTimingReport(expanded_args, &start, &end, &last_pipeline);
+        }
 
         for (int j = 0; j < num_expanded_args; j++) {
             free(expanded_args[j]);
@@ -1546,7 +9541,19 @@ int main() {
         free(expanded_args);
     }
 
-    pthread_mutex_destroy(&queue_mutex);
-    pthread_cond_destroy(&queue_cond);
-    return 0;
-}
\ No newline at end of file
+    if (pthread_cancel(delayed_commands_thread) != 0) {
+        perror("pthread_cancel");
+    }
+    // Join the delayed commands thread to ensure it has terminated
+    if (pthread_join(delayed_commands_thread, NULL) != 0) {
+        perror("pthread_join");
+    }
+    closeDelayedJournal(&delayed_queue);
+    pthread_mutex_destroy(&delayed_queue.mutex);
+    pthread_cond_destroy(&delayed_queue.cond);
+    stopForkServer();
+    if (script != NULL && script != stdin) {
+        fclose(script);
+    }
+    return last_exit_status;
+}